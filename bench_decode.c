@@ -0,0 +1,379 @@
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/avutil.h>
+#include <libavutil/common.h>
+#include <libavutil/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "decode_options.h"
+#include "gop_decoder.h"
+#include "json_util.h"
+#include "media_input.h"
+
+typedef struct _DecodeResult
+{
+  int64_t frames;
+  int64_t elapsed;
+  // Part of elapsed spent finding the split points, gop mode only.
+  int64_t scan_time;
+} DecodeResult;
+
+typedef struct _BenchResult
+{
+  const char* filename;
+  const char* codec_name;
+  // "threads" for one decoder with thread_count threads, "gop" for
+  // thread_count single-threaded decoders on ranges of the file.
+  const char* mode;
+  int thread_count;
+  int thread_type;
+  int runs;
+  DecodeResult total;
+  // fps relative to one thread.
+  double speedup;
+} BenchResult;
+
+// Decodes every frame of the first video stream, timed from the first
+// packet to the last frame out of the flushed decoder.
+static int run_decode(const char* filename, const InputOptions* input_options,
+                      const DecodeOptions* options, DecodeResult* result, const char** codec_name)
+{
+  AVFormatContext* fmt_ctx = NULL;
+  AVCodecContext* codec_ctx = NULL;
+  AVFrame* frame = NULL;
+  AVPacket pkt;
+  int64_t start_time;
+  int stream_index;
+  int ret = -1;
+
+  if(open_media_input(&fmt_ctx, filename, input_options, NULL) < 0)
+  {
+    printf("Could not open input file %s\n", filename);
+    return -1;
+  }
+
+  stream_index = open_best_decoder(fmt_ctx, AVMEDIA_TYPE_VIDEO, options, &codec_ctx);
+  frame = av_frame_alloc();
+  if(stream_index < 0 || frame == NULL)
+  {
+    goto run_end;
+  }
+  *codec_name = codec_ctx->codec->name;
+
+  result->frames = 0;
+  result->scan_time = 0;
+  start_time = av_gettime_relative();
+
+  while(1)
+  {
+    if(av_read_frame(fmt_ctx, &pkt) >= 0)
+    {
+      if(pkt.stream_index != stream_index)
+      {
+        av_packet_unref(&pkt);
+        continue;
+      }
+
+      ret = avcodec_send_packet(codec_ctx, &pkt);
+      av_packet_unref(&pkt);
+    }
+    else
+    {
+      // A NULL packet flushes the frames the threads still hold.
+      ret = avcodec_send_packet(codec_ctx, NULL);
+    }
+
+    if(ret < 0)
+    {
+      break;
+    }
+
+    while((ret = avcodec_receive_frame(codec_ctx, frame)) >= 0)
+    {
+      result->frames++;
+      av_frame_unref(frame);
+    } // while
+
+    if(ret == AVERROR_EOF)
+    {
+      ret = 0;
+      break;
+    }
+    else if(ret != AVERROR(EAGAIN))
+    {
+      break;
+    }
+  } // while
+
+  result->elapsed = av_gettime_relative() - start_time;
+
+run_end:
+  av_frame_free(&frame);
+  avcodec_free_context(&codec_ctx);
+  close_media_input(&fmt_ctx);
+
+  return ret;
+}
+
+static int count_frame(void* opaque, AVFrame* frame)
+{
+  (*(int64_t*)opaque)++;
+  return 0;
+}
+
+// Same as run_decode(), with the file split at closed GOPs over nb_workers
+// decoders. The pass that finds the split points reads the file once more,
+// so it is timed too, like the reads of run_decode().
+static int run_gop_decode(const char* filename, const InputOptions* input_options,
+                          int nb_workers, DecodeResult* result)
+{
+  DecodeOptions options;
+  GopDecodeStats stats;
+  int ret;
+
+  init_decode_options(&options);
+  options.thread_count = 1;
+
+  result->frames = 0;
+  result->scan_time = 0;
+  ret = gop_decode_file(filename, input_options, &options, nb_workers,
+    count_frame, &result->frames, &stats);
+  result->scan_time = stats.scan_time;
+  result->elapsed = stats.scan_time + stats.decode_time;
+
+  return ret;
+}
+
+// 1, 2, 4, ... and max_threads last, 0 after it.
+static int next_thread_count(int threads, int max_threads)
+{
+  if(threads >= max_threads)
+  {
+    return 0;
+  }
+
+  return FFMIN(threads * 2, max_threads);
+}
+
+static double frames_per_sec(const DecodeResult* total)
+{
+  return total->elapsed > 0 ? total->frames * 1000000.0 / total->elapsed : 0.0;
+}
+
+static void add_result(BenchResult* result, const char* filename, const char* codec_name,
+                       const char* mode, int threads, int thread_type, int runs,
+                       const DecodeResult* total, double base_fps)
+{
+  result->filename = filename;
+  result->codec_name = codec_name;
+  result->mode = mode;
+  result->thread_count = threads;
+  result->thread_type = thread_type;
+  result->runs = runs;
+  result->total = *total;
+  result->speedup = base_fps > 0 ? frames_per_sec(total) / base_fps : 0.0;
+
+  printf("%-8s %3d threads %-5s %-7s %10.1f fps %6.2fx  %s\n",
+    codec_name, threads, thread_type_name(thread_type), mode, frames_per_sec(total),
+    result->speedup, filename);
+}
+
+// Runs filename with 1, 2, 4, ... threads up to max_threads, and appends one
+// result per thread count. With gop, also with as many GOP split decoders,
+// so that both scale against the same single-threaded run.
+static int bench_file(const char* filename, int runs, int max_threads, int thread_type,
+                      int gop, BenchResult* results)
+{
+  InputOptions input_options;
+  DecodeOptions options;
+  DecodeResult result, total;
+  const char* codec_name = "";
+  double base_fps = 0.0;
+  int nb_results = 0;
+  int threads, run;
+
+  init_input_options(&input_options);
+  init_decode_options(&options);
+  options.thread_type = thread_type;
+
+  for(threads = 1; threads > 0; threads = next_thread_count(threads, max_threads))
+  {
+    options.thread_count = threads;
+    memset(&total, 0, sizeof(total));
+
+    for(run = 0; run < runs; run++)
+    {
+      if(run_decode(filename, &input_options, &options, &result, &codec_name) < 0)
+      {
+        break;
+      }
+
+      total.frames += result.frames;
+      total.elapsed += result.elapsed;
+      total.scan_time += result.scan_time;
+    } // for
+
+    if(run < runs)
+    {
+      break;
+    }
+
+    if(threads == 1)
+    {
+      base_fps = frames_per_sec(&total);
+    }
+
+    add_result(&results[nb_results++], filename, codec_name, "threads", threads, thread_type,
+      runs, &total, base_fps);
+
+    if(!gop || threads == 1)
+    {
+      continue;
+    }
+
+    memset(&total, 0, sizeof(total));
+    for(run = 0; run < runs; run++)
+    {
+      if(run_gop_decode(filename, &input_options, threads, &result) < 0)
+      {
+        break;
+      }
+
+      total.frames += result.frames;
+      total.elapsed += result.elapsed;
+      total.scan_time += result.scan_time;
+    } // for
+
+    if(run == runs)
+    {
+      add_result(&results[nb_results++], filename, codec_name, "gop", threads, thread_type,
+        runs, &total, base_fps);
+    }
+  } // for
+
+  return nb_results;
+}
+
+// Averages per run, so that results of different builds compare directly.
+static int write_results(const char* path, const BenchResult* results, int nb_results)
+{
+  FILE* fp;
+  int index;
+
+  fp = fopen(path, "w");
+  if(fp == NULL)
+  {
+    printf("Could not create %s\n", path);
+    return -1;
+  }
+
+  fprintf(fp, "{\"ffmpeg\":");
+  json_write_string(fp, av_version_info());
+  fprintf(fp, ",\"libavcodec\":%u,\"cpus\":%ld,\"timestamp\":%" PRId64 ",\n  \"results\":[\n",
+    avcodec_version(), sysconf(_SC_NPROCESSORS_ONLN), (int64_t)time(NULL));
+
+  for(index = 0; index < nb_results; index++)
+  {
+    const BenchResult* result = &results[index];
+    const DecodeResult* total = &result->total;
+
+    fprintf(fp, "    {\"file\":");
+    json_write_string(fp, result->filename);
+    fprintf(fp, ",\"codec\":");
+    json_write_string(fp, result->codec_name);
+    fprintf(fp, ",\"mode\":");
+    json_write_string(fp, result->mode);
+    fprintf(fp, ",\"threads\":%d,\"thread_type\":", result->thread_count);
+    json_write_string(fp, thread_type_name(result->thread_type));
+    fprintf(fp, ",\"runs\":%d,\"frames\":%" PRId64 ",\"fps\":%.1f,\"speedup\":%.3f,\"elapsed_ms\":%.3f,\"scan_ms\":%.3f}%s\n",
+      result->runs, total->frames / result->runs, frames_per_sec(total), result->speedup,
+      total->elapsed / 1000.0 / result->runs, total->scan_time / 1000.0 / result->runs,
+      index + 1 < nb_results ? "," : "");
+  } // for
+
+  fprintf(fp, "  ]}\n");
+  fclose(fp);
+
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  const char* results_path = NULL;
+  BenchResult* results;
+  int thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  int nb_results = 0, max_results;
+  int runs = 3;
+  int gop = 0;
+  int opt, index;
+
+  while((opt = getopt(argc, argv, "r:T:Y:Go:")) != -1)
+  {
+    switch(opt)
+    {
+    case 'r':
+      runs = atoi(optarg);
+      break;
+    case 'T':
+      max_threads = atoi(optarg);
+      break;
+    case 'Y':
+      if(parse_thread_type(optarg, &thread_type) < 0)
+      {
+        optind = argc + 1;
+      }
+      break;
+    case 'G':
+      gop = 1;
+      break;
+    case 'o':
+      results_path = optarg;
+      break;
+    default:
+      optind = argc + 1;
+      break;
+    }
+  } // while
+
+  if(optind >= argc || runs < 1 || max_threads < 1)
+  {
+    printf("usage : %s [-r runs] [-T max_threads] [-Y frame|slice|auto] [-G] [-o results.json] <input>...\n", argv[0]);
+    printf("        decodes the video of every input with 1, 2, 4, ... max_threads threads\n");
+    printf("        -G also splits it at closed GOPs over as many single-threaded decoders\n");
+    return 0;
+  }
+
+  av_log_set_level(AV_LOG_ERROR);
+
+  // log2(max_threads) + 2 thread counts per input at most, each twice with -G.
+  for(max_results = 2, index = max_threads; index > 1; index /= 2)
+  {
+    max_results++;
+  }
+  max_results *= gop ? 2 : 1;
+
+  results = calloc((argc - optind) * max_results, sizeof(BenchResult));
+  if(results == NULL)
+  {
+    return -1;
+  }
+
+  for(index = optind; index < argc; index++)
+  {
+    nb_results += bench_file(argv[index], runs, max_threads, thread_type, gop, results + nb_results);
+  }
+
+  if(results_path != NULL)
+  {
+    write_results(results_path, results, nb_results);
+  }
+
+  free(results);
+
+  return 0;
+}
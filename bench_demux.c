@@ -0,0 +1,587 @@
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavutil/avutil.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "json_util.h"
+#include "media_input.h"
+
+typedef struct _IOMode
+{
+  const char* name;
+  enum InputIOMode io_mode;
+} IOMode;
+
+typedef struct _DemuxResult
+{
+  int64_t packets;
+  int64_t bytes;
+  int64_t probe_time;
+  int64_t elapsed;
+} DemuxResult;
+
+typedef struct _BenchResult
+{
+  const char* filename;
+  const char* io_name;
+  int runs;
+  DemuxResult total;
+} BenchResult;
+
+// Synthetic inputs, written by -g into the given directory.
+typedef struct _MediaSpec
+{
+  const char* extension;
+  int64_t video_bit_rate;
+} MediaSpec;
+
+typedef struct _Generator
+{
+  AVFilterGraph* filter_graph;
+  AVFilterContext* v_sink_ctx;
+  AVFilterContext* a_sink_ctx;
+  AVFormatContext* fmt_ctx;
+  AVCodecContext* v_codec_ctx;
+  AVCodecContext* a_codec_ctx;
+} Generator;
+
+static const IOMode io_modes[] =
+{
+  { "default", INPUT_IO_DEFAULT },
+  { "mmap", INPUT_IO_MMAP },
+  { "readahead", INPUT_IO_READAHEAD },
+};
+
+static const MediaSpec media_specs[] =
+{
+  { "mp4", 1000000 },
+  { "mp4", 8000000 },
+  { "mkv", 1000000 },
+  { "mkv", 8000000 },
+  { "ts", 1000000 },
+  { "ts", 8000000 },
+};
+
+static const int gen_width = 1280;
+static const int gen_height = 720;
+static const int gen_frame_rate = 25;
+static const int gen_sample_rate = 48000;
+static const int gen_abit_rate = 192000;
+
+// open_input() and the av_read_frame() loop of sample02_demuxing, timed.
+static int run_demux(const char* filename, const InputOptions* options, DemuxResult* result)
+{
+  AVFormatContext* fmt_ctx = NULL;
+  ProbeStats probe_stats;
+  AVPacket pkt;
+  int64_t start_time;
+
+  start_time = av_gettime_relative();
+
+  if(open_media_input(&fmt_ctx, filename, options, &probe_stats) < 0)
+  {
+    printf("Could not open input file %s\n", filename);
+    return -1;
+  }
+
+  result->packets = 0;
+  while(av_read_frame(fmt_ctx, &pkt) >= 0)
+  {
+    result->packets++;
+    av_packet_unref(&pkt);
+  } // while
+
+  result->bytes = (fmt_ctx->pb != NULL) ? fmt_ctx->pb->bytes_read : 0;
+  result->probe_time = probe_stats.probe_time;
+  result->elapsed = av_gettime_relative() - start_time;
+
+  close_media_input(&fmt_ctx);
+
+  return 0;
+}
+
+static double packets_per_sec(const DemuxResult* total)
+{
+  return total->elapsed > 0 ? total->packets * 1000000.0 / total->elapsed : 0.0;
+}
+
+static double mb_per_sec(const DemuxResult* total)
+{
+  return total->elapsed > 0 ? total->bytes / 1048576.0 * 1000000.0 / total->elapsed : 0.0;
+}
+
+// Runs every I/O mode on filename and appends one result per mode.
+static int bench_file(const char* filename, int runs, BenchResult* results)
+{
+  InputOptions options;
+  DemuxResult result, total;
+  unsigned int mode;
+  int nb_results = 0;
+  int run;
+
+  init_input_options(&options);
+
+  // One untimed pass, so that every mode starts from the same page cache state.
+  if(run_demux(filename, &options, &result) < 0)
+  {
+    return 0;
+  }
+
+  for(mode = 0; mode < sizeof(io_modes) / sizeof(io_modes[0]); mode++)
+  {
+    options.io_mode = io_modes[mode].io_mode;
+    memset(&total, 0, sizeof(total));
+
+    for(run = 0; run < runs; run++)
+    {
+      if(run_demux(filename, &options, &result) < 0)
+      {
+        break;
+      }
+
+      total.packets += result.packets;
+      total.bytes += result.bytes;
+      total.probe_time += result.probe_time;
+      total.elapsed += result.elapsed;
+    } // for
+
+    if(run < runs)
+    {
+      continue;
+    }
+
+    printf("%-10s %12.0f pkt/s %10.1f MB/s %10.3f ms probe  %s\n",
+      io_modes[mode].name, packets_per_sec(&total), mb_per_sec(&total),
+      total.probe_time / 1000.0 / runs, filename);
+
+    results[nb_results].filename = filename;
+    results[nb_results].io_name = io_modes[mode].name;
+    results[nb_results].runs = runs;
+    results[nb_results].total = total;
+    nb_results++;
+  } // for
+
+  return nb_results;
+}
+
+// Averages per run, so that results of different builds compare directly.
+static int write_results(const char* path, const BenchResult* results, int nb_results)
+{
+  FILE* fp;
+  int index;
+
+  fp = fopen(path, "w");
+  if(fp == NULL)
+  {
+    printf("Could not create %s\n", path);
+    return -1;
+  }
+
+  fprintf(fp, "{\"ffmpeg\":");
+  json_write_string(fp, av_version_info());
+  fprintf(fp, ",\"libavformat\":%u,\"timestamp\":%" PRId64 ",\n  \"results\":[\n",
+    avformat_version(), (int64_t)time(NULL));
+
+  for(index = 0; index < nb_results; index++)
+  {
+    const BenchResult* result = &results[index];
+    const DemuxResult* total = &result->total;
+
+    fprintf(fp, "    {\"file\":");
+    json_write_string(fp, result->filename);
+    fprintf(fp, ",\"io\":");
+    json_write_string(fp, result->io_name);
+    fprintf(fp, ",\"runs\":%d,\"packets\":%" PRId64 ",\"bytes\":%" PRId64
+      ",\"packets_per_sec\":%.1f,\"mb_per_sec\":%.3f,\"probe_ms\":%.3f,\"elapsed_ms\":%.3f}%s\n",
+      result->runs, total->packets / result->runs, total->bytes / result->runs,
+      packets_per_sec(total), mb_per_sec(total),
+      total->probe_time / 1000.0 / result->runs, total->elapsed / 1000.0 / result->runs,
+      index + 1 < nb_results ? "," : "");
+  } // for
+
+  fprintf(fp, "  ]}\n");
+  fclose(fp);
+
+  return 0;
+}
+
+static int init_generator_filters(Generator* gen, int duration)
+{
+  AVFilterInOut *inputs = NULL, *outputs = NULL, *output;
+  char graph_desc[512];
+  int ret = 0;
+
+  gen->filter_graph = avfilter_graph_alloc();
+  if(gen->filter_graph == NULL)
+  {
+    return -1;
+  }
+
+  snprintf(graph_desc, sizeof(graph_desc),
+    "testsrc=size=%dx%d:rate=%d:duration=%d,format=yuv420p[v];"
+    "sine=frequency=440:beep_factor=4:sample_rate=%d:duration=%d,"
+    "aformat=sample_fmts=s16:channel_layouts=stereo[a]",
+    gen_width, gen_height, gen_frame_rate, duration, gen_sample_rate, duration);
+
+  if(avfilter_graph_parse2(gen->filter_graph, graph_desc, &inputs, &outputs) < 0)
+  {
+    printf("Failed to parse generator filtergraph\n");
+    return -2;
+  }
+
+  // Attach a buffer sink to each labeled output.
+  for(output = outputs; output != NULL && ret == 0; output = output->next)
+  {
+    int is_video = (strcmp(output->name, "v") == 0);
+    AVFilterContext** sink_ctx = is_video ? &gen->v_sink_ctx : &gen->a_sink_ctx;
+
+    if(avfilter_graph_create_filter(sink_ctx,
+        avfilter_get_by_name(is_video ? "buffersink" : "abuffersink"),
+        output->name, NULL, NULL, gen->filter_graph) < 0 ||
+      avfilter_link(output->filter_ctx, output->pad_idx, *sink_ctx, 0) < 0)
+    {
+      printf("Failed to create generator buffer sink\n");
+      ret = -3;
+    }
+  } // for
+
+  avfilter_inout_free(&inputs);
+  avfilter_inout_free(&outputs);
+
+  if(ret == 0 && avfilter_graph_config(gen->filter_graph, NULL) < 0)
+  {
+    printf("Failed to configure generator filtergraph\n");
+    ret = -4;
+  }
+
+  return ret;
+}
+
+static int open_generator_encoder(Generator* gen, AVCodecContext** codec_ctx,
+                                  enum AVCodecID codec_id, int64_t bit_rate)
+{
+  const AVCodec* encoder = avcodec_find_encoder(codec_id);
+  AVStream* stream;
+
+  if(encoder == NULL)
+  {
+    printf("Encoder %s is not available\n", avcodec_get_name(codec_id));
+    return -1;
+  }
+
+  *codec_ctx = avcodec_alloc_context3(encoder);
+  stream = avformat_new_stream(gen->fmt_ctx, NULL);
+  if(*codec_ctx == NULL || stream == NULL)
+  {
+    return -2;
+  }
+
+  (*codec_ctx)->bit_rate = bit_rate;
+  if(encoder->type == AVMEDIA_TYPE_VIDEO)
+  {
+    (*codec_ctx)->width = av_buffersink_get_w(gen->v_sink_ctx);
+    (*codec_ctx)->height = av_buffersink_get_h(gen->v_sink_ctx);
+    (*codec_ctx)->pix_fmt = av_buffersink_get_format(gen->v_sink_ctx);
+    (*codec_ctx)->time_base = av_buffersink_get_time_base(gen->v_sink_ctx);
+    (*codec_ctx)->framerate = (AVRational){ gen_frame_rate, 1 };
+    (*codec_ctx)->gop_size = 2 * gen_frame_rate;
+  }
+  else
+  {
+    (*codec_ctx)->sample_rate = av_buffersink_get_sample_rate(gen->a_sink_ctx);
+    (*codec_ctx)->channel_layout = AV_CH_LAYOUT_STEREO;
+    (*codec_ctx)->channels = 2;
+    (*codec_ctx)->sample_fmt = av_buffersink_get_format(gen->a_sink_ctx);
+    (*codec_ctx)->time_base = av_buffersink_get_time_base(gen->a_sink_ctx);
+  }
+
+  if(gen->fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+  {
+    (*codec_ctx)->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  }
+
+  if(avcodec_open2(*codec_ctx, encoder, NULL) < 0)
+  {
+    printf("Failed to open encoder %s\n", encoder->name);
+    return -3;
+  }
+
+  if(avcodec_parameters_from_context(stream->codecpar, *codec_ctx) < 0)
+  {
+    return -4;
+  }
+
+  stream->time_base = (*codec_ctx)->time_base;
+
+  return 0;
+}
+
+// Sends frame (NULL flushes) and writes every packet the encoder returns.
+static int encode_write(Generator* gen, AVCodecContext* codec_ctx, int stream_index, AVFrame* frame)
+{
+  AVPacket pkt;
+  int ret;
+
+  if(avcodec_send_frame(codec_ctx, frame) < 0)
+  {
+    return -1;
+  }
+
+  memset(&pkt, 0, sizeof(pkt));
+  while((ret = avcodec_receive_packet(codec_ctx, &pkt)) >= 0)
+  {
+    pkt.stream_index = stream_index;
+    av_packet_rescale_ts(&pkt, codec_ctx->time_base,
+      gen->fmt_ctx->streams[stream_index]->time_base);
+
+    if(av_interleaved_write_frame(gen->fmt_ctx, &pkt) < 0)
+    {
+      return -2;
+    }
+  } // while
+
+  return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+}
+
+static void free_generator(Generator* gen)
+{
+  avcodec_free_context(&gen->v_codec_ctx);
+  avcodec_free_context(&gen->a_codec_ctx);
+
+  if(gen->fmt_ctx != NULL)
+  {
+    avio_closep(&gen->fmt_ctx->pb);
+    avformat_free_context(gen->fmt_ctx);
+  }
+
+  avfilter_graph_free(&gen->filter_graph);
+}
+
+// testsrc and sine through MPEG-4 Part 2 and MP2, both built into every
+// FFmpeg, so no external encoder library is needed.
+static int generate_media(const char* filename, int64_t video_bit_rate, int duration)
+{
+  Generator gen;
+  AVFrame* frame = NULL;
+  int64_t v_next = 0, a_next = 0;
+  int v_done = 0, a_done = 0;
+  int ret = -1;
+
+  memset(&gen, 0, sizeof(gen));
+
+  if(init_generator_filters(&gen, duration) < 0)
+  {
+    goto generate_end;
+  }
+
+  if(avformat_alloc_output_context2(&gen.fmt_ctx, NULL, NULL, filename) < 0)
+  {
+    printf("Could not create output context\n");
+    goto generate_end;
+  }
+
+  if(open_generator_encoder(&gen, &gen.v_codec_ctx, AV_CODEC_ID_MPEG4, video_bit_rate) < 0 ||
+    open_generator_encoder(&gen, &gen.a_codec_ctx, AV_CODEC_ID_MP2, gen_abit_rate) < 0)
+  {
+    goto generate_end;
+  }
+
+  av_buffersink_set_frame_size(gen.a_sink_ctx, gen.a_codec_ctx->frame_size);
+
+  if(avio_open(&gen.fmt_ctx->pb, filename, AVIO_FLAG_WRITE) < 0 ||
+    avformat_write_header(gen.fmt_ctx, NULL) < 0)
+  {
+    printf("Failed to create output file %s\n", filename);
+    goto generate_end;
+  }
+
+  frame = av_frame_alloc();
+  if(frame == NULL)
+  {
+    goto generate_end;
+  }
+
+  // Pull from whichever stream is behind, so that the muxer gets interleaved input.
+  while(!v_done || !a_done)
+  {
+    int use_video = !v_done && (a_done ||
+      av_compare_ts(v_next, gen.v_codec_ctx->time_base, a_next, gen.a_codec_ctx->time_base) <= 0);
+    AVFilterContext* sink_ctx = use_video ? gen.v_sink_ctx : gen.a_sink_ctx;
+    AVCodecContext* codec_ctx = use_video ? gen.v_codec_ctx : gen.a_codec_ctx;
+
+    if(av_buffersink_get_frame(sink_ctx, frame) < 0)
+    {
+      // End of the source, flush the encoder.
+      ret = encode_write(&gen, codec_ctx, use_video ? 0 : 1, NULL);
+      if(ret < 0)
+      {
+        printf("Error occurred when flushing %s\n", filename);
+        goto generate_end;
+      }
+
+      if(use_video)
+      {
+        v_done = 1;
+      }
+      else
+      {
+        a_done = 1;
+      }
+      continue;
+    }
+
+    if(use_video)
+    {
+      v_next = frame->pts;
+    }
+    else
+    {
+      a_next = frame->pts;
+    }
+
+    frame->pict_type = AV_PICTURE_TYPE_NONE;
+    ret = encode_write(&gen, codec_ctx, use_video ? 0 : 1, frame);
+    av_frame_unref(frame);
+    if(ret < 0)
+    {
+      printf("Error occurred when encoding %s\n", filename);
+      goto generate_end;
+    }
+  } // while
+
+  ret = av_write_trailer(gen.fmt_ctx);
+
+generate_end:
+  av_frame_free(&frame);
+  free_generator(&gen);
+
+  if(ret < 0)
+  {
+    unlink(filename);
+  }
+
+  return ret;
+}
+
+// Writes the synthetic set into directory and adds the paths to files.
+static int generate_inputs(const char* directory, int duration, char** files, int max_files)
+{
+  unsigned int index;
+  int nb_files = 0;
+  char path[4096];
+  struct stat st;
+
+  mkdir(directory, 0755);
+
+  for(index = 0; index < sizeof(media_specs) / sizeof(media_specs[0]) && nb_files < max_files; index++)
+  {
+    snprintf(path, sizeof(path), "%s/bench_%ds_%" PRId64 "k.%s", directory, duration,
+      media_specs[index].video_bit_rate / 1000, media_specs[index].extension);
+
+    // Inputs of an earlier run are reused, generation is slower than the benchmark.
+    if(stat(path, &st) != 0)
+    {
+      printf("Generating %s\n", path);
+      if(generate_media(path, media_specs[index].video_bit_rate, duration) < 0)
+      {
+        printf("Failed to generate %s\n", path);
+        continue;
+      }
+    }
+
+    files[nb_files] = strdup(path);
+    if(files[nb_files] != NULL)
+    {
+      nb_files++;
+    }
+  } // for
+
+  return nb_files;
+}
+
+int main(int argc, char* argv[])
+{
+  const char* gen_directory = NULL;
+  const char* results_path = NULL;
+  char* gen_files[sizeof(media_specs) / sizeof(media_specs[0])];
+  BenchResult* results;
+  int nb_gen_files = 0, nb_results = 0;
+  int duration = 10;
+  int runs = 3;
+  int opt, index;
+
+  while((opt = getopt(argc, argv, "r:g:d:o:")) != -1)
+  {
+    switch(opt)
+    {
+    case 'r':
+      runs = atoi(optarg);
+      break;
+    case 'g':
+      gen_directory = optarg;
+      break;
+    case 'd':
+      duration = atoi(optarg);
+      break;
+    case 'o':
+      results_path = optarg;
+      break;
+    default:
+      optind = argc + 1;
+      break;
+    }
+  } // while
+
+  if(optind > argc || (optind == argc && gen_directory == NULL) || runs < 1 || duration < 1)
+  {
+    printf("usage : %s [-r runs] [-g gen_dir [-d seconds]] [-o results.json] [input]...\n", argv[0]);
+    return 0;
+  }
+
+  av_log_set_level(AV_LOG_ERROR);
+
+  if(gen_directory != NULL)
+  {
+    nb_gen_files = generate_inputs(gen_directory, duration, gen_files,
+      sizeof(gen_files) / sizeof(gen_files[0]));
+  }
+
+  results = calloc((nb_gen_files + argc - optind) * (sizeof(io_modes) / sizeof(io_modes[0])),
+    sizeof(BenchResult));
+  if(results == NULL)
+  {
+    return -1;
+  }
+
+  for(index = 0; index < nb_gen_files; index++)
+  {
+    nb_results += bench_file(gen_files[index], runs, results + nb_results);
+  }
+
+  for(index = optind; index < argc; index++)
+  {
+    nb_results += bench_file(argv[index], runs, results + nb_results);
+  }
+
+  if(results_path != NULL)
+  {
+    write_results(results_path, results, nb_results);
+  }
+
+  for(index = 0; index < nb_gen_files; index++)
+  {
+    free(gen_files[index]);
+  }
+  free(results);
+
+  return 0;
+}
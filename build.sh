@@ -1,6 +1,9 @@
-gcc -g -o sample01_scanning sample01_scanning.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil);
-gcc -g -o sample02_demuxing sample02_demuxing.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil);
-gcc -g -o sample03_remuxing sample03_remuxing.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil);
-gcc -g -o sample04_decoding sample04_decoding.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil);
-gcc -g -o sample05_filtering sample05_filtering.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil libavfilter);
-gcc -g -o sample06_encoding sample06_encoding.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil libavfilter);
+gcc -g -o sample01_scanning sample01_scanning.c file_list.c media_input.c mmap_io.c readahead_io.c probe_cache.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil) -pthread;
+gcc -g -o sample02_demuxing sample02_demuxing.c demux_thread.c json_util.c media_input.c mmap_io.c readahead_io.c packet_pool.c seek_index.c spsc_queue.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil) -pthread;
+gcc -g -o sample03_remuxing sample03_remuxing.c faststart.c file_list.c interleaver.c media_input.c mmap_io.c readahead_io.c seek_index.c segment_writer.c spsc_queue.c writebehind_io.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil) -pthread;
+gcc -g -o sample04_decoding sample04_decoding.c decode_options.c frame_hash.c frame_pool.c demux_thread.c gop_decoder.c latency_hist.c json_util.c media_input.c mmap_io.c readahead_io.c packet_pool.c seek_index.c spsc_queue.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil) -pthread;
+gcc -g -o sample05_filtering sample05_filtering.c decode_options.c frame_pool.c media_input.c mmap_io.c readahead_io.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil libavfilter) -pthread;
+gcc -g -o sample06_encoding sample06_encoding.c decode_options.c frame_pool.c demux_thread.c faststart.c interleaver.c media_input.c mmap_io.c readahead_io.c packet_pool.c spsc_queue.c writebehind_io.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil libavfilter) -pthread;
+gcc -g -o bench_demux bench_demux.c json_util.c media_input.c mmap_io.c readahead_io.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil libavfilter) -pthread;
+gcc -g -o bench_decode bench_decode.c decode_options.c frame_pool.c gop_decoder.c json_util.c media_input.c mmap_io.c readahead_io.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil) -pthread;
+gcc -g -o frame_server frame_server.c decode_options.c frame_cache.c frame_pool.c latency_hist.c media_input.c mmap_io.c readahead_io.c seek_index.c -I"/opt/ffmpeg/include" $(pkg-config --libs libavformat libavcodec libavutil) -pthread;
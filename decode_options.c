@@ -0,0 +1,105 @@
+#include "decode_options.h"
+
+#include <stdio.h>
+#include <string.h>
+
+void init_decode_options(DecodeOptions* options)
+{
+  options->thread_count = 0;
+  options->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  options->frame_pool = NULL;
+}
+
+int parse_thread_type(const char* name, int* thread_type)
+{
+  if(strcmp(name, "frame") == 0)
+  {
+    *thread_type = FF_THREAD_FRAME;
+  }
+  else if(strcmp(name, "slice") == 0)
+  {
+    *thread_type = FF_THREAD_SLICE;
+  }
+  else if(strcmp(name, "auto") == 0)
+  {
+    *thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  }
+  else
+  {
+    return -1;
+  }
+
+  return 0;
+}
+
+void apply_decode_options(AVCodecContext* codec_ctx, const DecodeOptions* options)
+{
+  codec_ctx->thread_count = options->thread_count;
+  codec_ctx->thread_type = options->thread_type;
+
+  if(options->frame_pool != NULL)
+  {
+    frame_pool_attach_decoder(options->frame_pool, codec_ctx);
+  }
+}
+
+const char* thread_type_name(int thread_type)
+{
+  switch(thread_type)
+  {
+  case FF_THREAD_FRAME:
+    return "frame";
+  case FF_THREAD_SLICE:
+    return "slice";
+  default:
+    return "auto";
+  }
+}
+
+int open_best_decoder(AVFormatContext* fmt_ctx, enum AVMediaType type,
+                      const DecodeOptions* options, AVCodecContext** codec_ctx)
+{
+  const AVCodec* decoder = NULL;
+  AVStream* stream;
+  int stream_index;
+
+  *codec_ctx = NULL;
+
+  stream_index = av_find_best_stream(fmt_ctx, type, -1, -1, NULL, 0);
+  if(stream_index < 0)
+  {
+    printf("No %s stream to decode in %s\n", av_get_media_type_string(type), fmt_ctx->url);
+    return -1;
+  }
+
+  stream = fmt_ctx->streams[stream_index];
+  decoder = avcodec_find_decoder(stream->codecpar->codec_id);
+  if(decoder == NULL)
+  {
+    printf("No decoder for %s\n", avcodec_get_name(stream->codecpar->codec_id));
+    return -2;
+  }
+
+  *codec_ctx = avcodec_alloc_context3(decoder);
+  if(*codec_ctx == NULL || avcodec_parameters_to_context(*codec_ctx, stream->codecpar) < 0)
+  {
+    avcodec_free_context(codec_ctx);
+    return -3;
+  }
+
+  if(type == AVMEDIA_TYPE_VIDEO)
+  {
+    (*codec_ctx)->framerate = av_guess_frame_rate(fmt_ctx, stream, NULL);
+  }
+  (*codec_ctx)->pkt_timebase = stream->time_base;
+  apply_decode_options(*codec_ctx, options);
+
+  if(avcodec_open2(*codec_ctx, decoder, NULL) < 0)
+  {
+    printf("Failed to open decoder %s\n", decoder->name);
+    avcodec_free_context(codec_ctx);
+    return -4;
+  }
+
+  return stream_index;
+}
@@ -0,0 +1,36 @@
+#ifndef DECODE_OPTIONS_H
+#define DECODE_OPTIONS_H
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include "frame_pool.h"
+
+typedef struct _DecodeOptions
+{
+  // 0 lets libavcodec start one thread per core.
+  int thread_count;
+  // FF_THREAD_FRAME and/or FF_THREAD_SLICE. With both, the decoder uses
+  // frame threading when it supports it and slice threading otherwise.
+  int thread_type;
+  // Frame buffers come from here when set, see frame_pool.h.
+  FramePool* frame_pool;
+} DecodeOptions;
+
+void init_decode_options(DecodeOptions* options);
+
+// "frame", "slice" or "auto" for both. Returns -1 for anything else.
+int parse_thread_type(const char* name, int* thread_type);
+
+// Call before avcodec_open2().
+void apply_decode_options(AVCodecContext* codec_ctx, const DecodeOptions* options);
+
+const char* thread_type_name(int thread_type);
+
+// Finds the best stream of type in fmt_ctx and opens a decoder for it with
+// options applied. Returns the stream index with *codec_ctx set, or a
+// negative value with *codec_ctx NULL.
+int open_best_decoder(AVFormatContext* fmt_ctx, enum AVMediaType type,
+                      const DecodeOptions* options, AVCodecContext** codec_ctx);
+
+#endif
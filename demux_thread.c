@@ -0,0 +1,225 @@
+#include "demux_thread.h"
+
+#include <libavutil/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void* demux_main(void* arg)
+{
+  DemuxThread* demux = (DemuxThread*)arg;
+  AVPacket* pkt = NULL;
+  unsigned int index;
+  int64_t start_time;
+  int ret;
+
+  while(1)
+  {
+    if(pkt == NULL)
+    {
+      pkt = packet_pool_get(&demux->pool);
+      if(pkt == NULL)
+      {
+        demux->error = AVERROR(ENOMEM);
+        break;
+      }
+    }
+
+    start_time = av_gettime_relative();
+    ret = av_read_frame(demux->fmt_ctx, pkt);
+    demux->read_time += av_gettime_relative() - start_time;
+    if(ret < 0)
+    {
+      if(ret != AVERROR_EOF)
+      {
+        demux->error = ret;
+      }
+      break;
+    }
+
+    if((unsigned int)pkt->stream_index >= demux->nb_streams || !demux->enabled[pkt->stream_index])
+    {
+      demux->dropped++;
+      av_packet_unref(pkt);
+      continue;
+    }
+
+    demux->packets++;
+    demux->bytes += pkt->size;
+
+    // Blocks while the consumer is behind, which is the backpressure.
+    start_time = av_gettime_relative();
+    ret = spsc_queue_push(&demux->queues[pkt->stream_index], pkt);
+    demux->blocked_time += av_gettime_relative() - start_time;
+    if(ret < 0)
+    {
+      break;
+    }
+    pkt = NULL;
+  } // while
+
+  packet_pool_put(&demux->pool, &pkt);
+
+  for(index = 0; index < demux->nb_streams; index++)
+  {
+    if(demux->enabled[index])
+    {
+      spsc_queue_close(&demux->queues[index]);
+    }
+  }
+
+  return NULL;
+}
+
+int demux_thread_start(DemuxThread* demux, AVFormatContext* fmt_ctx,
+                       const int* stream_indexes, int nb_indexes, uint32_t queue_size)
+{
+  int index;
+
+  memset(demux, 0, sizeof(*demux));
+  demux->fmt_ctx = fmt_ctx;
+  demux->nb_streams = fmt_ctx->nb_streams;
+  demux->queues = calloc(demux->nb_streams, sizeof(SpscQueue));
+  demux->enabled = calloc(demux->nb_streams, sizeof(int));
+  if(demux->queues == NULL || demux->enabled == NULL)
+  {
+    demux_thread_free(demux);
+    return -1;
+  }
+
+  // Enough free packets to refill every queue without allocating.
+  if(packet_pool_init(&demux->pool, queue_size * nb_indexes + 4) < 0)
+  {
+    demux_thread_free(demux);
+    return -1;
+  }
+  demux->pool_ready = 1;
+
+  for(index = 0; index < nb_indexes; index++)
+  {
+    int stream_index = stream_indexes[index];
+    if(stream_index < 0 || (unsigned int)stream_index >= demux->nb_streams ||
+      demux->enabled[stream_index])
+    {
+      continue;
+    }
+
+    if(spsc_queue_init(&demux->queues[stream_index], queue_size) < 0)
+    {
+      demux_thread_free(demux);
+      return -2;
+    }
+    demux->enabled[stream_index] = 1;
+  } // for
+
+  if(pthread_create(&demux->thread, NULL, demux_main, demux) != 0)
+  {
+    demux_thread_free(demux);
+    return -3;
+  }
+
+  demux->started = 1;
+  return 0;
+}
+
+SpscQueue* demux_thread_queue(DemuxThread* demux, int stream_index)
+{
+  if(stream_index < 0 || (unsigned int)stream_index >= demux->nb_streams ||
+    !demux->enabled[stream_index])
+  {
+    return NULL;
+  }
+
+  return &demux->queues[stream_index];
+}
+
+void demux_thread_release_packet(DemuxThread* demux, AVPacket** pkt)
+{
+  packet_pool_put(&demux->pool, pkt);
+}
+
+void demux_thread_abort(DemuxThread* demux)
+{
+  unsigned int index;
+
+  for(index = 0; index < demux->nb_streams; index++)
+  {
+    if(demux->enabled[index])
+    {
+      spsc_queue_abort(&demux->queues[index]);
+    }
+  }
+}
+
+void demux_thread_join(DemuxThread* demux)
+{
+  if(demux->started)
+  {
+    pthread_join(demux->thread, NULL);
+    demux->started = 0;
+  }
+}
+
+void demux_thread_free(DemuxThread* demux)
+{
+  unsigned int index;
+  AVPacket* pkt;
+
+  demux_thread_join(demux);
+
+  for(index = 0; index < demux->nb_streams && demux->enabled != NULL; index++)
+  {
+    if(!demux->enabled[index])
+    {
+      continue;
+    }
+
+    while((pkt = (AVPacket*)spsc_queue_try_pop(&demux->queues[index])) != NULL)
+    {
+      packet_pool_put(&demux->pool, &pkt);
+    }
+    spsc_queue_uninit(&demux->queues[index]);
+  } // for
+
+  if(demux->pool_ready)
+  {
+    packet_pool_uninit(&demux->pool);
+    demux->pool_ready = 0;
+  }
+
+  free(demux->queues);
+  free(demux->enabled);
+  demux->queues = NULL;
+  demux->enabled = NULL;
+}
+
+void demux_thread_print_stats(DemuxThread* demux)
+{
+  unsigned int index;
+
+  printf("------- Demux thread -------\n");
+  printf("packets : %" PRId64 " (%" PRId64 " bytes) / dropped : %" PRId64 "\n",
+    demux->packets, demux->bytes, demux->dropped);
+  printf("read : %.3f ms / blocked on full queues : %.3f ms\n",
+    demux->read_time / 1000.0, demux->blocked_time / 1000.0);
+
+  for(index = 0; index < demux->nb_streams; index++)
+  {
+    SpscQueue* queue;
+
+    if(demux->enabled == NULL || !demux->enabled[index])
+    {
+      continue;
+    }
+
+    // Producer stalls mean the consumer is the bottleneck, consumer stalls the demuxer.
+    queue = &demux->queues[index];
+    printf("stream %u : max depth %u/%u / producer stalls %" PRIu64 " / consumer stalls %" PRIu64 "\n",
+      index, queue->max_depth, queue->capacity, queue->push_stalls, queue->pop_stalls);
+  } // for
+
+  if(demux->pool_ready)
+  {
+    packet_pool_print_stats(&demux->pool);
+  }
+}
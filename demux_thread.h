@@ -0,0 +1,53 @@
+#ifndef DEMUX_THREAD_H
+#define DEMUX_THREAD_H
+
+#include <libavformat/avformat.h>
+#include <pthread.h>
+
+#include "packet_pool.h"
+#include "spsc_queue.h"
+
+// Runs av_read_frame() on its own thread and hands each packet to the
+// queue of its stream. Consumers pop AVPacket pointers and give them back
+// with demux_thread_release_packet(); a NULL pop means end of input.
+typedef struct _DemuxThread
+{
+  AVFormatContext* fmt_ctx;
+  unsigned int nb_streams;
+  SpscQueue* queues;
+  int* enabled;
+  PacketPool pool;
+  int pool_ready;
+  pthread_t thread;
+  int started;
+
+  int64_t packets;
+  int64_t bytes;
+  int64_t dropped;
+  // Time in av_read_frame(), and waiting for room in a full queue, in microseconds.
+  int64_t read_time;
+  int64_t blocked_time;
+  int error;
+} DemuxThread;
+
+// Only packets of stream_indexes are queued, the others are dropped.
+int demux_thread_start(DemuxThread* demux, AVFormatContext* fmt_ctx,
+                       const int* stream_indexes, int nb_indexes, uint32_t queue_size);
+
+SpscQueue* demux_thread_queue(DemuxThread* demux, int stream_index);
+
+// Recycles a popped packet.
+void demux_thread_release_packet(DemuxThread* demux, AVPacket** pkt);
+
+// Makes the demux thread give up, e.g. when a consumer failed.
+void demux_thread_abort(DemuxThread* demux);
+
+// Waits for the demux thread to finish.
+void demux_thread_join(DemuxThread* demux);
+
+void demux_thread_print_stats(DemuxThread* demux);
+
+// Joins, then frees the queues and any packet left in them.
+void demux_thread_free(DemuxThread* demux);
+
+#endif
@@ -0,0 +1,109 @@
+#include "faststart.h"
+
+#include <libavutil/common.h>
+#include <libavutil/dict.h>
+#include <limits.h>
+#include <string.h>
+
+// Sample table bytes per sample, assuming the worst case of one sample per
+// chunk: stsz 4, stts 8, stsc 12 and co64 8, plus ctts 8 and stss 4 for video.
+#define VIDEO_SAMPLE_BYTES 44
+#define AUDIO_SAMPLE_BYTES 32
+// trak, mdia, stsd and friends of one stream, without extradata.
+#define STREAM_HEADER_BYTES 1024
+// mvhd, udta and the free atom around the reserved room.
+#define FILE_HEADER_BYTES 4096
+// Estimates above this share of the largest room, in percent, are too
+// close to the limit to risk and go fragmented.
+#define MOOV_SAFETY_BAND 75
+
+int64_t faststart_guess_samples(const AVCodecParameters* par, AVRational frame_rate, int64_t duration)
+{
+  if(duration <= 0)
+  {
+    return -1;
+  }
+
+  if(par->codec_type == AVMEDIA_TYPE_VIDEO && frame_rate.num > 0 && frame_rate.den > 0)
+  {
+    return av_rescale(duration, frame_rate.num, (int64_t)frame_rate.den * AV_TIME_BASE) + 1;
+  }
+
+  // PCM and other audio without a fixed frame size packs a varying number of samples.
+  if(par->codec_type == AVMEDIA_TYPE_AUDIO && par->sample_rate > 0 && par->frame_size > 0)
+  {
+    return av_rescale(duration, par->sample_rate, (int64_t)par->frame_size * AV_TIME_BASE) + 1;
+  }
+
+  return -1;
+}
+
+int64_t faststart_video_samples(const AVStream* in_stream, int64_t guess)
+{
+  if(in_stream->nb_frames <= 0 || av_cmp_q(in_stream->avg_frame_rate, in_stream->r_frame_rate) != 0)
+  {
+    return -1;
+  }
+
+  return FFMAX(guess, in_stream->nb_frames);
+}
+
+int64_t faststart_estimate_moov(const AVFormatContext* fmt_ctx, const int64_t* nb_samples)
+{
+  int64_t size = FILE_HEADER_BYTES;
+  unsigned int index;
+
+  for(index = 0; index < fmt_ctx->nb_streams; index++)
+  {
+    const AVCodecParameters* par = fmt_ctx->streams[index]->codecpar;
+
+    if(nb_samples[index] < 0)
+    {
+      return -1;
+    }
+
+    size += STREAM_HEADER_BYTES + par->extradata_size;
+    size += nb_samples[index] *
+      (par->codec_type == AVMEDIA_TYPE_VIDEO ? VIDEO_SAMPLE_BYTES : AUDIO_SAMPLE_BYTES);
+  } // for
+
+  // The guessed sample counts are rounded, variable frame rates are not.
+  return size + size / 8;
+}
+
+int faststart_set_options(AVDictionary** opts, const AVFormatContext* fmt_ctx,
+                          const int64_t* nb_samples, int64_t max_moov_size)
+{
+  const char* name = fmt_ctx->oformat->name;
+  int64_t moov_size;
+
+  if(strcmp(name, "mp4") != 0 && strcmp(name, "mov") != 0)
+  {
+    return FASTSTART_NONE;
+  }
+
+  // The room is written before the first packet and can't grow afterwards,
+  // so a layout that may not fit is ruled out here.
+  moov_size = faststart_estimate_moov(fmt_ctx, nb_samples);
+  if(moov_size > 0 && moov_size <= max_moov_size / 100 * MOOV_SAFETY_BAND && moov_size <= INT_MAX)
+  {
+    av_dict_set_int(opts, "moov_size", moov_size, 0);
+    return FASTSTART_RESERVED;
+  }
+
+  av_dict_set(opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+  return FASTSTART_FRAGMENTED;
+}
+
+const char* faststart_layout_name(int layout)
+{
+  switch(layout)
+  {
+  case FASTSTART_RESERVED:
+    return "reserved moov";
+  case FASTSTART_FRAGMENTED:
+    return "fragmented";
+  default:
+    return "default";
+  }
+}
@@ -0,0 +1,43 @@
+#ifndef FASTSTART_H
+#define FASTSTART_H
+
+#include <libavformat/avformat.h>
+
+// Single-pass MP4 with the index in front of the media data. The mov muxer
+// keeps room for moov after ftyp ("moov_size") and writes it there at
+// av_write_trailer(), instead of moving the whole file like "+faststart".
+// The room is sized from the expected number of samples. When that can't be
+// told, or the index would come close to the largest room allowed, the
+// output is fragmented instead, which starts playing without a complete
+// index. The estimate must not be short: if the real index outgrows the
+// room, av_write_trailer() fails and the file is left without moov, which
+// no player can open. Callers should pass -1 for counts they can't trust,
+// variable frame rate video for example, and check av_write_trailer().
+
+enum
+{
+  FASTSTART_NONE = 0,
+  FASTSTART_RESERVED,
+  FASTSTART_FRAGMENTED,
+};
+
+// Expected samples of a stream lasting duration (AV_TIME_BASE), -1 if unknown.
+// frame_rate is used for video, sample_rate and frame_size of par for audio.
+int64_t faststart_guess_samples(const AVCodecParameters* par, AVRational frame_rate, int64_t duration);
+
+// Video samples of in_stream taken in full, from a guess made with
+// faststart_guess_samples(). The guess only holds at a constant frame rate
+// and with a frame count in the header to check it against, -1 otherwise.
+int64_t faststart_video_samples(const AVStream* in_stream, int64_t guess);
+
+// Bytes of moov for nb_samples[i] samples in stream i of fmt_ctx, -1 if any is unknown.
+int64_t faststart_estimate_moov(const AVFormatContext* fmt_ctx, const int64_t* nb_samples);
+
+// Adds the muxer options of the chosen layout to opts, for avformat_write_header().
+// Returns FASTSTART_NONE if fmt_ctx is not MP4 or MOV.
+int faststart_set_options(AVDictionary** opts, const AVFormatContext* fmt_ctx,
+                          const int64_t* nb_samples, int64_t max_moov_size);
+
+const char* faststart_layout_name(int layout);
+
+#endif
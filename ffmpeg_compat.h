@@ -0,0 +1,15 @@
+#ifndef FFMPEG_COMPAT_H
+#define FFMPEG_COMPAT_H
+
+#include <libavutil/version.h>
+#include <stddef.h>
+
+// Size argument of the av_buffer_pool_init2() allocation callback, an int
+// before libavutil 57 (FFmpeg 5) and a size_t since.
+#if LIBAVUTIL_VERSION_MAJOR >= 57
+typedef size_t BufferPoolSize;
+#else
+typedef int BufferPoolSize;
+#endif
+
+#endif
@@ -0,0 +1,132 @@
+#include "file_list.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+int file_list_add(FileList* list, const char* path)
+{
+  if(list->count == list->capacity)
+  {
+    int capacity = list->capacity ? list->capacity * 2 : 256;
+    char** paths = realloc(list->paths, capacity * sizeof(char*));
+    if(paths == NULL)
+    {
+      return -1;
+    }
+
+    list->paths = paths;
+    list->capacity = capacity;
+  }
+
+  list->paths[list->count] = strdup(path);
+  if(list->paths[list->count] == NULL)
+  {
+    return -1;
+  }
+
+  list->count++;
+  return 0;
+}
+
+void file_list_free(FileList* list)
+{
+  int index;
+
+  for(index = 0; index < list->count; index++)
+  {
+    free(list->paths[index]);
+  }
+
+  free(list->paths);
+  list->paths = NULL;
+  list->count = list->capacity = 0;
+}
+
+int file_list_add_directory(FileList* list, const char* dirname)
+{
+  DIR* dir;
+  struct dirent* entry;
+  char path[4096];
+  struct stat st;
+
+  dir = opendir(dirname);
+  if(dir == NULL)
+  {
+    printf("Could not open directory %s\n", dirname);
+    return -1;
+  }
+
+  while((entry = readdir(dir)) != NULL)
+  {
+    if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+    {
+      continue;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", dirname, entry->d_name);
+    if(lstat(path, &st) < 0)
+    {
+      continue;
+    }
+
+    // Only the target of a link to a file counts, linked directories are
+    // skipped.
+    if(S_ISLNK(st.st_mode) && (stat(path, &st) < 0 || !S_ISREG(st.st_mode)))
+    {
+      continue;
+    }
+
+    if(S_ISDIR(st.st_mode))
+    {
+      file_list_add_directory(list, path);
+    }
+    else if(S_ISREG(st.st_mode))
+    {
+      if(file_list_add(list, path) < 0)
+      {
+        closedir(dir);
+        return -2;
+      }
+    }
+  } // while
+
+  closedir(dir);
+  return 0;
+}
+
+int file_list_add_list(FileList* list, const char* listname)
+{
+  FILE* fp;
+  char line[4096];
+
+  fp = (strcmp(listname, "-") == 0) ? stdin : fopen(listname, "r");
+  if(fp == NULL)
+  {
+    printf("Could not open file list %s\n", listname);
+    return -1;
+  }
+
+  while(fgets(line, sizeof(line), fp) != NULL)
+  {
+    line[strcspn(line, "\r\n")] = '\0';
+    if(line[0] == '\0')
+    {
+      continue;
+    }
+
+    if(file_list_add(list, line) < 0)
+    {
+      break;
+    }
+  } // while
+
+  if(fp != stdin)
+  {
+    fclose(fp);
+  }
+
+  return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef FILE_LIST_H
+#define FILE_LIST_H
+
+typedef struct _FileList
+{
+  char** paths;
+  int count;
+  int capacity;
+} FileList;
+
+int file_list_add(FileList* list, const char* path);
+
+void file_list_free(FileList* list);
+
+// Collect every regular file below the given directory. Symbolic links to
+// files are followed, links to directories are not, so that a link back
+// to a parent can't make the walk loop.
+int file_list_add_directory(FileList* list, const char* dirname);
+
+// Read one path per line. "-" means standard input.
+int file_list_add_list(FileList* list, const char* listname);
+
+#endif
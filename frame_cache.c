@@ -0,0 +1,408 @@
+#include "frame_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Without a .kidx index the keyframes are unknown, so a request this far
+// ahead of the decoder, in seconds, is decoded forward rather than seeked.
+#define FORWARD_WINDOW 2.0
+
+int frame_cache_init(FrameCache* cache, int capacity,
+                     const InputOptions* input_opts, const DecodeOptions* decode_opts)
+{
+  memset(cache, 0, sizeof(*cache));
+
+  cache->sources = calloc(capacity, sizeof(FrameSource));
+  cache->decoded = av_frame_alloc();
+  if(cache->sources == NULL || cache->decoded == NULL)
+  {
+    frame_cache_uninit(cache);
+    return -1;
+  }
+
+  cache->capacity = capacity;
+  cache->input_opts = input_opts;
+  cache->decode_opts = decode_opts;
+  latency_hist_init(&cache->hit_latency);
+  latency_hist_init(&cache->miss_latency);
+
+  return 0;
+}
+
+static void close_source(FrameSource* source)
+{
+  av_frame_free(&source->current);
+  av_frame_free(&source->next);
+  avcodec_free_context(&source->codec_ctx);
+  close_media_input(&source->fmt_ctx);
+  seek_index_close(&source->index);
+  free(source->path);
+  memset(source, 0, sizeof(*source));
+}
+
+void frame_cache_uninit(FrameCache* cache)
+{
+  int index;
+
+  for(index = 0; cache->sources != NULL && index < cache->capacity; index++)
+  {
+    close_source(&cache->sources[index]);
+  }
+
+  av_frame_free(&cache->decoded);
+  free(cache->sources);
+  cache->sources = NULL;
+}
+
+static int open_source(FrameCache* cache, FrameSource* source, const char* path)
+{
+  char index_path[4096];
+  unsigned int index;
+
+  if(open_media_input(&source->fmt_ctx, path, cache->input_opts, NULL) < 0)
+  {
+    printf("Could not open input file %s\n", path);
+    return -1;
+  }
+
+  source->stream_index = open_best_decoder(source->fmt_ctx, AVMEDIA_TYPE_VIDEO,
+                                           cache->decode_opts, &source->codec_ctx);
+  if(source->stream_index < 0)
+  {
+    return -2;
+  }
+
+  source->current = av_frame_alloc();
+  source->next = av_frame_alloc();
+  source->path = strdup(path);
+  if(source->current == NULL || source->next == NULL || source->path == NULL)
+  {
+    return -4;
+  }
+
+  // Only the video stream is ever decoded.
+  for(index = 0; index < source->fmt_ctx->nb_streams; index++)
+  {
+    if((int)index != source->stream_index)
+    {
+      source->fmt_ctx->streams[index]->discard = AVDISCARD_ALL;
+    }
+  }
+
+  seek_index_path(path, index_path, sizeof(index_path));
+  source->index = seek_index_open(index_path, path);
+
+  return 0;
+}
+
+// Returns the open source of path, or opens it in place of the least
+// recently used one. *hit tells which. The least recently used one is only
+// closed once path is open, so a bad path costs no warm decoder.
+static FrameSource* find_source(FrameCache* cache, const char* path, int* hit)
+{
+  FrameSource* oldest = &cache->sources[0];
+  FrameSource opened;
+  int index;
+
+  for(index = 0; index < cache->capacity; index++)
+  {
+    FrameSource* source = &cache->sources[index];
+    if(source->path != NULL && strcmp(source->path, path) == 0)
+    {
+      *hit = 1;
+      return source;
+    }
+
+    if(source->path == NULL || (oldest->path != NULL && source->last_used < oldest->last_used))
+    {
+      oldest = source;
+    }
+  } // for
+
+  *hit = 0;
+  memset(&opened, 0, sizeof(opened));
+  if(open_source(cache, &opened, path) < 0)
+  {
+    close_source(&opened);
+    return NULL;
+  }
+
+  if(oldest->path != NULL)
+  {
+    close_source(oldest);
+    cache->evictions++;
+  }
+  *oldest = opened;
+
+  return oldest;
+}
+
+static int64_t frame_pts(const AVFrame* frame)
+{
+  return (frame->best_effort_timestamp != AV_NOPTS_VALUE) ? frame->best_effort_timestamp : frame->pts;
+}
+
+// The frame is shown at target: it starts at or before it and lasts past it.
+// Frames without timestamps are taken as they come, and so is the first
+// frame after target when there is none before it.
+static int shows(const AVFrame* frame, int64_t target)
+{
+  int64_t pts = frame_pts(frame);
+
+  if(pts == AV_NOPTS_VALUE)
+  {
+    return 1;
+  }
+
+  return pts >= target || (frame->pkt_duration > 0 && pts + frame->pkt_duration > target);
+}
+
+// Without a duration, a frame is only known to last past target once the
+// frame after it starts later than that.
+static int current_shows(const FrameSource* source, int64_t target)
+{
+  int64_t pts = frame_pts(source->current);
+
+  if(source->current->buf[0] == NULL || pts == AV_NOPTS_VALUE || pts > target)
+  {
+    return 0;
+  }
+
+  return shows(source->current, target) || source->eof ||
+    (source->next->buf[0] != NULL && frame_pts(source->next) > target);
+}
+
+// Decoding on from the current frame is cheaper than seeking when there is
+// no keyframe between it and target.
+static int can_decode_forward(const FrameSource* source, int64_t target)
+{
+  const AVStream* stream = source->fmt_ctx->streams[source->stream_index];
+  int64_t pts;
+  SeekIndexEntry entry;
+
+  if(source->current->buf[0] == NULL || source->eof)
+  {
+    return 0;
+  }
+
+  pts = frame_pts(source->current);
+  if(pts == AV_NOPTS_VALUE || target <= pts)
+  {
+    return 0;
+  }
+
+  if(source->index != NULL)
+  {
+    return seek_index_lookup(source->index, source->stream_index, target, &entry) >= 0 &&
+      entry.pts <= pts;
+  }
+
+  return (target - pts) * av_q2d(stream->time_base) <= FORWARD_WINDOW;
+}
+
+// Seeks to the keyframe at or before target.
+static int seek_source(FrameSource* source, int64_t target)
+{
+  SeekIndexEntry entry;
+  int ret = -1;
+
+  if(source->index != NULL)
+  {
+    ret = seek_index_seek(source->fmt_ctx, source->index, source->stream_index, target, &entry);
+  }
+
+  if(ret < 0)
+  {
+    ret = avformat_seek_file(source->fmt_ctx, source->stream_index, INT64_MIN, target, target, 0);
+  }
+
+  avcodec_flush_buffers(source->codec_ctx);
+  av_frame_unref(source->current);
+  av_frame_unref(source->next);
+  source->eof = 0;
+
+  return ret;
+}
+
+// Decodes until the frame shown at target is in source->current. Frames go
+// through cache->decoded, so that the last one stays in current when the
+// stream ends before target. A frame starting past target leaves current,
+// which started before it, on screen and waits in source->next.
+static int decode_to(FrameCache* cache, FrameSource* source, int64_t target)
+{
+  AVPacket pkt;
+  int64_t pts;
+  int ret;
+
+  while(1)
+  {
+    if(source->next->buf[0] != NULL)
+    {
+      av_frame_move_ref(cache->decoded, source->next);
+      ret = 0;
+    }
+    else
+    {
+      ret = avcodec_receive_frame(source->codec_ctx, cache->decoded);
+      if(ret >= 0)
+      {
+        cache->frames_decoded++;
+      }
+    }
+
+    if(ret >= 0)
+    {
+      pts = frame_pts(cache->decoded);
+      if(pts != AV_NOPTS_VALUE && pts > target && source->current->buf[0] != NULL &&
+        frame_pts(source->current) != AV_NOPTS_VALUE && frame_pts(source->current) <= target)
+      {
+        av_frame_move_ref(source->next, cache->decoded);
+        return 0;
+      }
+
+      av_frame_unref(source->current);
+      av_frame_move_ref(source->current, cache->decoded);
+      if(shows(source->current, target))
+      {
+        return 0;
+      }
+      continue;
+    }
+    else if(ret == AVERROR_EOF)
+    {
+      source->eof = 1;
+      return 0;
+    }
+    else if(ret != AVERROR(EAGAIN))
+    {
+      return ret;
+    }
+
+    if(av_read_frame(source->fmt_ctx, &pkt) < 0)
+    {
+      ret = avcodec_send_packet(source->codec_ctx, NULL);
+    }
+    else if(pkt.stream_index != source->stream_index)
+    {
+      av_packet_unref(&pkt);
+      continue;
+    }
+    else
+    {
+      ret = avcodec_send_packet(source->codec_ctx, &pkt);
+      av_packet_unref(&pkt);
+    }
+
+    if(ret < 0 && ret != AVERROR_EOF)
+    {
+      return ret;
+    }
+  } // while
+}
+
+int frame_cache_get(FrameCache* cache, const char* path, double seconds,
+                    AVFrame* frame, double* frame_seconds)
+{
+  int64_t start_time = latency_now();
+  FrameSource* source;
+  AVStream* stream;
+  int64_t target;
+  int hit, ret;
+
+  cache->requests++;
+
+  source = find_source(cache, path, &hit);
+  if(hit)
+  {
+    cache->hits++;
+  }
+  else
+  {
+    cache->misses++;
+  }
+
+  if(source == NULL)
+  {
+    cache->failures++;
+    return -1;
+  }
+  source->last_used = ++cache->clock;
+
+  stream = source->fmt_ctx->streams[source->stream_index];
+  target = av_rescale_q((int64_t)(seconds * AV_TIME_BASE), AV_TIME_BASE_Q, stream->time_base);
+  if(stream->start_time != AV_NOPTS_VALUE)
+  {
+    target += stream->start_time;
+  }
+
+  if(current_shows(source, target))
+  {
+    cache->repeats++;
+    ret = 0;
+  }
+  else
+  {
+    if(can_decode_forward(source, target))
+    {
+      cache->forwards++;
+    }
+    else
+    {
+      cache->seeks++;
+      if(seek_source(source, target) < 0)
+      {
+        printf("Failed to seek %s to %.3f sec\n", path, seconds);
+      }
+    }
+
+    ret = decode_to(cache, source, target);
+  }
+
+  if(ret >= 0 && source->current->buf[0] == NULL)
+  {
+    ret = AVERROR_EOF;
+  }
+
+  if(ret >= 0)
+  {
+    ret = av_frame_ref(frame, source->current);
+  }
+
+  if(ret >= 0 && frame_seconds != NULL)
+  {
+    int64_t pts = frame_pts(frame);
+    if(pts != AV_NOPTS_VALUE && stream->start_time != AV_NOPTS_VALUE)
+    {
+      pts -= stream->start_time;
+    }
+    *frame_seconds = (pts != AV_NOPTS_VALUE) ? pts * av_q2d(stream->time_base) : seconds;
+  }
+
+  if(ret < 0)
+  {
+    cache->failures++;
+    // Start over with a seek next time.
+    av_frame_unref(source->current);
+    source->eof = 1;
+  }
+
+  latency_hist_add(hit ? &cache->hit_latency : &cache->miss_latency, latency_now() - start_time);
+
+  return ret;
+}
+
+void frame_cache_print_stats(FrameCache* cache)
+{
+  uint64_t decodes = cache->forwards + cache->seeks;
+
+  printf("------- Frame cache -------\n");
+  printf("requests : %" PRIu64 " / open file hits %" PRIu64 " / misses %" PRIu64 " / hit rate %.1f%% / evictions %" PRIu64 " / failures %" PRIu64 "\n",
+    cache->requests, cache->hits, cache->misses,
+    cache->requests ? cache->hits * 100.0 / cache->requests : 0.0, cache->evictions, cache->failures);
+  printf("frames : %" PRIu64 " repeated / %" PRIu64 " decoded forward / %" PRIu64 " after a seek / %.1f decoded per request\n",
+    cache->repeats, cache->forwards, cache->seeks,
+    decodes ? (double)cache->frames_decoded / decodes : 0.0);
+  latency_hist_print(&cache->hit_latency, "hit latency");
+  latency_hist_print(&cache->miss_latency, "miss latency");
+}
@@ -0,0 +1,68 @@
+#ifndef FRAME_CACHE_H
+#define FRAME_CACHE_H
+
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+
+#include "decode_options.h"
+#include "latency_hist.h"
+#include "media_input.h"
+#include "seek_index.h"
+
+// An input kept open with its video decoder. current is the last frame
+// handed out, so a request at or just after it decodes forward from there.
+// next is a frame already decoded after it, kept when it turned out to
+// start past the request.
+typedef struct _FrameSource
+{
+  char* path;
+  AVFormatContext* fmt_ctx;
+  AVCodecContext* codec_ctx;
+  SeekIndex* index;
+  int stream_index;
+  AVFrame* current;
+  AVFrame* next;
+  int eof;
+  uint64_t last_used;
+} FrameSource;
+
+// Answers "the video frame shown at time T of file F" requests, keeping up
+// to capacity files open. The least recently used one is closed to make
+// room once the new file is open. Not thread-safe; use one cache per thread.
+typedef struct _FrameCache
+{
+  FrameSource* sources;
+  int capacity;
+  uint64_t clock;
+  AVFrame* decoded;
+  const InputOptions* input_opts;
+  const DecodeOptions* decode_opts;
+
+  uint64_t requests;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+  uint64_t failures;
+  // Requests answered by the last decoded frame, by decoding forward from
+  // it, and by seeking to a keyframe first.
+  uint64_t repeats;
+  uint64_t forwards;
+  uint64_t seeks;
+  int64_t frames_decoded;
+  LatencyHist hit_latency;
+  LatencyHist miss_latency;
+} FrameCache;
+
+int frame_cache_init(FrameCache* cache, int capacity,
+                     const InputOptions* input_opts, const DecodeOptions* decode_opts);
+void frame_cache_uninit(FrameCache* cache);
+
+// Puts a reference to the frame shown at seconds from the start of path
+// into frame, or the last frame if seconds is past the end. The caller
+// unrefs it. frame_seconds, if not NULL, gets the time the frame starts at.
+int frame_cache_get(FrameCache* cache, const char* path, double seconds,
+                    AVFrame* frame, double* frame_seconds);
+
+void frame_cache_print_stats(FrameCache* cache);
+
+#endif
@@ -0,0 +1,441 @@
+#include "frame_hash.h"
+
+#include <libavutil/common.h>
+#include <libavutil/cpu.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/samplefmt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+// The vector versions are built with target attributes, so that the rest
+// of the program needs no -mavx2 and still runs on CPUs without it.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FRAME_HASH_X86 1
+#include <immintrin.h>
+#else
+#define FRAME_HASH_X86 0
+#endif
+
+// The accumulators are scrambled every this many stripes, 1 KiB, so that
+// a bit flipped early can't be cancelled out by the sums that follow.
+#define STRIPES_PER_SCRAMBLE 16
+#define NB_KEYS (STRIPES_PER_SCRAMBLE + 8)
+
+#define PRIME32 0x9E3779B1U
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+
+// Stripe n of a block mixes its lane i with hash_keys[n + i], so that two
+// stripes swapped within a block don't give the same hash. The last eight
+// keys also scramble the accumulators. Any fixed values would do, these
+// come from splitmix64.
+static const uint64_t hash_keys[NB_KEYS] =
+{
+  0x3c4c2714abbadd80ULL, 0xbbf51768a6702dd5ULL, 0x1b9250818d8d02a5ULL,
+  0x637debd1e88f4f9eULL, 0xd89285324398e367ULL, 0x4b9e04e7d7250e73ULL,
+  0x933adc9ef441ee49ULL, 0x2215b0576175cec8ULL, 0x9c62d6f51cda1ddbULL,
+  0xd235bdcce0468edeULL, 0xc64d62381923dfb6ULL, 0x6136a7e177f43faeULL,
+  0x6640088b11eb7b5cULL, 0x5de02e044c6e62dbULL, 0x35048d2dad5ec4a1ULL,
+  0x4047fb156e4e7446ULL, 0x5ebaed453a7313fdULL, 0x1cd9d5cb65d42004ULL,
+  0xd4c614d40c8d8c8eULL, 0x290b620a5e76eeb1ULL, 0x38a16582616f448fULL,
+  0x5fdbc76a9443418fULL, 0x39cd679841e4adc1ULL, 0xefa6b2ba423a1c66ULL,
+};
+
+typedef struct _FrameHashImpl
+{
+  const char* name;
+  // av_get_cpu_flags() bits it needs.
+  int cpu_flags;
+  void (*accumulate)(uint64_t* acc, const uint8_t* data, size_t stripes, const uint64_t* keys);
+  void (*scramble)(uint64_t* acc, const uint64_t* keys);
+} FrameHashImpl;
+
+// Lane i of every stripe goes into acc[i] as the product of the low and
+// high halves of the lane xor its key, plus the neighbouring lane i ^ 1
+// as it is, so that no lane is lost when the product is 0.
+static void accumulate_scalar(uint64_t* acc, const uint8_t* data, size_t stripes, const uint64_t* keys)
+{
+  uint64_t value, mixed;
+  size_t stripe;
+  int lane;
+
+  for(stripe = 0; stripe < stripes; stripe++)
+  {
+    for(lane = 0; lane < 8; lane++)
+    {
+      value = AV_RL64(data + lane * 8);
+      mixed = value ^ keys[stripe + lane];
+      acc[lane ^ 1] += value;
+      acc[lane] += (mixed & 0xFFFFFFFF) * (mixed >> 32);
+    } // for
+
+    data += FRAME_HASH_STRIPE;
+  } // for
+}
+
+static void scramble_scalar(uint64_t* acc, const uint64_t* keys)
+{
+  int lane;
+
+  for(lane = 0; lane < 8; lane++)
+  {
+    acc[lane] = (acc[lane] ^ (acc[lane] >> 47) ^ keys[lane]) * PRIME32;
+  }
+}
+
+#if FRAME_HASH_X86
+__attribute__((target("sse2")))
+static void accumulate_sse2(uint64_t* acc, const uint8_t* data, size_t stripes, const uint64_t* keys)
+{
+  __m128i sums[4], value, mixed;
+  size_t stripe;
+  int lane;
+
+  for(lane = 0; lane < 4; lane++)
+  {
+    sums[lane] = _mm_loadu_si128((const __m128i*)(acc + lane * 2));
+  }
+
+  for(stripe = 0; stripe < stripes; stripe++)
+  {
+    for(lane = 0; lane < 4; lane++)
+    {
+      value = _mm_loadu_si128((const __m128i*)data + lane);
+      mixed = _mm_xor_si128(value, _mm_loadu_si128((const __m128i*)(keys + stripe + lane * 2)));
+      sums[lane] = _mm_add_epi64(sums[lane], _mm_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2)));
+      sums[lane] = _mm_add_epi64(sums[lane], _mm_mul_epu32(mixed, _mm_srli_epi64(mixed, 32)));
+    } // for
+
+    data += FRAME_HASH_STRIPE;
+  } // for
+
+  for(lane = 0; lane < 4; lane++)
+  {
+    _mm_storeu_si128((__m128i*)(acc + lane * 2), sums[lane]);
+  }
+}
+
+// A 64x32 multiply is the low half times the prime, plus the high half
+// times the prime shifted back up.
+__attribute__((target("sse2")))
+static void scramble_sse2(uint64_t* acc, const uint64_t* keys)
+{
+  const __m128i prime = _mm_set1_epi32(PRIME32);
+  __m128i value;
+  int lane;
+
+  for(lane = 0; lane < 4; lane++)
+  {
+    value = _mm_loadu_si128((const __m128i*)(acc + lane * 2));
+    value = _mm_xor_si128(value, _mm_srli_epi64(value, 47));
+    value = _mm_xor_si128(value, _mm_loadu_si128((const __m128i*)(keys + lane * 2)));
+    value = _mm_add_epi64(_mm_mul_epu32(value, prime),
+      _mm_slli_epi64(_mm_mul_epu32(_mm_srli_epi64(value, 32), prime), 32));
+    _mm_storeu_si128((__m128i*)(acc + lane * 2), value);
+  } // for
+}
+
+__attribute__((target("avx2")))
+static void accumulate_avx2(uint64_t* acc, const uint8_t* data, size_t stripes, const uint64_t* keys)
+{
+  __m256i sums[2], value, mixed;
+  size_t stripe;
+  int lane;
+
+  for(lane = 0; lane < 2; lane++)
+  {
+    sums[lane] = _mm256_loadu_si256((const __m256i*)(acc + lane * 4));
+  }
+
+  for(stripe = 0; stripe < stripes; stripe++)
+  {
+    for(lane = 0; lane < 2; lane++)
+    {
+      value = _mm256_loadu_si256((const __m256i*)data + lane);
+      mixed = _mm256_xor_si256(value, _mm256_loadu_si256((const __m256i*)(keys + stripe + lane * 4)));
+      // The shuffle stays within 128-bit halves, which is where the lane
+      // pairs are.
+      sums[lane] = _mm256_add_epi64(sums[lane], _mm256_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2)));
+      sums[lane] = _mm256_add_epi64(sums[lane], _mm256_mul_epu32(mixed, _mm256_srli_epi64(mixed, 32)));
+    } // for
+
+    data += FRAME_HASH_STRIPE;
+  } // for
+
+  for(lane = 0; lane < 2; lane++)
+  {
+    _mm256_storeu_si256((__m256i*)(acc + lane * 4), sums[lane]);
+  }
+}
+
+__attribute__((target("avx2")))
+static void scramble_avx2(uint64_t* acc, const uint64_t* keys)
+{
+  const __m256i prime = _mm256_set1_epi32(PRIME32);
+  __m256i value;
+  int lane;
+
+  for(lane = 0; lane < 2; lane++)
+  {
+    value = _mm256_loadu_si256((const __m256i*)(acc + lane * 4));
+    value = _mm256_xor_si256(value, _mm256_srli_epi64(value, 47));
+    value = _mm256_xor_si256(value, _mm256_loadu_si256((const __m256i*)(keys + lane * 4)));
+    value = _mm256_add_epi64(_mm256_mul_epu32(value, prime),
+      _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(value, 32), prime), 32));
+    _mm256_storeu_si256((__m256i*)(acc + lane * 4), value);
+  } // for
+}
+#endif
+
+// Fastest first, so that auto takes the first one the CPU runs.
+static const FrameHashImpl hash_impls[] =
+{
+#if FRAME_HASH_X86
+  { "avx2", AV_CPU_FLAG_AVX2, accumulate_avx2, scramble_avx2 },
+  { "sse2", AV_CPU_FLAG_SSE2, accumulate_sse2, scramble_sse2 },
+#endif
+  { "scalar", 0, accumulate_scalar, scramble_scalar },
+};
+
+static const FrameHashImpl* selected_impl = NULL;
+static pthread_once_t select_once = PTHREAD_ONCE_INIT;
+
+int frame_hash_select(const char* name)
+{
+  int cpu_flags = av_get_cpu_flags();
+  int auto_select = (strcmp(name, "auto") == 0);
+  size_t index;
+
+  for(index = 0; index < sizeof(hash_impls) / sizeof(hash_impls[0]); index++)
+  {
+    const FrameHashImpl* impl = &hash_impls[index];
+    if(!auto_select && strcmp(name, impl->name) != 0)
+    {
+      continue;
+    }
+
+    if((cpu_flags & impl->cpu_flags) != impl->cpu_flags)
+    {
+      if(auto_select)
+      {
+        continue;
+      }
+
+      printf("This CPU can't run the %s frame hash\n", name);
+      return -1;
+    }
+
+    selected_impl = impl;
+    return 0;
+  } // for
+
+  printf("Unknown frame hash %s\n", name);
+  return -2;
+}
+
+static void select_default()
+{
+  if(selected_impl == NULL)
+  {
+    frame_hash_select("auto");
+  }
+}
+
+const char* frame_hash_name()
+{
+  pthread_once(&select_once, select_default);
+  return selected_impl->name;
+}
+
+void frame_hash_init(FrameHash* hash)
+{
+  int lane;
+
+  pthread_once(&select_once, select_default);
+
+  memset(hash, 0, sizeof(*hash));
+  for(lane = 0; lane < 8; lane++)
+  {
+    hash->acc[lane] = hash_keys[NB_KEYS - 1 - lane];
+  }
+}
+
+// Accumulates whole stripes, scrambling at every block boundary.
+static void consume(FrameHash* hash, const uint8_t* data, size_t stripes)
+{
+  size_t count;
+
+  while(stripes > 0)
+  {
+    count = FFMIN(stripes, (size_t)(STRIPES_PER_SCRAMBLE - hash->stripes));
+    selected_impl->accumulate(hash->acc, data, count, hash_keys + hash->stripes);
+
+    hash->stripes += count;
+    data += count * FRAME_HASH_STRIPE;
+    stripes -= count;
+
+    if(hash->stripes == STRIPES_PER_SCRAMBLE)
+    {
+      selected_impl->scramble(hash->acc, hash_keys + STRIPES_PER_SCRAMBLE);
+      hash->stripes = 0;
+    }
+  } // while
+}
+
+// Partial stripes wait in hash->buffer, so a row that doesn't end on a
+// stripe carries over into the next one.
+void frame_hash_update(FrameHash* hash, const uint8_t* data, size_t size)
+{
+  size_t count;
+
+  hash->length += size;
+
+  if(hash->buffered > 0)
+  {
+    count = FFMIN(size, (size_t)(FRAME_HASH_STRIPE - hash->buffered));
+    memcpy(hash->buffer + hash->buffered, data, count);
+    hash->buffered += count;
+    data += count;
+    size -= count;
+
+    if(hash->buffered < FRAME_HASH_STRIPE)
+    {
+      return;
+    }
+
+    consume(hash, hash->buffer, 1);
+    hash->buffered = 0;
+  }
+
+  count = size / FRAME_HASH_STRIPE;
+  consume(hash, data, count);
+  data += count * FRAME_HASH_STRIPE;
+  size -= count * FRAME_HASH_STRIPE;
+
+  memcpy(hash->buffer, data, size);
+  hash->buffered = size;
+}
+
+static uint64_t mix64(uint64_t value)
+{
+  value ^= value >> 30;
+  value *= 0xBF58476D1CE4E5B9ULL;
+  value ^= value >> 27;
+  value *= 0x94D049BB133111EBULL;
+  value ^= value >> 31;
+  return value;
+}
+
+static uint64_t rotl64(uint64_t value, int bits)
+{
+  return (value << bits) | (value >> (64 - bits));
+}
+
+// The last partial stripe is padded with zeros; the length tells it apart
+// from input that really ends in zeros.
+void frame_hash_final(FrameHash* hash, uint8_t out[FRAME_HASH_SIZE])
+{
+  uint64_t low, high;
+  int lane;
+
+  if(hash->buffered > 0)
+  {
+    memset(hash->buffer + hash->buffered, 0, FRAME_HASH_STRIPE - hash->buffered);
+    consume(hash, hash->buffer, 1);
+    hash->buffered = 0;
+  }
+
+  low = mix64(hash->length + PRIME64_1);
+  high = mix64(hash->length + PRIME64_2);
+  for(lane = 0; lane < 8; lane++)
+  {
+    low = rotl64(low ^ mix64(hash->acc[lane] ^ hash_keys[lane]), 27) * PRIME64_1;
+    high = rotl64(high ^ mix64(hash->acc[7 - lane] ^ hash_keys[lane + 8]), 31) * PRIME64_2;
+  } // for
+
+  low = mix64(low ^ high);
+  high = mix64(high + low);
+
+  for(lane = 0; lane < 8; lane++)
+  {
+    out[lane] = (uint8_t)(high >> (56 - lane * 8));
+    out[lane + 8] = (uint8_t)(low >> (56 - lane * 8));
+  }
+}
+
+int64_t frame_hash_frame(const AVFrame* frame, uint8_t out[FRAME_HASH_SIZE])
+{
+  const AVPixFmtDescriptor* desc;
+  FrameHash hash;
+  int linesizes[4];
+  int plane, nb_planes, row, height, channel, size;
+
+  frame_hash_init(&hash);
+
+  // Video frames have no samples.
+  if(frame->nb_samples > 0)
+  {
+    size = av_get_bytes_per_sample(frame->format) * frame->nb_samples;
+    if(size <= 0)
+    {
+      return -1;
+    }
+
+    if(av_sample_fmt_is_planar(frame->format))
+    {
+      for(channel = 0; channel < frame->channels; channel++)
+      {
+        frame_hash_update(&hash, frame->extended_data[channel], size);
+      }
+    }
+    else
+    {
+      frame_hash_update(&hash, frame->extended_data[0], (size_t)size * frame->channels);
+    }
+  }
+  else
+  {
+    desc = av_pix_fmt_desc_get(frame->format);
+    if(desc == NULL || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL) ||
+      av_image_fill_linesizes(linesizes, frame->format, frame->width) < 0)
+    {
+      return -2;
+    }
+
+    // linesizes holds the bytes of picture in a row; frame->linesize, which
+    // may be larger or negative, is only used to step to the next one.
+    nb_planes = av_pix_fmt_count_planes(frame->format);
+    for(plane = 0; plane < nb_planes; plane++)
+    {
+      height = (plane == 1 || plane == 2) ?
+        AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h) : frame->height;
+      for(row = 0; row < height; row++)
+      {
+        frame_hash_update(&hash, frame->data[plane] + (ptrdiff_t)row * frame->linesize[plane],
+          linesizes[plane]);
+      }
+    } // for
+
+    if(desc->flags & AV_PIX_FMT_FLAG_PAL)
+    {
+      frame_hash_update(&hash, frame->data[1], AVPALETTE_SIZE);
+    }
+  }
+
+  frame_hash_final(&hash, out);
+
+  return (int64_t)hash.length;
+}
+
+void frame_hash_to_string(const uint8_t hash[FRAME_HASH_SIZE], char* str)
+{
+  int index;
+
+  for(index = 0; index < FRAME_HASH_SIZE; index++)
+  {
+    snprintf(str + index * 2, 3, "%02x", hash[index]);
+  }
+}
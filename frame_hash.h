@@ -0,0 +1,48 @@
+#ifndef FRAME_HASH_H
+#define FRAME_HASH_H
+
+#include <libavutil/frame.h>
+#include <stdint.h>
+
+// Bytes of a hash, printed as twice as many hex digits like an MD5.
+#define FRAME_HASH_SIZE 16
+
+// Input is consumed in stripes of this many bytes, eight 64-bit lanes.
+#define FRAME_HASH_STRIPE 64
+
+// A 128-bit checksum in the style of XXH3: every 64-bit lane of a stripe
+// is mixed with a key into its own accumulator with one 32x32 multiply, so
+// SSE2 and AVX2 do two and four lanes at a time. Not cryptographic, only
+// meant to tell decoded frames apart. All implementations give the same
+// hash for the same bytes, however they are split across updates.
+typedef struct _FrameHash
+{
+  uint64_t acc[8];
+  uint8_t buffer[FRAME_HASH_STRIPE];
+  int buffered;
+  // Stripes since the accumulators were last scrambled.
+  int stripes;
+  uint64_t length;
+} FrameHash;
+
+// Picks the implementation by name : auto, avx2, sse2 or scalar. Returns a
+// negative value if it is unknown or the CPU can't run it. Without a call,
+// the first hash picks with auto. Not thread-safe against running hashes.
+int frame_hash_select(const char* name);
+const char* frame_hash_name();
+
+void frame_hash_init(FrameHash* hash);
+void frame_hash_update(FrameHash* hash, const uint8_t* data, size_t size);
+void frame_hash_final(FrameHash* hash, uint8_t out[FRAME_HASH_SIZE]);
+
+// Hashes the picture of a video frame plane by plane and row by row, so the
+// linesize padding is left out and the result only depends on the pixels,
+// or the samples of an audio frame channel by channel. Returns the number
+// of bytes hashed, or a negative value for hardware frames and unknown
+// formats.
+int64_t frame_hash_frame(const AVFrame* frame, uint8_t out[FRAME_HASH_SIZE]);
+
+// str needs 2 * FRAME_HASH_SIZE + 1 chars.
+void frame_hash_to_string(const uint8_t hash[FRAME_HASH_SIZE], char* str);
+
+#endif
@@ -0,0 +1,256 @@
+#include "frame_pool.h"
+#include "ffmpeg_compat.h"
+
+#include <libavutil/common.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <stdio.h>
+#include <string.h>
+
+// Plane sizes are rounded up to this, so that close sizes share a pool.
+#define FRAME_POOL_GRANULE 4096
+// Decoders may read and write a little past the end of a plane.
+#define FRAME_POOL_PADDING (16 + FRAME_POOL_ALIGN - 1)
+
+// Formats with a palette plane are left to libavcodec.
+#ifdef AV_PIX_FMT_FLAG_PSEUDOPAL
+#define PSEUDOPAL_FLAG AV_PIX_FMT_FLAG_PSEUDOPAL
+#else
+#define PSEUDOPAL_FLAG 0
+#endif
+
+int frame_pool_init(FramePool* pool, int64_t max_bytes)
+{
+  memset(pool, 0, sizeof(*pool));
+
+  if(pthread_mutex_init(&pool->lock, NULL) != 0)
+  {
+    return -1;
+  }
+
+  pool->max_bytes = max_bytes;
+
+  return 0;
+}
+
+void frame_pool_uninit(FramePool* pool)
+{
+  int index;
+
+  for(index = 0; index < FRAME_POOL_SIZES; index++)
+  {
+    av_buffer_pool_uninit(&pool->buckets[index].pool);
+  }
+
+  pthread_mutex_destroy(&pool->lock);
+}
+
+// Pooled buffers carry their size in a header of FRAME_POOL_ALIGN bytes in
+// front of the data, so that the plane stays aligned.
+static void free_pool_buffer(void* opaque, uint8_t* data)
+{
+  FramePool* pool = (FramePool*)opaque;
+  uint8_t* block = data - FRAME_POOL_ALIGN;
+  int64_t size;
+
+  // Runs when an AVBufferPool lets go of a buffer, on any thread.
+  memcpy(&size, block, sizeof(size));
+  __atomic_fetch_sub(&pool->bytes_held, size, __ATOMIC_RELAXED);
+  av_free(block);
+}
+
+static AVBufferRef* alloc_pool_buffer(void* opaque, BufferPoolSize size)
+{
+  FramePool* pool = (FramePool*)opaque;
+  int64_t held = __atomic_load_n(&pool->bytes_held, __ATOMIC_RELAXED);
+  int64_t block_size = (int64_t)size + FRAME_POOL_ALIGN;
+  AVBufferRef* buf;
+  uint8_t* block;
+
+  // Called by AVBufferPool only when it has no free buffer, i.e. on a miss,
+  // from get_plane() with the lock held.
+  if(held + block_size > pool->max_bytes)
+  {
+    return NULL;
+  }
+
+  block = av_malloc(block_size);
+  if(block == NULL)
+  {
+    return NULL;
+  }
+
+  memcpy(block, &block_size, sizeof(block_size));
+  buf = av_buffer_create(block + FRAME_POOL_ALIGN, size, free_pool_buffer, pool, 0);
+  if(buf == NULL)
+  {
+    av_free(block);
+    return NULL;
+  }
+
+  held = __atomic_add_fetch(&pool->bytes_held, block_size, __ATOMIC_RELAXED);
+  if(held > pool->peak_bytes)
+  {
+    pool->peak_bytes = held;
+  }
+  pool->plane_allocs++;
+
+  return buf;
+}
+
+// Returns the bucket for size, creating it in place of the least recently
+// used one if needed. Call with the lock held.
+static FramePoolBucket* find_bucket(FramePool* pool, int size)
+{
+  FramePoolBucket* oldest = &pool->buckets[0];
+  int index;
+
+  for(index = 0; index < FRAME_POOL_SIZES; index++)
+  {
+    FramePoolBucket* bucket = &pool->buckets[index];
+    if(bucket->pool != NULL && bucket->size == size)
+    {
+      return bucket;
+    }
+
+    if(bucket->pool == NULL || (oldest->pool != NULL && bucket->last_used < oldest->last_used))
+    {
+      oldest = bucket;
+    }
+  } // for
+
+  if(oldest->pool != NULL)
+  {
+    // Buffers out in frames are freed when they come back.
+    av_buffer_pool_uninit(&oldest->pool);
+    pool->evictions++;
+  }
+
+  oldest->pool = av_buffer_pool_init2(size, pool, alloc_pool_buffer, NULL);
+  oldest->size = size;
+
+  return oldest->pool != NULL ? oldest : NULL;
+}
+
+static AVBufferRef* get_plane(FramePool* pool, int size)
+{
+  FramePoolBucket* bucket;
+  AVBufferRef* buf = NULL;
+
+  size = (size + FRAME_POOL_GRANULE - 1) / FRAME_POOL_GRANULE * FRAME_POOL_GRANULE;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->plane_gets++;
+  bucket = find_bucket(pool, size);
+  if(bucket != NULL)
+  {
+    bucket->last_used = ++pool->clock;
+    buf = av_buffer_pool_get(bucket->pool);
+  }
+  if(buf == NULL)
+  {
+    pool->overflows++;
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  // Over max_bytes, the plane lives only as long as its frames.
+  if(buf == NULL)
+  {
+    buf = av_buffer_alloc(size);
+  }
+
+  return buf;
+}
+
+static int use_default_buffer(FramePool* pool, AVCodecContext* codec_ctx, AVFrame* frame, int flags)
+{
+  __atomic_fetch_add(&pool->default_frames, 1, __ATOMIC_RELAXED);
+  return avcodec_default_get_buffer2(codec_ctx, frame, flags);
+}
+
+int frame_pool_get_buffer2(AVCodecContext* codec_ctx, AVFrame* frame, int flags)
+{
+  FramePool* pool = (FramePool*)codec_ctx->opaque;
+  const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get(frame->format);
+  int linesize_align[AV_NUM_DATA_POINTERS];
+  int linesizes[4];
+  int width = frame->width;
+  int height = frame->height;
+  int plane, nb_planes, unaligned;
+
+  if(codec_ctx->codec_type != AVMEDIA_TYPE_VIDEO || desc == NULL ||
+    (desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL | PSEUDOPAL_FLAG)))
+  {
+    return use_default_buffer(pool, codec_ctx, frame, flags);
+  }
+
+  // Room for the decoder to write whole macroblocks, then widen until every
+  // line is a multiple of FRAME_POOL_ALIGN.
+  avcodec_align_dimensions2(codec_ctx, &width, &height, linesize_align);
+  do
+  {
+    if(av_image_fill_linesizes(linesizes, frame->format, width) < 0)
+    {
+      return use_default_buffer(pool, codec_ctx, frame, flags);
+    }
+
+    width += width & ~(width - 1);
+    unaligned = 0;
+    for(plane = 0; plane < 4; plane++)
+    {
+      unaligned |= linesizes[plane] % FRAME_POOL_ALIGN;
+    }
+  } while(unaligned);
+
+  nb_planes = av_pix_fmt_count_planes(frame->format);
+  for(plane = 0; plane < nb_planes; plane++)
+  {
+    int plane_height = (plane == 1 || plane == 2) ?
+      AV_CEIL_RSHIFT(height, desc->log2_chroma_h) : height;
+
+    frame->buf[plane] = get_plane(pool, linesizes[plane] * plane_height + FRAME_POOL_PADDING);
+    if(frame->buf[plane] == NULL)
+    {
+      while(plane-- > 0)
+      {
+        av_buffer_unref(&frame->buf[plane]);
+      }
+      return AVERROR(ENOMEM);
+    }
+
+    frame->data[plane] = frame->buf[plane]->data;
+    frame->linesize[plane] = linesizes[plane];
+  } // for
+
+  frame->extended_data = frame->data;
+
+  return 0;
+}
+
+void frame_pool_attach_decoder(FramePool* pool, AVCodecContext* codec_ctx)
+{
+  // get_buffer2 may only be replaced for decoders with the DR1 capability.
+  if(codec_ctx->codec != NULL && (codec_ctx->codec->capabilities & AV_CODEC_CAP_DR1))
+  {
+    codec_ctx->opaque = pool;
+    codec_ctx->get_buffer2 = frame_pool_get_buffer2;
+#if LIBAVCODEC_VERSION_MAJOR < 59
+    // Otherwise frame threads hand every call over to the main thread.
+    codec_ctx->thread_safe_callbacks = 1;
+#endif
+  }
+}
+
+void frame_pool_print_stats(FramePool* pool)
+{
+  uint64_t hits = pool->plane_gets - pool->plane_allocs - pool->overflows;
+
+  printf("------- Frame pool -------\n");
+  printf("planes : %" PRIu64 " gets / %" PRIu64 " hits / %" PRIu64 " misses / %" PRIu64 " over the cap / hit rate %.1f%%\n",
+    pool->plane_gets, hits, pool->plane_allocs, pool->overflows,
+    pool->plane_gets ? hits * 100.0 / pool->plane_gets : 0.0);
+  printf("pooled : %.1f MiB held / %.1f MiB peak / %.1f MiB cap / %" PRIu64 " sizes dropped\n",
+    __atomic_load_n(&pool->bytes_held, __ATOMIC_RELAXED) / 1048576.0,
+    pool->peak_bytes / 1048576.0, pool->max_bytes / 1048576.0, pool->evictions);
+  printf("default allocator : %" PRIu64 " frames\n", pool->default_frames);
+}
@@ -0,0 +1,58 @@
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <libavcodec/avcodec.h>
+#include <pthread.h>
+
+// Distinct plane sizes kept at once. A stream needs one or two, the least
+// recently used size is dropped when a new resolution shows up.
+#define FRAME_POOL_SIZES 16
+
+// Every plane starts on and every line is padded to this many bytes.
+#define FRAME_POOL_ALIGN 64
+
+typedef struct _FramePoolBucket
+{
+  int size;
+  uint64_t last_used;
+  AVBufferPool* pool;
+} FramePoolBucket;
+
+// get_buffer2 for video decoders, handing out planes from one AVBufferPool
+// per plane size. Buffers come back to their pool when the last frame
+// referencing them is freed. All calls are thread-safe, so frame threads
+// call it directly. Audio, hardware and palette frames go to libavcodec's
+// default allocator.
+typedef struct _FramePool
+{
+  pthread_mutex_t lock;
+  FramePoolBucket buckets[FRAME_POOL_SIZES];
+  uint64_t clock;
+  // Pooled bytes, idle or in use, are kept under this. Planes beyond it are
+  // allocated and freed on their own.
+  int64_t max_bytes;
+
+  uint64_t plane_gets;
+  uint64_t plane_allocs;
+  uint64_t overflows;
+  uint64_t default_frames;
+  uint64_t evictions;
+  int64_t bytes_held;
+  int64_t peak_bytes;
+} FramePool;
+
+int frame_pool_init(FramePool* pool, int64_t max_bytes);
+
+// Buffers still referenced by frames stay valid, but pool must outlive them.
+void frame_pool_uninit(FramePool* pool);
+
+// AVCodecContext.get_buffer2 callback, with the pool in AVCodecContext.opaque.
+int frame_pool_get_buffer2(AVCodecContext* codec_ctx, AVFrame* frame, int flags);
+
+// Sets up codec_ctx to take frame buffers from pool, if the decoder supports
+// it. Call before avcodec_open2().
+void frame_pool_attach_decoder(FramePool* pool, AVCodecContext* codec_ctx);
+
+void frame_pool_print_stats(FramePool* pool);
+
+#endif
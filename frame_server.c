@@ -0,0 +1,331 @@
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/avutil.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "decode_options.h"
+#include "frame_cache.h"
+#include "frame_pool.h"
+#include "media_input.h"
+
+// Serves "frame at time T of file F" over a Unix socket, keeping recently
+// used files open with their decoder. One request per line:
+//
+//   FRAME <seconds> <path>   answered with
+//                            OK <width> <height> <pix_fmt> <seconds> <bytes>\n
+//                            and the picture, planes packed without padding
+//   STATS                    prints the cache statistics on the server
+//   QUIT                     stops the server
+//
+// Failures are answered with ERR <reason>\n. Clients are served one at a
+// time, each for as many requests as it sends.
+
+static InputOptions input_opts;
+static DecodeOptions decode_opts;
+static FramePool frame_pool;
+static int frame_pool_mb = 0;
+static FrameCache frame_cache;
+static int cache_size = 8;
+
+static volatile sig_atomic_t stop_server = 0;
+
+static void on_signal(int signo)
+{
+  stop_server = 1;
+}
+
+static int write_all(int fd, const void* data, size_t size)
+{
+  const uint8_t* ptr = (const uint8_t*)data;
+  ssize_t written;
+
+  while(size > 0)
+  {
+    written = write(fd, ptr, size);
+    if(written < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    else if(written <= 0)
+    {
+      return -1;
+    }
+
+    ptr += written;
+    size -= written;
+  } // while
+
+  return 0;
+}
+
+static int reply_error(int fd, const char* reason)
+{
+  char line[256];
+
+  snprintf(line, sizeof(line), "ERR %s\n", reason);
+  return write_all(fd, line, strlen(line));
+}
+
+static int reply_frame(int fd, AVFrame* frame, double frame_seconds)
+{
+  const char* pix_fmt = av_get_pix_fmt_name(frame->format);
+  uint8_t* buffer;
+  char line[256];
+  int size, ret;
+
+  size = av_image_get_buffer_size(frame->format, frame->width, frame->height, 1);
+  if(size < 0 || pix_fmt == NULL)
+  {
+    return reply_error(fd, "unsupported picture format");
+  }
+
+  buffer = av_malloc(size);
+  if(buffer == NULL)
+  {
+    return reply_error(fd, "out of memory");
+  }
+
+  av_image_copy_to_buffer(buffer, size, (const uint8_t* const*)frame->data, frame->linesize,
+    frame->format, frame->width, frame->height, 1);
+
+  snprintf(line, sizeof(line), "OK %d %d %s %.6f %d\n", frame->width, frame->height, pix_fmt,
+    frame_seconds, size);
+
+  ret = write_all(fd, line, strlen(line));
+  if(ret >= 0)
+  {
+    ret = write_all(fd, buffer, size);
+  }
+
+  av_free(buffer);
+  return ret;
+}
+
+// Returns -1 when the connection is gone, 1 on QUIT.
+static int handle_request(int fd, char* line, AVFrame* frame)
+{
+  char* path;
+  double seconds, frame_seconds;
+  int ret;
+
+  line[strcspn(line, "\r\n")] = '\0';
+
+  if(strcmp(line, "QUIT") == 0)
+  {
+    return 1;
+  }
+  else if(strcmp(line, "STATS") == 0)
+  {
+    frame_cache_print_stats(&frame_cache);
+    return write_all(fd, "OK\n", 3);
+  }
+  else if(strncmp(line, "FRAME ", 6) != 0)
+  {
+    return reply_error(fd, "unknown request");
+  }
+
+  seconds = strtod(line + 6, &path);
+  if(path == line + 6 || *path != ' ' || path[1] == '\0')
+  {
+    return reply_error(fd, "usage : FRAME <seconds> <path>");
+  }
+  path++;
+
+  if(frame_cache_get(&frame_cache, path, seconds, frame, &frame_seconds) < 0)
+  {
+    return reply_error(fd, "no frame");
+  }
+
+  ret = reply_frame(fd, frame, frame_seconds);
+  av_frame_unref(frame);
+
+  return ret;
+}
+
+static int serve(const char* socket_path)
+{
+  struct sockaddr_un addr;
+  struct stat st;
+  AVFrame* frame;
+  char line[4096 + 64];
+  FILE* input;
+  int server_fd, client_fd;
+  int ret = 0;
+
+  if(strlen(socket_path) >= sizeof(addr.sun_path))
+  {
+    printf("Socket path too long : %s\n", socket_path);
+    return -1;
+  }
+
+  // A socket left over from an earlier run is replaced, anything else at
+  // that path is kept.
+  if(lstat(socket_path, &st) == 0)
+  {
+    if(!S_ISSOCK(st.st_mode))
+    {
+      printf("%s exists and is not a socket\n", socket_path);
+      return -1;
+    }
+    unlink(socket_path);
+  }
+
+  server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(server_fd < 0)
+  {
+    printf("Could not create socket\n");
+    return -2;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, socket_path);
+
+  if(bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(server_fd, 8) < 0)
+  {
+    printf("Could not listen on %s\n", socket_path);
+    close(server_fd);
+    return -3;
+  }
+
+  frame = av_frame_alloc();
+  if(frame == NULL)
+  {
+    close(server_fd);
+    return -4;
+  }
+
+  printf("Listening on %s\n", socket_path);
+
+  while(!stop_server && ret == 0)
+  {
+    client_fd = accept(server_fd, NULL, NULL);
+    if(client_fd < 0)
+    {
+      continue;
+    }
+
+    input = fdopen(client_fd, "r");
+    if(input == NULL)
+    {
+      close(client_fd);
+      continue;
+    }
+
+    while(!stop_server && fgets(line, sizeof(line), input) != NULL)
+    {
+      ret = handle_request(client_fd, line, frame);
+      if(ret != 0)
+      {
+        break;
+      }
+    } // while
+
+    // A dropped client does not stop the server, QUIT does.
+    ret = (ret > 0) ? 1 : 0;
+    fclose(input);
+  } // while
+
+  av_frame_free(&frame);
+  close(server_fd);
+  unlink(socket_path);
+
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  struct sigaction action;
+  int opt;
+
+  init_input_options(&input_opts);
+  init_decode_options(&decode_opts);
+  while((opt = getopt(argc, argv, "fmac:T:Y:P:")) != -1)
+  {
+    switch(opt)
+    {
+    case 'f':
+      input_opts.fast_probe = 1;
+      break;
+    case 'm':
+      input_opts.io_mode = INPUT_IO_MMAP;
+      break;
+    case 'a':
+      input_opts.io_mode = INPUT_IO_READAHEAD;
+      break;
+    case 'c':
+      cache_size = atoi(optarg);
+      break;
+    case 'T':
+      decode_opts.thread_count = atoi(optarg);
+      break;
+    case 'Y':
+      if(parse_thread_type(optarg, &decode_opts.thread_type) < 0)
+      {
+        optind = argc + 1;
+      }
+      break;
+    case 'P':
+      frame_pool_mb = atoi(optarg);
+      break;
+    default:
+      optind = argc + 1;
+      break;
+    }
+  } // while
+
+  if(argc - optind < 1 || cache_size < 1)
+  {
+    printf("usage : %s [-f] [-m | -a] [-c open_files] [-T threads] [-Y frame|slice|auto] [-P pool_mb] <socket>\n", argv[0]);
+    printf("        requests : FRAME <seconds> <path> | STATS | QUIT, one per line\n");
+    return 0;
+  }
+
+  av_log_set_level(AV_LOG_ERROR);
+
+  // Stop on SIGINT and SIGTERM by interrupting accept(), and keep going
+  // when a client hangs up in the middle of a reply.
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_signal;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  if(frame_pool_mb > 0)
+  {
+    if(frame_pool_init(&frame_pool, (int64_t)frame_pool_mb * 1024 * 1024) < 0)
+    {
+      return -1;
+    }
+    decode_opts.frame_pool = &frame_pool;
+  }
+
+  if(frame_cache_init(&frame_cache, cache_size, &input_opts, &decode_opts) < 0)
+  {
+    return -1;
+  }
+
+  serve(argv[optind]);
+
+  frame_cache_print_stats(&frame_cache);
+  frame_cache_uninit(&frame_cache);
+
+  // After the decoders, which may hold on to pooled frames.
+  if(decode_opts.frame_pool != NULL)
+  {
+    frame_pool_print_stats(&frame_pool);
+    frame_pool_uninit(&frame_pool);
+  }
+
+  return 0;
+}
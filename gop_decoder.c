@@ -0,0 +1,628 @@
+#include "gop_decoder.h"
+
+#include <libavutil/common.h>
+#include <libavutil/time.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Ranges per worker, so that one slow range does not leave the others idle
+// at the end.
+#define CHUNKS_PER_WORKER 4
+
+// Ranges end at the first closed keyframe past this many packets however
+// long the file is, so a range is a GOP or a few short ones.
+#define MAX_CHUNK_PACKETS 64
+
+// Decoded frames each worker may hold ahead of the range being delivered.
+// Past that the workers wait, trading parallelism for memory.
+#define FRAMES_PER_WORKER 64
+
+// A range of the video stream, from the keyframe at start_pts up to the
+// keyframe at end_pts, and the frames decoded from it so far.
+typedef struct _GopChunk
+{
+  int64_t start_pts;
+  int64_t end_pts;
+  // Lowest pts kept. Only the first range keeps frames shown before its
+  // keyframe, no other range can have them.
+  int64_t min_pts;
+  AVFrame** frames;
+  int nb_frames;
+  int max_frames;
+  int next_frame;
+  int done;
+} GopChunk;
+
+typedef struct _GopDecoder GopDecoder;
+
+typedef struct _GopWorker
+{
+  GopDecoder* decoder;
+  AVFormatContext* fmt_ctx;
+  AVCodecContext* codec_ctx;
+  int stream_index;
+  pthread_t thread;
+  int started;
+  int error;
+} GopWorker;
+
+// Workers take the ranges in order, and are held back once they get more
+// than window ranges ahead of the one being delivered. Within a range, a
+// worker that is not on the range being delivered waits while more than
+// frame_budget frames are buffered, which bounds the frames held in memory
+// to about the budget plus the frames of that one range not yet handed over.
+struct _GopDecoder
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  GopChunk* chunks;
+  int nb_chunks;
+  int next_chunk;
+  int delivered_chunks;
+  int window;
+  int64_t frame_budget;
+  int abort;
+  int64_t buffered;
+  int64_t peak_buffered;
+};
+
+typedef struct _KeyframeInfo
+{
+  int64_t pts;
+  int64_t packet_no;
+  int closed;
+} KeyframeInfo;
+
+static int64_t frame_pts(const AVFrame* frame)
+{
+  return (frame->best_effort_timestamp != AV_NOPTS_VALUE) ? frame->best_effort_timestamp : frame->pts;
+}
+
+static int open_decoder(const char* filename, const InputOptions* input_options,
+                        const DecodeOptions* options, GopWorker* worker)
+{
+  DecodeOptions worker_options = *options;
+  unsigned int index;
+
+  if(open_media_input(&worker->fmt_ctx, filename, input_options, NULL) < 0)
+  {
+    printf("Could not open input file %s\n", filename);
+    return -1;
+  }
+
+  // The parallelism comes from the workers; threads inside each decoder
+  // only if asked for.
+  if(worker_options.thread_count == 0)
+  {
+    worker_options.thread_count = 1;
+  }
+
+  worker->stream_index = open_best_decoder(worker->fmt_ctx, AVMEDIA_TYPE_VIDEO,
+                                           &worker_options, &worker->codec_ctx);
+  if(worker->stream_index < 0)
+  {
+    return -2;
+  }
+
+  for(index = 0; index < worker->fmt_ctx->nb_streams; index++)
+  {
+    if((int)index != worker->stream_index)
+    {
+      worker->fmt_ctx->streams[index]->discard = AVDISCARD_ALL;
+    }
+  }
+
+  return 0;
+}
+
+static void close_decoder(GopWorker* worker)
+{
+  avcodec_free_context(&worker->codec_ctx);
+  close_media_input(&worker->fmt_ctx);
+}
+
+// Reads the packets of the video stream once, without decoding, and lists
+// its keyframes. A keyframe is closed when no packet up to the next one is
+// shown before it, so that decoding can start there without the frames of
+// the previous GOP.
+static int scan_keyframes(GopWorker* worker, KeyframeInfo** keyframes, int* nb_keyframes,
+                          int64_t* nb_packets, GopDecodeStats* stats)
+{
+  AVPacket pkt;
+  KeyframeInfo* list = NULL;
+  int count = 0, max_count = 0;
+  int64_t packet_no = 0;
+  int64_t pts;
+  int index;
+
+  while(av_read_frame(worker->fmt_ctx, &pkt) >= 0)
+  {
+    if(pkt.stream_index != worker->stream_index)
+    {
+      av_packet_unref(&pkt);
+      continue;
+    }
+
+    pts = pkt.pts;
+    if(pts == AV_NOPTS_VALUE)
+    {
+      // Without timestamps the frames of two ranges can't be told apart.
+      av_packet_unref(&pkt);
+      count = 0;
+      break;
+    }
+
+    if(pkt.flags & AV_PKT_FLAG_KEY)
+    {
+      if(count == max_count)
+      {
+        KeyframeInfo* grown;
+        max_count = max_count ? max_count * 2 : 256;
+        grown = realloc(list, max_count * sizeof(KeyframeInfo));
+        if(grown == NULL)
+        {
+          av_packet_unref(&pkt);
+          free(list);
+          return -1;
+        }
+        list = grown;
+      }
+
+      list[count].pts = pts;
+      list[count].packet_no = packet_no;
+      list[count].closed = 1;
+      count++;
+    }
+    else if(count > 0 && pts < list[count - 1].pts)
+    {
+      list[count - 1].closed = 0;
+    }
+
+    packet_no++;
+    av_packet_unref(&pkt);
+  } // while
+
+  stats->keyframes = count;
+  for(index = 0; index < count; index++)
+  {
+    stats->open_keyframes += !list[index].closed;
+  }
+
+  *keyframes = list;
+  *nb_keyframes = count;
+  *nb_packets = packet_no;
+
+  return 0;
+}
+
+// Splits at closed keyframes, into ranges of about the same number of
+// packets, CHUNKS_PER_WORKER per worker for short files and at most
+// MAX_CHUNK_PACKETS long for the others.
+static int make_chunks(GopDecoder* decoder, const KeyframeInfo* keyframes, int nb_keyframes,
+                       int64_t nb_packets, int nb_workers)
+{
+  int64_t chunk_packets = FFMIN(nb_packets / (nb_workers * CHUNKS_PER_WORKER), MAX_CHUNK_PACKETS);
+  int64_t chunk_start = 0;
+  int index, nb_chunks = 0;
+
+  // At most one range per keyframe.
+  decoder->chunks = calloc(FFMAX(nb_keyframes, 1), sizeof(GopChunk));
+  if(decoder->chunks == NULL)
+  {
+    return -1;
+  }
+
+  decoder->chunks[0].start_pts = (nb_keyframes > 0) ? keyframes[0].pts : INT64_MIN;
+  decoder->chunks[0].min_pts = INT64_MIN;
+  nb_chunks = 1;
+
+  for(index = 1; index < nb_keyframes; index++)
+  {
+    if(!keyframes[index].closed || keyframes[index].packet_no - chunk_start < chunk_packets)
+    {
+      continue;
+    }
+
+    decoder->chunks[nb_chunks - 1].end_pts = keyframes[index].pts;
+    decoder->chunks[nb_chunks].start_pts = keyframes[index].pts;
+    decoder->chunks[nb_chunks].min_pts = keyframes[index].pts;
+    chunk_start = keyframes[index].packet_no;
+    nb_chunks++;
+  } // for
+
+  decoder->chunks[nb_chunks - 1].end_pts = INT64_MAX;
+  decoder->nb_chunks = nb_chunks;
+
+  return 0;
+}
+
+// Hands a frame of chunk over to the delivering thread, first waiting for
+// the buffered frames to drop under the budget unless chunk is the one
+// being delivered, which must never wait or delivery would stall.
+static int add_frame(GopDecoder* decoder, GopChunk* chunk, AVFrame* frame)
+{
+  int chunk_index = (int)(chunk - decoder->chunks);
+  AVFrame* copy = av_frame_alloc();
+  int ret = 0;
+
+  if(copy == NULL)
+  {
+    return -1;
+  }
+  av_frame_move_ref(copy, frame);
+
+  pthread_mutex_lock(&decoder->lock);
+  while(!decoder->abort && chunk_index != decoder->delivered_chunks &&
+    decoder->buffered >= decoder->frame_budget)
+  {
+    pthread_cond_wait(&decoder->cond, &decoder->lock);
+  } // while
+
+  if(!decoder->abort && chunk->nb_frames == chunk->max_frames)
+  {
+    int max_frames = chunk->max_frames ? chunk->max_frames * 2 : 64;
+    AVFrame** grown = realloc(chunk->frames, max_frames * sizeof(AVFrame*));
+    if(grown != NULL)
+    {
+      chunk->frames = grown;
+      chunk->max_frames = max_frames;
+    }
+  }
+
+  if(decoder->abort)
+  {
+    // Delivery has stopped, nobody would free the frame.
+    ret = -3;
+  }
+  else if(chunk->nb_frames < chunk->max_frames)
+  {
+    chunk->frames[chunk->nb_frames++] = copy;
+    copy = NULL;
+    decoder->buffered++;
+    if(decoder->buffered > decoder->peak_buffered)
+    {
+      decoder->peak_buffered = decoder->buffered;
+    }
+    pthread_cond_broadcast(&decoder->cond);
+  }
+  else
+  {
+    ret = -2;
+  }
+  pthread_mutex_unlock(&decoder->lock);
+
+  av_frame_free(&copy);
+  return ret;
+}
+
+// Sends pkt, or NULL at the end of the range, and keeps the frames that
+// belong to chunk. Corrupt data is skipped like in the serial decode, so
+// that it doesn't stop the other workers.
+static int decode_chunk_packet(GopWorker* worker, GopChunk* chunk, AVPacket* pkt, AVFrame* frame)
+{
+  int64_t pts;
+  int ret;
+
+  ret = avcodec_send_packet(worker->codec_ctx, pkt);
+  if(ret == AVERROR_INVALIDDATA)
+  {
+    printf("Failed to decode video packet, skipped\n");
+    return 0;
+  }
+  else if(ret < 0)
+  {
+    return -1;
+  }
+
+  while((ret = avcodec_receive_frame(worker->codec_ctx, frame)) >= 0)
+  {
+    // Frames of the previous range, when the seek landed early.
+    pts = frame_pts(frame);
+    if(pts != AV_NOPTS_VALUE && (pts < chunk->min_pts || pts >= chunk->end_pts))
+    {
+      av_frame_unref(frame);
+      continue;
+    }
+
+    if(add_frame(worker->decoder, chunk, frame) < 0)
+    {
+      av_frame_unref(frame);
+      return -2;
+    }
+  } // while
+
+  if(ret == AVERROR_INVALIDDATA)
+  {
+    printf("Failed to decode video frame, skipped\n");
+    return 0;
+  }
+
+  return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+}
+
+static int decode_chunk(GopWorker* worker, GopChunk* chunk, AVFrame* frame)
+{
+  AVFormatContext* fmt_ctx = worker->fmt_ctx;
+  AVPacket pkt;
+  int ret = 0;
+
+  // Back to the start when the keyframes are unknown, with stream_index -1
+  // in AV_TIME_BASE.
+  if(chunk->start_pts == INT64_MIN)
+  {
+    ret = avformat_seek_file(fmt_ctx, -1, INT64_MIN,
+      (fmt_ctx->start_time != AV_NOPTS_VALUE) ? fmt_ctx->start_time : 0, INT64_MAX, 0);
+  }
+  else
+  {
+    ret = av_seek_frame(fmt_ctx, worker->stream_index, chunk->start_pts, AVSEEK_FLAG_BACKWARD);
+  }
+
+  if(ret < 0)
+  {
+    printf("Failed to seek to keyframe %" PRId64 "\n", chunk->start_pts);
+    return -1;
+  }
+  avcodec_flush_buffers(worker->codec_ctx);
+
+  while(ret >= 0 && av_read_frame(worker->fmt_ctx, &pkt) >= 0)
+  {
+    if(pkt.stream_index != worker->stream_index)
+    {
+      av_packet_unref(&pkt);
+      continue;
+    }
+
+    // The keyframe of the next range.
+    if((pkt.flags & AV_PKT_FLAG_KEY) && pkt.pts != AV_NOPTS_VALUE && pkt.pts >= chunk->end_pts)
+    {
+      av_packet_unref(&pkt);
+      break;
+    }
+
+    ret = decode_chunk_packet(worker, chunk, &pkt, frame);
+    av_packet_unref(&pkt);
+  } // while
+
+  if(ret >= 0)
+  {
+    ret = decode_chunk_packet(worker, chunk, NULL, frame);
+  }
+
+  return ret;
+}
+
+static void* gop_worker_main(void* arg)
+{
+  GopWorker* worker = (GopWorker*)arg;
+  GopDecoder* decoder = worker->decoder;
+  AVFrame* frame = av_frame_alloc();
+  GopChunk* chunk;
+  int ret = (frame != NULL) ? 0 : -1;
+
+  while(ret >= 0)
+  {
+    pthread_mutex_lock(&decoder->lock);
+    while(!decoder->abort && decoder->next_chunk < decoder->nb_chunks &&
+      decoder->next_chunk >= decoder->delivered_chunks + decoder->window)
+    {
+      pthread_cond_wait(&decoder->cond, &decoder->lock);
+    } // while
+
+    if(decoder->abort || decoder->next_chunk >= decoder->nb_chunks)
+    {
+      pthread_mutex_unlock(&decoder->lock);
+      break;
+    }
+    chunk = &decoder->chunks[decoder->next_chunk++];
+    pthread_mutex_unlock(&decoder->lock);
+
+    ret = decode_chunk(worker, chunk, frame);
+
+    pthread_mutex_lock(&decoder->lock);
+    chunk->done = 1;
+    if(ret < 0)
+    {
+      decoder->abort = 1;
+    }
+    pthread_cond_broadcast(&decoder->cond);
+    pthread_mutex_unlock(&decoder->lock);
+  } // while
+
+  worker->error = ret;
+  av_frame_free(&frame);
+
+  return NULL;
+}
+
+// Hands the frames to callback range by range, each range in the order its
+// decoder returned them, which is presentation order.
+static int deliver_frames(GopDecoder* decoder, GopFrameCallback callback, void* opaque,
+                          GopDecodeStats* stats)
+{
+  GopChunk* chunk;
+  AVFrame* frame;
+  int index, ret = 0;
+
+  for(index = 0; index < decoder->nb_chunks && ret >= 0; index++)
+  {
+    chunk = &decoder->chunks[index];
+
+    while(ret >= 0)
+    {
+      pthread_mutex_lock(&decoder->lock);
+      while(!decoder->abort && !chunk->done && chunk->next_frame == chunk->nb_frames)
+      {
+        pthread_cond_wait(&decoder->cond, &decoder->lock);
+      } // while
+
+      frame = NULL;
+      if(chunk->next_frame < chunk->nb_frames)
+      {
+        frame = chunk->frames[chunk->next_frame];
+        chunk->frames[chunk->next_frame++] = NULL;
+        // Wakes up the workers waiting for room under the budget.
+        if(decoder->buffered-- == decoder->frame_budget)
+        {
+          pthread_cond_broadcast(&decoder->cond);
+        }
+      }
+      else if(decoder->abort)
+      {
+        ret = -1;
+      }
+      pthread_mutex_unlock(&decoder->lock);
+
+      if(frame == NULL)
+      {
+        break;
+      }
+
+      stats->frames++;
+      ret = callback(opaque, frame);
+      av_frame_free(&frame);
+    } // while
+
+    pthread_mutex_lock(&decoder->lock);
+    if(ret < 0)
+    {
+      decoder->abort = 1;
+    }
+    decoder->delivered_chunks = index + 1;
+    pthread_cond_broadcast(&decoder->cond);
+    pthread_mutex_unlock(&decoder->lock);
+  } // for
+
+  return ret;
+}
+
+static void free_chunks(GopDecoder* decoder)
+{
+  int index, frame_index;
+
+  for(index = 0; decoder->chunks != NULL && index < decoder->nb_chunks; index++)
+  {
+    GopChunk* chunk = &decoder->chunks[index];
+    for(frame_index = chunk->next_frame; frame_index < chunk->nb_frames; frame_index++)
+    {
+      av_frame_free(&chunk->frames[frame_index]);
+    }
+    free(chunk->frames);
+  } // for
+
+  free(decoder->chunks);
+  decoder->chunks = NULL;
+}
+
+int gop_decode_file(const char* filename, const InputOptions* input_options,
+                    const DecodeOptions* options, int nb_workers,
+                    GopFrameCallback callback, void* opaque, GopDecodeStats* stats)
+{
+  GopDecoder decoder;
+  GopWorker* workers;
+  KeyframeInfo* keyframes = NULL;
+  int64_t start_time, nb_packets = 0;
+  int nb_keyframes = 0;
+  int index, started = 0;
+  int ret = 0;
+
+  memset(stats, 0, sizeof(*stats));
+  memset(&decoder, 0, sizeof(decoder));
+  stats->workers = nb_workers;
+
+  workers = calloc(nb_workers, sizeof(GopWorker));
+  if(workers == NULL)
+  {
+    return -1;
+  }
+
+  // Every worker reads the file on its own.
+  for(index = 0; index < nb_workers && ret >= 0; index++)
+  {
+    workers[index].decoder = &decoder;
+    ret = open_decoder(filename, input_options, options, &workers[index]);
+  }
+
+  if(ret >= 0)
+  {
+    start_time = av_gettime_relative();
+    ret = scan_keyframes(&workers[0], &keyframes, &nb_keyframes, &nb_packets, stats);
+    stats->scan_time = av_gettime_relative() - start_time;
+  }
+
+  if(ret >= 0)
+  {
+    ret = make_chunks(&decoder, keyframes, nb_keyframes, nb_packets, nb_workers);
+  }
+  free(keyframes);
+
+  if(ret < 0)
+  {
+    goto gop_end;
+  }
+
+  stats->chunks = decoder.nb_chunks;
+  decoder.window = nb_workers + 1;
+  decoder.frame_budget = (int64_t)nb_workers * FRAMES_PER_WORKER;
+  stats->frame_budget = decoder.frame_budget;
+  pthread_mutex_init(&decoder.lock, NULL);
+  pthread_cond_init(&decoder.cond, NULL);
+
+  start_time = av_gettime_relative();
+  for(index = 0; index < nb_workers; index++)
+  {
+    if(pthread_create(&workers[index].thread, NULL, gop_worker_main, &workers[index]) == 0)
+    {
+      workers[index].started = 1;
+      started++;
+    }
+  } // for
+
+  if(started == 0)
+  {
+    printf("Failed to start decoder threads\n");
+    decoder.abort = 1;
+  }
+
+  ret = deliver_frames(&decoder, callback, opaque, stats);
+
+  for(index = 0; index < nb_workers; index++)
+  {
+    if(workers[index].started)
+    {
+      pthread_join(workers[index].thread, NULL);
+      if(workers[index].error < 0)
+      {
+        ret = workers[index].error;
+      }
+    }
+  } // for
+  stats->decode_time = av_gettime_relative() - start_time;
+  stats->peak_buffered = decoder.peak_buffered;
+
+  pthread_cond_destroy(&decoder.cond);
+  pthread_mutex_destroy(&decoder.lock);
+
+gop_end:
+  free_chunks(&decoder);
+  for(index = 0; index < nb_workers; index++)
+  {
+    close_decoder(&workers[index]);
+  }
+  free(workers);
+
+  return ret;
+}
+
+void gop_decode_print_stats(const GopDecodeStats* stats)
+{
+  printf("------- GOP split decode -------\n");
+  printf("%d workers / %d ranges / %" PRId64 " keyframes, %" PRId64 " open\n",
+    stats->workers, stats->chunks, stats->keyframes, stats->open_keyframes);
+  printf("%" PRId64 " frames in %.3f sec, %.1f fps / scan %.3f sec / peak %" PRId64 " frames buffered, budget %" PRId64 "\n",
+    stats->frames, stats->decode_time / 1000000.0,
+    stats->decode_time > 0 ? stats->frames * 1000000.0 / stats->decode_time : 0.0,
+    stats->scan_time / 1000000.0, stats->peak_buffered, stats->frame_budget);
+}
@@ -0,0 +1,44 @@
+#ifndef GOP_DECODER_H
+#define GOP_DECODER_H
+
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+
+#include "decode_options.h"
+#include "media_input.h"
+
+// Called in presentation order on the calling thread. The frame is freed
+// after it returns; a negative return stops the decode.
+typedef int (*GopFrameCallback)(void* opaque, AVFrame* frame);
+
+typedef struct _GopDecodeStats
+{
+  int workers;
+  int chunks;
+  int64_t keyframes;
+  // Keyframes that a later packet of their GOP shows before, so the file
+  // can't be split there.
+  int64_t open_keyframes;
+  int64_t frames;
+  // Frames decoded ahead and held until their turn, and the number past
+  // which the workers ahead of delivery wait.
+  int64_t peak_buffered;
+  int64_t frame_budget;
+  // Time of the pass over the packets that finds the split points, and of
+  // the decode, in microseconds.
+  int64_t scan_time;
+  int64_t decode_time;
+} GopDecodeStats;
+
+// Decodes the first video stream of filename with nb_workers decoders, each
+// with its own AVFormatContext and AVCodecContext, on ranges of the file
+// split at closed-GOP keyframes. The frames of the ranges are put back in
+// order before they reach callback. With a thread_count of 0 in options,
+// each decoder gets one thread.
+int gop_decode_file(const char* filename, const InputOptions* input_options,
+                    const DecodeOptions* options, int nb_workers,
+                    GopFrameCallback callback, void* opaque, GopDecodeStats* stats);
+
+void gop_decode_print_stats(const GopDecodeStats* stats);
+
+#endif
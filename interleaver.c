@@ -0,0 +1,226 @@
+#include "interleaver.h"
+
+#include <libavutil/mem.h>
+#include <stdio.h>
+#include <string.h>
+
+static int64_t packet_time(const AVPacket* pkt)
+{
+  return (pkt->dts != AV_NOPTS_VALUE) ? pkt->dts : pkt->pts;
+}
+
+// Queued packet with the lowest timestamp, NULL if nothing is queued.
+// ready is cleared if an active stream has nothing queued.
+static InterleaverStream* next_stream(Interleaver* interleaver, int* ready)
+{
+  InterleaverStream* best = NULL;
+  AVRational best_tb = { 0, 1 };
+  int64_t best_ts = 0;
+  unsigned int index;
+
+  *ready = 1;
+  for(index = 0; index < interleaver->nb_streams; index++)
+  {
+    InterleaverStream* stream = &interleaver->streams[index];
+    AVRational time_base = interleaver->fmt_ctx->streams[index]->time_base;
+    int64_t ts;
+
+    if(stream->head == NULL)
+    {
+      if(stream->active)
+      {
+        *ready = 0;
+      }
+      continue;
+    }
+
+    // Packets without timestamps go out in arrival order.
+    ts = packet_time(stream->head->pkt);
+    if(best == NULL || ts == AV_NOPTS_VALUE ||
+      (best_ts != AV_NOPTS_VALUE && av_compare_ts(ts, time_base, best_ts, best_tb) < 0))
+    {
+      best = stream;
+      best_ts = ts;
+      best_tb = time_base;
+    }
+  } // for
+
+  return best;
+}
+
+static int write_head(Interleaver* interleaver, InterleaverStream* stream)
+{
+  InterleaverPacket* entry = stream->head;
+  int ret;
+
+  stream->head = entry->next;
+  if(stream->head == NULL)
+  {
+    stream->tail = NULL;
+  }
+
+  interleaver->buffered_bytes -= entry->pkt->size;
+  interleaver->packets++;
+
+  // av_write_frame() does not take the reference.
+  ret = av_write_frame(interleaver->fmt_ctx, entry->pkt);
+  av_packet_unref(entry->pkt);
+
+  entry->next = interleaver->free_list;
+  interleaver->free_list = entry;
+
+  return ret;
+}
+
+static int drain(Interleaver* interleaver, int flush)
+{
+  InterleaverStream* stream;
+  int ready;
+
+  while((stream = next_stream(interleaver, &ready)) != NULL)
+  {
+    if(!ready && !flush)
+    {
+      if(interleaver->buffered_bytes <= interleaver->budget)
+      {
+        break;
+      }
+      interleaver->forced_writes++;
+    }
+
+    if(write_head(interleaver, stream) < 0)
+    {
+      return -1;
+    }
+  } // while
+
+  return 0;
+}
+
+int interleaver_init(Interleaver* interleaver, AVFormatContext* fmt_ctx, int64_t budget)
+{
+  unsigned int index;
+
+  memset(interleaver, 0, sizeof(Interleaver));
+
+  interleaver->streams = av_calloc(fmt_ctx->nb_streams, sizeof(InterleaverStream));
+  if(interleaver->streams == NULL)
+  {
+    return -1;
+  }
+
+  interleaver->fmt_ctx = fmt_ctx;
+  interleaver->nb_streams = fmt_ctx->nb_streams;
+  interleaver->budget = budget;
+
+  // Like av_interleaved_write_frame(), every stream is waited for until
+  // it ends.
+  for(index = 0; index < interleaver->nb_streams; index++)
+  {
+    interleaver->streams[index].active = 1;
+  }
+
+  return 0;
+}
+
+int interleaver_write(Interleaver* interleaver, AVPacket* pkt)
+{
+  InterleaverStream* stream;
+  InterleaverPacket* entry;
+
+  if(pkt->stream_index < 0 || (unsigned int)pkt->stream_index >= interleaver->nb_streams)
+  {
+    av_packet_unref(pkt);
+    return -1;
+  }
+
+  entry = interleaver->free_list;
+  if(entry != NULL)
+  {
+    interleaver->free_list = entry->next;
+  }
+  else
+  {
+    entry = av_mallocz(sizeof(InterleaverPacket));
+    if(entry == NULL || (entry->pkt = av_packet_alloc()) == NULL)
+    {
+      av_free(entry);
+      av_packet_unref(pkt);
+      return -2;
+    }
+  }
+
+  av_packet_move_ref(entry->pkt, pkt);
+  entry->next = NULL;
+
+  stream = &interleaver->streams[entry->pkt->stream_index];
+  if(stream->tail != NULL)
+  {
+    stream->tail->next = entry;
+  }
+  else
+  {
+    stream->head = entry;
+  }
+  stream->tail = entry;
+
+  interleaver->buffered_bytes += entry->pkt->size;
+  if(interleaver->buffered_bytes > interleaver->peak_bytes)
+  {
+    interleaver->peak_bytes = interleaver->buffered_bytes;
+  }
+
+  return drain(interleaver, 0);
+}
+
+int interleaver_end_stream(Interleaver* interleaver, int index)
+{
+  if(index < 0 || (unsigned int)index >= interleaver->nb_streams)
+  {
+    return -1;
+  }
+
+  interleaver->streams[index].active = 0;
+
+  return drain(interleaver, 0);
+}
+
+int interleaver_flush(Interleaver* interleaver)
+{
+  return drain(interleaver, 1);
+}
+
+static void free_entries(InterleaverPacket* entry)
+{
+  InterleaverPacket* next;
+
+  for(; entry != NULL; entry = next)
+  {
+    next = entry->next;
+    av_packet_free(&entry->pkt);
+    av_free(entry);
+  }
+}
+
+void interleaver_uninit(Interleaver* interleaver)
+{
+  unsigned int index;
+
+  if(interleaver->streams != NULL)
+  {
+    for(index = 0; index < interleaver->nb_streams; index++)
+    {
+      free_entries(interleaver->streams[index].head);
+    }
+    av_freep(&interleaver->streams);
+  }
+
+  free_entries(interleaver->free_list);
+  interleaver->free_list = NULL;
+}
+
+void interleaver_print_stats(const Interleaver* interleaver)
+{
+  printf("interleaver : %" PRId64 " packets, peak %" PRId64 " bytes buffered (budget %" PRId64 "), %" PRId64 " forced writes\n",
+    interleaver->packets, interleaver->peak_bytes, interleaver->budget, interleaver->forced_writes);
+}
@@ -0,0 +1,61 @@
+#ifndef INTERLEAVER_H
+#define INTERLEAVER_H
+
+#include <libavformat/avformat.h>
+
+// Replacement for av_interleaved_write_frame() with a memory budget.
+// Packets are queued per stream and written with av_write_frame() in dts
+// order once every stream that has not ended has one queued, so that a
+// stream which starts late, video behind an encoder lookahead for example,
+// still starts interleaved. When the queued bytes exceed the budget, the
+// oldest packet is written without waiting for the missing streams,
+// trading strict interleaving for memory.
+
+typedef struct _InterleaverPacket
+{
+  AVPacket* pkt;
+  struct _InterleaverPacket* next;
+} InterleaverPacket;
+
+typedef struct _InterleaverStream
+{
+  InterleaverPacket* head;
+  InterleaverPacket* tail;
+  // Cleared by interleaver_end_stream(), only active streams are waited for.
+  int active;
+} InterleaverStream;
+
+typedef struct _Interleaver
+{
+  AVFormatContext* fmt_ctx;
+  InterleaverStream* streams;
+  unsigned int nb_streams;
+  // Recycled queue entries, with their AVPacket.
+  InterleaverPacket* free_list;
+
+  int64_t budget;
+  int64_t buffered_bytes;
+  int64_t peak_bytes;
+  int64_t packets;
+  // Packets written early because of the budget.
+  int64_t forced_writes;
+} Interleaver;
+
+// Call after avformat_write_header(). budget is in bytes.
+int interleaver_init(Interleaver* interleaver, AVFormatContext* fmt_ctx, int64_t budget);
+
+// Takes over the reference of pkt, which is blank on return.
+int interleaver_write(Interleaver* interleaver, AVPacket* pkt);
+
+// Tells that stream index will get no more packets, so that the others
+// are no longer held back waiting for it.
+int interleaver_end_stream(Interleaver* interleaver, int index);
+
+// Writes every queued packet, e.g. before av_write_trailer().
+int interleaver_flush(Interleaver* interleaver);
+
+void interleaver_uninit(Interleaver* interleaver);
+
+void interleaver_print_stats(const Interleaver* interleaver);
+
+#endif
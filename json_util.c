@@ -0,0 +1,22 @@
+#include "json_util.h"
+
+void json_write_string(FILE* fp, const char* str)
+{
+  fputc('"', fp);
+  for(; *str != '\0'; str++)
+  {
+    if(*str == '"' || *str == '\\')
+    {
+      fprintf(fp, "\\%c", *str);
+    }
+    else if((unsigned char)*str < 0x20)
+    {
+      fprintf(fp, "\\u%04x", *str);
+    }
+    else
+    {
+      fputc(*str, fp);
+    }
+  }
+  fputc('"', fp);
+}
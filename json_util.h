@@ -0,0 +1,10 @@
+#ifndef JSON_UTIL_H
+#define JSON_UTIL_H
+
+#include <stdio.h>
+
+// Writes str as a quoted JSON string, escaping quotes, backslashes and
+// control characters. Other bytes, UTF-8 included, go out as they are.
+void json_write_string(FILE* fp, const char* str);
+
+#endif
@@ -0,0 +1,131 @@
+#include "latency_hist.h"
+
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+// log2 of LATENCY_HIST_SUB_BUCKETS.
+#define SUB_BUCKET_BITS 3
+
+int64_t latency_now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void latency_hist_init(LatencyHist* hist)
+{
+  memset(hist, 0, sizeof(*hist));
+}
+
+// Values below LATENCY_HIST_SUB_BUCKETS get a bucket each. Above, the
+// highest bit picks the power of two and the next SUB_BUCKET_BITS bits the
+// bucket within it.
+static int bucket_of(int64_t value)
+{
+  int msb, index;
+
+  if(value < LATENCY_HIST_SUB_BUCKETS)
+  {
+    return value < 0 ? 0 : (int)value;
+  }
+
+  msb = 63 - __builtin_clzll((uint64_t)value);
+  index = (msb - SUB_BUCKET_BITS + 1) * LATENCY_HIST_SUB_BUCKETS +
+    (int)((value >> (msb - SUB_BUCKET_BITS)) & (LATENCY_HIST_SUB_BUCKETS - 1));
+
+  return index < LATENCY_HIST_BUCKETS ? index : LATENCY_HIST_BUCKETS - 1;
+}
+
+static int64_t bucket_lower_bound(int index)
+{
+  int shift = index / LATENCY_HIST_SUB_BUCKETS - 1;
+
+  if(shift < 0)
+  {
+    return index;
+  }
+
+  return (int64_t)(LATENCY_HIST_SUB_BUCKETS + index % LATENCY_HIST_SUB_BUCKETS) << shift;
+}
+
+void latency_hist_add(LatencyHist* hist, int64_t nanoseconds)
+{
+  if(hist->count == 0 || nanoseconds < hist->min)
+  {
+    hist->min = nanoseconds;
+  }
+  if(nanoseconds > hist->max)
+  {
+    hist->max = nanoseconds;
+  }
+
+  hist->count++;
+  hist->sum += nanoseconds;
+  hist->buckets[bucket_of(nanoseconds)]++;
+}
+
+int64_t latency_hist_percentile(const LatencyHist* hist, double percentile)
+{
+  int64_t rank, seen = 0;
+  int index;
+
+  if(hist->count == 0)
+  {
+    return 0;
+  }
+
+  // The smallest value with at least percentile% of the samples at or below it.
+  rank = (int64_t)(hist->count * percentile / 100.0 + 0.999999);
+  if(rank < 1)
+  {
+    rank = 1;
+  }
+
+  for(index = 0; index < LATENCY_HIST_BUCKETS; index++)
+  {
+    seen += hist->buckets[index];
+    if(seen >= rank)
+    {
+      int64_t upper = bucket_lower_bound(index + 1) - 1;
+      return upper < hist->max ? upper : hist->max;
+    }
+  } // for
+
+  return hist->max;
+}
+
+void latency_hist_print(const LatencyHist* hist, const char* name)
+{
+  printf("%-16s %10" PRId64 " calls  mean %9.3f  p50 %9.3f  p99 %9.3f  p99.9 %9.3f  max %9.3f us\n",
+    name, hist->count, hist->count ? hist->sum / 1000.0 / hist->count : 0.0,
+    latency_hist_percentile(hist, 50.0) / 1000.0, latency_hist_percentile(hist, 99.0) / 1000.0,
+    latency_hist_percentile(hist, 99.9) / 1000.0, hist->max / 1000.0);
+}
+
+void latency_hist_write_json(FILE* fp, const LatencyHist* hist)
+{
+  int index, first = 1;
+
+  fprintf(fp, "{\"count\":%" PRId64 ",\"mean_us\":%.3f,\"min_us\":%.3f,\"p50_us\":%.3f,"
+    "\"p99_us\":%.3f,\"p999_us\":%.3f,\"max_us\":%.3f,\"buckets_ns\":[",
+    hist->count, hist->count ? hist->sum / 1000.0 / hist->count : 0.0, hist->min / 1000.0,
+    latency_hist_percentile(hist, 50.0) / 1000.0, latency_hist_percentile(hist, 99.0) / 1000.0,
+    latency_hist_percentile(hist, 99.9) / 1000.0, hist->max / 1000.0);
+
+  for(index = 0; index < LATENCY_HIST_BUCKETS; index++)
+  {
+    if(hist->buckets[index] == 0)
+    {
+      continue;
+    }
+
+    fprintf(fp, "%s[%" PRId64 ",%" PRId64 "]", first ? "" : ",",
+      bucket_lower_bound(index), hist->buckets[index]);
+    first = 0;
+  } // for
+
+  fprintf(fp, "]}");
+}
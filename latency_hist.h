@@ -0,0 +1,39 @@
+#ifndef LATENCY_HIST_H
+#define LATENCY_HIST_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Latencies in nanoseconds, counted in 8 buckets per power of two, so a
+// percentile is off by at most 12.5% and the size does not depend on the
+// number of samples. Values up to 2^41 ns (about 36 minutes) are told apart.
+#define LATENCY_HIST_SUB_BUCKETS 8
+#define LATENCY_HIST_BUCKETS (40 * LATENCY_HIST_SUB_BUCKETS)
+
+typedef struct _LatencyHist
+{
+  int64_t count;
+  int64_t sum;
+  int64_t min;
+  int64_t max;
+  int64_t buckets[LATENCY_HIST_BUCKETS];
+} LatencyHist;
+
+// Monotonic clock in nanoseconds.
+int64_t latency_now();
+
+void latency_hist_init(LatencyHist* hist);
+void latency_hist_add(LatencyHist* hist, int64_t nanoseconds);
+
+// percentile in 0-100. Returns the upper bound of the bucket it falls in,
+// clamped to the largest value seen.
+int64_t latency_hist_percentile(const LatencyHist* hist, double percentile);
+
+// One line of count, mean, p50, p99, p99.9 and max, in microseconds.
+void latency_hist_print(const LatencyHist* hist, const char* name);
+
+// A JSON object with the same figures, and the non-empty buckets as
+// [lower bound in ns, count] pairs.
+void latency_hist_write_json(FILE* fp, const LatencyHist* hist);
+
+#endif
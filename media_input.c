@@ -0,0 +1,215 @@
+#include "media_input.h"
+#include "mmap_io.h"
+#include "readahead_io.h"
+
+#include <libavutil/time.h>
+#include <stdio.h>
+
+// Defaults for fast probe. libavformat uses 5000000 bytes and 5 seconds.
+static const int64_t fast_probesize = 256 * 1024;
+static const int64_t fast_analyzeduration = 500000;
+// Default read-ahead window, 8 blocks of 1 MiB.
+static const int readahead_blocks = 8;
+static const int readahead_block_size = 1024 * 1024;
+
+// Custom I/O attached to an input, kept in AVFormatContext.opaque so that
+// close_media_input() knows how to release it.
+typedef struct _CustomIO
+{
+  int (*open)(AVIOContext** pb, const char* filename, const InputOptions* options);
+  void (*close)(AVIOContext** pb);
+  // May be NULL.
+  void (*print_stats)(AVIOContext* pb);
+} CustomIO;
+
+static int open_mmap_io(AVIOContext** pb, const char* filename, const InputOptions* options)
+{
+  return mmap_io_open(pb, filename);
+}
+
+static int open_readahead_io(AVIOContext** pb, const char* filename, const InputOptions* options)
+{
+  return readahead_io_open(pb, filename, options->readahead_blocks, options->readahead_block_size);
+}
+
+static const CustomIO mmap_custom_io = { open_mmap_io, mmap_io_close, NULL };
+static const CustomIO readahead_custom_io = { open_readahead_io, readahead_io_close, readahead_io_print_stats };
+
+void init_input_options(InputOptions* options)
+{
+  options->fast_probe = 0;
+  options->need_formats = 0;
+  options->probesize = fast_probesize;
+  options->analyzeduration = fast_analyzeduration;
+  options->io_mode = INPUT_IO_DEFAULT;
+  options->readahead_blocks = readahead_blocks;
+  options->readahead_block_size = readahead_block_size;
+}
+
+static const CustomIO* get_custom_io(enum InputIOMode io_mode)
+{
+  switch(io_mode)
+  {
+  case INPUT_IO_MMAP:
+    return &mmap_custom_io;
+  case INPUT_IO_READAHEAD:
+    return &readahead_custom_io;
+  default:
+    return NULL;
+  }
+}
+
+// Returns 1 if the demuxer filled in everything a scan or a decoder setup
+// needs from the container headers alone, and the formats with need_formats.
+static int has_header_info(AVFormatContext* fmt_ctx, int need_formats)
+{
+  unsigned int index;
+
+  if(fmt_ctx->nb_streams == 0 || (fmt_ctx->ctx_flags & AVFMTCTX_NOHEADER))
+  {
+    return 0;
+  }
+
+  for(index = 0; index < fmt_ctx->nb_streams; index++)
+  {
+    AVCodecParameters* codecpar = fmt_ctx->streams[index]->codecpar;
+    if(codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+    {
+      if(codecpar->codec_id == AV_CODEC_ID_NONE || (need_formats && codecpar->format < 0) ||
+        codecpar->width <= 0 || codecpar->height <= 0)
+      {
+        return 0;
+      }
+    }
+    else if(codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+    {
+      if(codecpar->codec_id == AV_CODEC_ID_NONE || (need_formats && codecpar->format < 0) ||
+        codecpar->sample_rate <= 0 || codecpar->channels <= 0)
+      {
+        return 0;
+      }
+    }
+  } // for
+
+  return 1;
+}
+
+int open_media_input(AVFormatContext** fmt_ctx, const char* filename,
+                     const InputOptions* options, ProbeStats* stats)
+{
+  AVDictionary* format_opts = NULL;
+  const CustomIO* custom_io = NULL;
+  AVIOContext* pb = NULL;
+  int64_t start_time = av_gettime_relative();
+  int skipped = 0;
+  int ret;
+
+  if(options != NULL)
+  {
+    custom_io = get_custom_io(options->io_mode);
+  }
+
+  if(custom_io != NULL)
+  {
+    if(custom_io->open(&pb, filename, options) < 0)
+    {
+      return -1;
+    }
+
+    *fmt_ctx = avformat_alloc_context();
+    if(*fmt_ctx == NULL)
+    {
+      custom_io->close(&pb);
+      return -1;
+    }
+
+    (*fmt_ctx)->pb = pb;
+    (*fmt_ctx)->opaque = (void*)custom_io;
+  }
+
+  if(options != NULL && options->fast_probe)
+  {
+    av_dict_set_int(&format_opts, "probesize", options->probesize, 0);
+    av_dict_set_int(&format_opts, "analyzeduration", options->analyzeduration, 0);
+    // Do not decode extra frames only to guess the frame rate.
+    av_dict_set_int(&format_opts, "fpsprobesize", 0, 0);
+  }
+
+  ret = avformat_open_input(fmt_ctx, filename, NULL, &format_opts);
+  av_dict_free(&format_opts);
+  if(ret < 0)
+  {
+    // avformat_open_input() frees the context, but never a custom pb.
+    if(custom_io != NULL)
+    {
+      custom_io->close(&pb);
+    }
+    return -1;
+  }
+
+  if(options != NULL && options->fast_probe && has_header_info(*fmt_ctx, options->need_formats))
+  {
+    skipped = 1;
+  }
+  else if(avformat_find_stream_info(*fmt_ctx, NULL) < 0)
+  {
+    close_media_input(fmt_ctx);
+    return -2;
+  }
+
+  if(stats != NULL)
+  {
+    stats->bytes_read = ((*fmt_ctx)->pb != NULL) ? (*fmt_ctx)->pb->bytes_read : 0;
+    stats->probe_time = av_gettime_relative() - start_time;
+    stats->stream_info_skipped = skipped;
+  }
+
+  return 0;
+}
+
+void close_media_input(AVFormatContext** fmt_ctx)
+{
+  const CustomIO* custom_io = NULL;
+  AVIOContext* pb = NULL;
+
+  if(*fmt_ctx == NULL)
+  {
+    return;
+  }
+
+  if((*fmt_ctx)->flags & AVFMT_FLAG_CUSTOM_IO)
+  {
+    custom_io = (const CustomIO*)(*fmt_ctx)->opaque;
+    pb = (*fmt_ctx)->pb;
+  }
+
+  avformat_close_input(fmt_ctx);
+
+  if(custom_io != NULL)
+  {
+    custom_io->close(&pb);
+  }
+}
+
+void print_probe_stats(const ProbeStats* stats)
+{
+  printf("probe : %" PRId64 " bytes read / %.3f ms%s\n",
+    stats->bytes_read, stats->probe_time / 1000.0,
+    stats->stream_info_skipped ? " (stream info from headers)" : "");
+}
+
+void print_input_io_stats(AVFormatContext* fmt_ctx)
+{
+  const CustomIO* custom_io;
+
+  if(fmt_ctx == NULL || !(fmt_ctx->flags & AVFMT_FLAG_CUSTOM_IO))
+  {
+    return;
+  }
+
+  custom_io = (const CustomIO*)fmt_ctx->opaque;
+  if(custom_io->print_stats != NULL)
+  {
+    custom_io->print_stats(fmt_ctx->pb);
+  }
+}
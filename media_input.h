@@ -0,0 +1,57 @@
+#ifndef MEDIA_INPUT_H
+#define MEDIA_INPUT_H
+
+#include <libavformat/avformat.h>
+
+enum InputIOMode
+{
+  INPUT_IO_DEFAULT,
+  // Read local files through a memory mapping, see mmap_io.h.
+  INPUT_IO_MMAP,
+  // Read through a background thread that fills buffers ahead of the
+  // demuxer, see readahead_io.h.
+  INPUT_IO_READAHEAD,
+};
+
+typedef struct _InputOptions
+{
+  // Fast probe caps the bytes and duration read while probing, and skips
+  // avformat_find_stream_info() entirely when the container headers
+  // already describe every stream : codec, picture size, sample rate and
+  // channels. mov, mkv and ts leave the pixel and sample formats of H.264
+  // and AAC unset, so they are only required with need_formats, for
+  // callers that set up filters from them before the first frame.
+  int fast_probe;
+  int need_formats;
+  int64_t probesize;
+  int64_t analyzeduration;
+  enum InputIOMode io_mode;
+  // Read-ahead window of INPUT_IO_READAHEAD, in blocks of block_size bytes.
+  int readahead_blocks;
+  int readahead_block_size;
+} InputOptions;
+
+typedef struct _ProbeStats
+{
+  int64_t bytes_read;
+  // Wall time spent in opening and probing, in microseconds.
+  int64_t probe_time;
+  int stream_info_skipped;
+} ProbeStats;
+
+void init_input_options(InputOptions* options);
+
+// Same as avformat_open_input() followed by avformat_find_stream_info(),
+// honoring the given options. stats may be NULL.
+int open_media_input(AVFormatContext** fmt_ctx, const char* filename,
+                     const InputOptions* options, ProbeStats* stats);
+
+// Closes the input and any custom AVIOContext opened for it.
+void close_media_input(AVFormatContext** fmt_ctx);
+
+void print_probe_stats(const ProbeStats* stats);
+
+// Prints the statistics of the custom AVIOContext of an input, if it has any.
+void print_input_io_stats(AVFormatContext* fmt_ctx);
+
+#endif
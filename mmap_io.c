@@ -0,0 +1,175 @@
+#include "mmap_io.h"
+
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+#include <libavutil/error.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Size of the buffer handed to avio_alloc_context().
+#define MMAP_IO_BUFFER_SIZE (64 * 1024)
+// How far ahead of the read position the kernel is asked to page in.
+#define MMAP_IO_WILLNEED_SIZE (8 * 1024 * 1024)
+
+typedef struct _MmapFile
+{
+  uint8_t* data;
+  int64_t size;
+  int64_t pos;
+  // Everything below this offset has been advised with MADV_WILLNEED.
+  int64_t advised_end;
+  long page_size;
+} MmapFile;
+
+static void advise_ahead(MmapFile* file)
+{
+  int64_t start, length;
+
+  if(file->pos + MMAP_IO_WILLNEED_SIZE / 2 < file->advised_end)
+  {
+    return;
+  }
+
+  // madvise() wants a page aligned address.
+  start = file->pos & ~((int64_t)file->page_size - 1);
+  length = FFMIN(MMAP_IO_WILLNEED_SIZE, file->size - start);
+  if(length > 0)
+  {
+    madvise(file->data + start, length, MADV_WILLNEED);
+  }
+
+  file->advised_end = start + length;
+}
+
+static int mmap_read_packet(void* opaque, uint8_t* buf, int buf_size)
+{
+  MmapFile* file = (MmapFile*)opaque;
+  int size;
+
+  if(file->pos >= file->size)
+  {
+    return AVERROR_EOF;
+  }
+
+  advise_ahead(file);
+
+  size = (int)FFMIN((int64_t)buf_size, file->size - file->pos);
+  memcpy(buf, file->data + file->pos, size);
+  file->pos += size;
+
+  return size;
+}
+
+static int64_t mmap_seek(void* opaque, int64_t offset, int whence)
+{
+  MmapFile* file = (MmapFile*)opaque;
+  int64_t pos;
+
+  switch(whence & ~AVSEEK_FORCE)
+  {
+  case AVSEEK_SIZE:
+    return file->size;
+  case SEEK_SET:
+    pos = offset;
+    break;
+  case SEEK_CUR:
+    pos = file->pos + offset;
+    break;
+  case SEEK_END:
+    pos = file->size + offset;
+    break;
+  default:
+    return AVERROR(EINVAL);
+  }
+
+  if(pos < 0 || pos > file->size)
+  {
+    return AVERROR(EINVAL);
+  }
+
+  file->pos = pos;
+  // Read-ahead starts over from the new position.
+  file->advised_end = 0;
+
+  return pos;
+}
+
+int mmap_io_open(AVIOContext** pb, const char* filename)
+{
+  MmapFile* file;
+  uint8_t* buffer;
+  struct stat st;
+  void* data;
+  int fd;
+
+  fd = open(filename, O_RDONLY);
+  if(fd < 0)
+  {
+    return AVERROR(errno);
+  }
+
+  if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+  {
+    close(fd);
+    return AVERROR(EINVAL);
+  }
+
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping stays valid after the descriptor is closed.
+  close(fd);
+  if(data == MAP_FAILED)
+  {
+    return AVERROR(errno);
+  }
+
+  // Demuxers read mostly forward, let the kernel read ahead aggressively.
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+  file = av_mallocz(sizeof(MmapFile));
+  buffer = av_malloc(MMAP_IO_BUFFER_SIZE);
+  if(file == NULL || buffer == NULL)
+  {
+    av_free(file);
+    av_free(buffer);
+    munmap(data, st.st_size);
+    return AVERROR(ENOMEM);
+  }
+
+  file->data = (uint8_t*)data;
+  file->size = st.st_size;
+  file->page_size = sysconf(_SC_PAGESIZE);
+
+  *pb = avio_alloc_context(buffer, MMAP_IO_BUFFER_SIZE, 0, file,
+    mmap_read_packet, NULL, mmap_seek);
+  if(*pb == NULL)
+  {
+    av_free(file);
+    av_free(buffer);
+    munmap(data, st.st_size);
+    return AVERROR(ENOMEM);
+  }
+
+  return 0;
+}
+
+void mmap_io_close(AVIOContext** pb)
+{
+  MmapFile* file;
+
+  if(*pb == NULL)
+  {
+    return;
+  }
+
+  file = (MmapFile*)(*pb)->opaque;
+  munmap(file->data, file->size);
+  av_free(file);
+
+  // The buffer may have been reallocated by libavformat, free the current one.
+  av_freep(&(*pb)->buffer);
+  avio_context_free(pb);
+}
@@ -0,0 +1,12 @@
+#ifndef MMAP_IO_H
+#define MMAP_IO_H
+
+#include <libavformat/avio.h>
+
+// Maps a local file and wraps it in a read-only, seekable AVIOContext.
+// Reads are served from the mapping instead of read() calls on the file.
+int mmap_io_open(AVIOContext** pb, const char* filename);
+
+void mmap_io_close(AVIOContext** pb);
+
+#endif
@@ -0,0 +1,178 @@
+#include "packet_pool.h"
+#include "ffmpeg_compat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PACKET_POOL_MIN_BUFFER (4 * 1024)
+
+int packet_pool_init(PacketPool* pool, int max_free)
+{
+  memset(pool, 0, sizeof(*pool));
+
+  pool->free_packets = calloc(max_free, sizeof(AVPacket*));
+  if(pool->free_packets == NULL)
+  {
+    return -1;
+  }
+
+  pool->max_free = max_free;
+  pthread_mutex_init(&pool->lock, NULL);
+
+  return 0;
+}
+
+void packet_pool_uninit(PacketPool* pool)
+{
+  int index;
+
+  for(index = 0; index < pool->nb_free; index++)
+  {
+    av_packet_free(&pool->free_packets[index]);
+  }
+
+  // Buffers still referenced by packets stay valid, the pools go away with the last one.
+  for(index = 0; index < PACKET_POOL_BUCKETS; index++)
+  {
+    av_buffer_pool_uninit(&pool->buffer_pools[index]);
+  }
+
+  free(pool->free_packets);
+  pool->free_packets = NULL;
+  pool->nb_free = 0;
+  pthread_mutex_destroy(&pool->lock);
+}
+
+AVPacket* packet_pool_get(PacketPool* pool)
+{
+  AVPacket* pkt = NULL;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->packet_gets++;
+  if(pool->nb_free > 0)
+  {
+    pkt = pool->free_packets[--pool->nb_free];
+  }
+  else
+  {
+    pool->packet_allocs++;
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if(pkt == NULL)
+  {
+    pkt = av_packet_alloc();
+  }
+
+  return pkt;
+}
+
+void packet_pool_put(PacketPool* pool, AVPacket** pkt)
+{
+  if(*pkt == NULL)
+  {
+    return;
+  }
+
+  // Drops the payload reference; a pooled buffer goes back to its AVBufferPool.
+  av_packet_unref(*pkt);
+
+  pthread_mutex_lock(&pool->lock);
+  if(pool->nb_free < pool->max_free)
+  {
+    pool->free_packets[pool->nb_free++] = *pkt;
+    *pkt = NULL;
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  av_packet_free(pkt);
+}
+
+static AVBufferRef* alloc_pool_buffer(void* opaque, BufferPoolSize size)
+{
+  PacketPool* pool = (PacketPool*)opaque;
+
+  // Called by AVBufferPool only when it has no free buffer, i.e. on a miss.
+  __atomic_fetch_add(&pool->buffer_allocs, 1, __ATOMIC_RELAXED);
+
+  return av_buffer_alloc(size);
+}
+
+static AVBufferRef* get_pool_buffer(PacketPool* pool, int size)
+{
+  int bucket = 0;
+  int bucket_size = PACKET_POOL_MIN_BUFFER;
+
+  while(bucket_size < size && bucket < PACKET_POOL_BUCKETS)
+  {
+    bucket_size <<= 1;
+    bucket++;
+  }
+
+  if(bucket == PACKET_POOL_BUCKETS)
+  {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  if(pool->buffer_pools[bucket] == NULL)
+  {
+    pool->buffer_pools[bucket] = av_buffer_pool_init2(bucket_size, pool, alloc_pool_buffer, NULL);
+  }
+  pool->buffer_gets++;
+  pthread_mutex_unlock(&pool->lock);
+
+  if(pool->buffer_pools[bucket] == NULL)
+  {
+    return NULL;
+  }
+
+  return av_buffer_pool_get(pool->buffer_pools[bucket]);
+}
+
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 134, 100)
+int packet_pool_get_encode_buffer(AVCodecContext* codec_ctx, AVPacket* pkt, int flags)
+{
+  PacketPool* pool = (PacketPool*)codec_ctx->opaque;
+  AVBufferRef* buf;
+
+  buf = get_pool_buffer(pool, pkt->size + AV_INPUT_BUFFER_PADDING_SIZE);
+  if(buf == NULL)
+  {
+    return avcodec_default_get_encode_buffer(codec_ctx, pkt, flags);
+  }
+
+  pkt->buf = buf;
+  pkt->data = buf->data;
+  memset(pkt->data + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+
+  return 0;
+}
+#endif
+
+void packet_pool_attach_encoder(PacketPool* pool, AVCodecContext* codec_ctx)
+{
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 134, 100)
+  // get_encode_buffer is only honored by encoders with the DR1 capability.
+  if(codec_ctx->codec != NULL && (codec_ctx->codec->capabilities & AV_CODEC_CAP_DR1))
+  {
+    codec_ctx->opaque = pool;
+    codec_ctx->get_encode_buffer = packet_pool_get_encode_buffer;
+  }
+#endif
+}
+
+void packet_pool_print_stats(PacketPool* pool)
+{
+  uint64_t packet_hits = pool->packet_gets - pool->packet_allocs;
+  uint64_t buffer_hits = pool->buffer_gets - pool->buffer_allocs;
+
+  printf("------- Packet pool -------\n");
+  printf("packets : %" PRIu64 " gets / %" PRIu64 " allocations / hit rate %.1f%%\n",
+    pool->packet_gets, pool->packet_allocs,
+    pool->packet_gets ? packet_hits * 100.0 / pool->packet_gets : 0.0);
+  printf("buffers : %" PRIu64 " gets / %" PRIu64 " allocations / hit rate %.1f%%\n",
+    pool->buffer_gets, pool->buffer_allocs,
+    pool->buffer_gets ? buffer_hits * 100.0 / pool->buffer_gets : 0.0);
+}
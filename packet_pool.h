@@ -0,0 +1,45 @@
+#ifndef PACKET_POOL_H
+#define PACKET_POOL_H
+
+#include <libavcodec/avcodec.h>
+#include <pthread.h>
+
+// Payload buffers come in power of two sizes from 4 KiB to 16 MiB.
+#define PACKET_POOL_BUCKETS 13
+
+// Recycles AVPacket structs, and payload buffers for encoders through
+// AVBufferPool. All calls are thread-safe.
+typedef struct _PacketPool
+{
+  pthread_mutex_t lock;
+  AVPacket** free_packets;
+  int nb_free;
+  int max_free;
+  AVBufferPool* buffer_pools[PACKET_POOL_BUCKETS];
+
+  uint64_t packet_gets;
+  uint64_t packet_allocs;
+  uint64_t buffer_gets;
+  uint64_t buffer_allocs;
+} PacketPool;
+
+// Up to max_free returned packets are kept for reuse.
+int packet_pool_init(PacketPool* pool, int max_free);
+void packet_pool_uninit(PacketPool* pool);
+
+// Returns a blank packet. Give it back with packet_pool_put().
+AVPacket* packet_pool_get(PacketPool* pool);
+void packet_pool_put(PacketPool* pool, AVPacket** pkt);
+
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(58, 134, 100)
+// AVCodecContext.get_encode_buffer callback, with the pool in AVCodecContext.opaque.
+int packet_pool_get_encode_buffer(AVCodecContext* codec_ctx, AVPacket* pkt, int flags);
+#endif
+
+// Sets up codec_ctx to take payload buffers from pool, if the encoder and
+// the libavcodec version (4.4+) support it. Call before avcodec_open2().
+void packet_pool_attach_encoder(PacketPool* pool, AVCodecContext* codec_ctx);
+
+void packet_pool_print_stats(PacketPool* pool);
+
+#endif
@@ -0,0 +1,489 @@
+#include "probe_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+// File layout, native byte order:
+//   CacheHeader
+//   CacheEntry[nb_entries], sorted by path_hash then path
+//   StreamInfo[nb_streams]
+//   path strings, not NUL terminated
+#define CACHE_MAGIC 0x43425250 // "PRBC"
+#define CACHE_VERSION 1
+
+typedef struct _CacheHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nb_entries;
+  uint32_t nb_streams;
+  uint64_t strings_size;
+  uint64_t reserved;
+} CacheHeader;
+
+typedef struct _CacheEntry
+{
+  uint64_t path_hash;
+  int64_t size;
+  int64_t mtime;
+  uint32_t path_offset;
+  uint32_t path_length;
+  uint32_t first_stream;
+  uint32_t nb_streams;
+} CacheEntry;
+
+// One result stored during this run, or one entry to write out on save.
+typedef struct _CacheItem
+{
+  uint64_t path_hash;
+  const char* path;
+  uint32_t path_length;
+  int64_t size;
+  int64_t mtime;
+  const StreamInfo* streams;
+  uint32_t nb_streams;
+} CacheItem;
+
+struct _ProbeCache
+{
+  char* path;
+
+  // Read-only mapping of the existing index.
+  uint8_t* map;
+  size_t map_size;
+  const CacheHeader* header;
+  const CacheEntry* entries;
+  const StreamInfo* streams;
+  const char* strings;
+
+  // Results stored during this run.
+  pthread_mutex_t lock;
+  CacheItem* items;
+  int nb_items;
+  int max_items;
+};
+
+static uint64_t hash_path(const char* path, size_t length)
+{
+  // 64-bit FNV-1a
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  size_t index;
+
+  for(index = 0; index < length; index++)
+  {
+    hash ^= (uint8_t)path[index];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+static int compare_items(const void* a, const void* b)
+{
+  const CacheItem* item1 = (const CacheItem*)a;
+  const CacheItem* item2 = (const CacheItem*)b;
+  uint32_t length;
+  int ret;
+
+  if(item1->path_hash != item2->path_hash)
+  {
+    return item1->path_hash < item2->path_hash ? -1 : 1;
+  }
+
+  length = item1->path_length < item2->path_length ? item1->path_length : item2->path_length;
+  ret = memcmp(item1->path, item2->path, length);
+  if(ret != 0)
+  {
+    return ret;
+  }
+
+  return (int)item1->path_length - (int)item2->path_length;
+}
+
+// The file is written by the scanner but may be edited or damaged, so
+// every entry must point inside the stream and string tables before any
+// lookup follows it. The sums are done in 64 bits and can't wrap.
+static int entries_valid(const CacheHeader* header, const CacheEntry* entries)
+{
+  uint32_t index;
+
+  for(index = 0; index < header->nb_entries; index++)
+  {
+    const CacheEntry* entry = &entries[index];
+    if((uint64_t)entry->path_offset + entry->path_length > header->strings_size ||
+      (uint64_t)entry->first_stream + entry->nb_streams > header->nb_streams)
+    {
+      return 0;
+    }
+  } // for
+
+  return 1;
+}
+
+static int map_index(ProbeCache* cache)
+{
+  struct stat st;
+  const CacheHeader* header;
+  uint64_t expected;
+  void* map;
+  int fd;
+
+  fd = open(cache->path, O_RDONLY);
+  if(fd < 0)
+  {
+    return -1;
+  }
+
+  if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(CacheHeader))
+  {
+    close(fd);
+    return -2;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED)
+  {
+    return -3;
+  }
+
+  // strings_size is checked first so that the sum can't wrap.
+  header = (const CacheHeader*)map;
+  expected = sizeof(CacheHeader) + (uint64_t)header->nb_entries * sizeof(CacheEntry) +
+    (uint64_t)header->nb_streams * sizeof(StreamInfo) + header->strings_size;
+  if(header->magic != CACHE_MAGIC || header->version != CACHE_VERSION ||
+    header->strings_size > (uint64_t)st.st_size || expected != (uint64_t)st.st_size)
+  {
+    printf("Ignoring invalid probe cache %s\n", cache->path);
+    munmap(map, st.st_size);
+    return -4;
+  }
+
+  const CacheEntry* entries = (const CacheEntry*)((const uint8_t*)map + sizeof(CacheHeader));
+  if(!entries_valid(header, entries))
+  {
+    printf("Ignoring invalid probe cache %s\n", cache->path);
+    munmap(map, st.st_size);
+    return -5;
+  }
+
+  cache->map = (uint8_t*)map;
+  cache->map_size = st.st_size;
+  cache->header = header;
+  cache->entries = entries;
+  cache->streams = (const StreamInfo*)(cache->entries + header->nb_entries);
+  cache->strings = (const char*)(cache->streams + header->nb_streams);
+
+  return 0;
+}
+
+ProbeCache* probe_cache_open(const char* path)
+{
+  ProbeCache* cache = calloc(1, sizeof(ProbeCache));
+  if(cache == NULL)
+  {
+    return NULL;
+  }
+
+  cache->path = strdup(path);
+  if(cache->path == NULL)
+  {
+    free(cache);
+    return NULL;
+  }
+
+  pthread_mutex_init(&cache->lock, NULL);
+
+  // Without a usable index every lookup simply misses.
+  map_index(cache);
+
+  return cache;
+}
+
+// Binary search on the mapped entries. Returns NULL if the path is not there.
+static const CacheEntry* find_entry(ProbeCache* cache, const char* filename)
+{
+  CacheItem key;
+  uint32_t low, high;
+
+  if(cache->header == NULL)
+  {
+    return NULL;
+  }
+
+  key.path = filename;
+  key.path_length = (uint32_t)strlen(filename);
+  key.path_hash = hash_path(filename, key.path_length);
+
+  low = 0;
+  high = cache->header->nb_entries;
+  while(low < high)
+  {
+    uint32_t middle = low + (high - low) / 2;
+    const CacheEntry* entry = &cache->entries[middle];
+    CacheItem item;
+    int ret;
+
+    item.path_hash = entry->path_hash;
+    item.path = cache->strings + entry->path_offset;
+    item.path_length = entry->path_length;
+
+    ret = compare_items(&key, &item);
+    if(ret == 0)
+    {
+      return entry;
+    }
+    else if(ret < 0)
+    {
+      high = middle;
+    }
+    else
+    {
+      low = middle + 1;
+    }
+  } // while
+
+  return NULL;
+}
+
+int probe_cache_lookup(ProbeCache* cache, const char* filename, int64_t size, int64_t mtime,
+                       StreamInfo* streams, int max_streams)
+{
+  const CacheEntry* entry = find_entry(cache, filename);
+  int nb_streams;
+
+  if(entry == NULL || entry->size != size || entry->mtime != mtime)
+  {
+    return -1;
+  }
+
+  nb_streams = entry->nb_streams < (uint32_t)max_streams ? (int)entry->nb_streams : max_streams;
+  memcpy(streams, cache->streams + entry->first_stream, nb_streams * sizeof(StreamInfo));
+
+  return nb_streams;
+}
+
+int probe_cache_store(ProbeCache* cache, const char* filename, int64_t size, int64_t mtime,
+                      const StreamInfo* streams, int nb_streams)
+{
+  CacheItem* item;
+  StreamInfo* copy;
+  char* path;
+
+  path = strdup(filename);
+  copy = malloc(nb_streams * sizeof(StreamInfo) + 1);
+  if(path == NULL || copy == NULL)
+  {
+    free(path);
+    free(copy);
+    return -1;
+  }
+
+  memcpy(copy, streams, nb_streams * sizeof(StreamInfo));
+
+  pthread_mutex_lock(&cache->lock);
+  if(cache->nb_items == cache->max_items)
+  {
+    int max_items = cache->max_items ? cache->max_items * 2 : 256;
+    CacheItem* items = realloc(cache->items, max_items * sizeof(CacheItem));
+    if(items == NULL)
+    {
+      pthread_mutex_unlock(&cache->lock);
+      free(path);
+      free(copy);
+      return -2;
+    }
+
+    cache->items = items;
+    cache->max_items = max_items;
+  }
+
+  item = &cache->items[cache->nb_items++];
+  item->path = path;
+  item->path_length = (uint32_t)strlen(path);
+  item->path_hash = hash_path(path, item->path_length);
+  item->size = size;
+  item->mtime = mtime;
+  item->streams = copy;
+  item->nb_streams = nb_streams;
+  pthread_mutex_unlock(&cache->lock);
+
+  return 0;
+}
+
+static int write_all(int fd, const void* data, size_t size)
+{
+  const uint8_t* ptr = (const uint8_t*)data;
+
+  while(size > 0)
+  {
+    ssize_t written = write(fd, ptr, size);
+    if(written < 0)
+    {
+      return -1;
+    }
+
+    ptr += written;
+    size -= written;
+  } // while
+
+  return 0;
+}
+
+int probe_cache_save(ProbeCache* cache)
+{
+  uint32_t nb_old = cache->header ? cache->header->nb_entries : 0;
+  CacheItem* items;
+  CacheHeader header;
+  char tmp_path[4096];
+  uint32_t index, nb_items = 0;
+  int fd, ret = 0;
+
+  if(cache->nb_items == 0)
+  {
+    // Nothing changed, keep the file as it is.
+    return 0;
+  }
+
+  items = malloc((nb_old + cache->nb_items) * sizeof(CacheItem));
+  if(items == NULL)
+  {
+    return -1;
+  }
+
+  // Fresh results win over entries of the mapped index.
+  qsort(cache->items, cache->nb_items, sizeof(CacheItem), compare_items);
+  for(index = 0; index < (uint32_t)cache->nb_items; index++)
+  {
+    if(nb_items > 0 && compare_items(&items[nb_items - 1], &cache->items[index]) == 0)
+    {
+      items[nb_items - 1] = cache->items[index];
+      continue;
+    }
+    items[nb_items++] = cache->items[index];
+  } // for
+
+  for(index = 0; index < nb_old; index++)
+  {
+    const CacheEntry* entry = &cache->entries[index];
+    CacheItem item;
+
+    item.path_hash = entry->path_hash;
+    item.path = cache->strings + entry->path_offset;
+    item.path_length = entry->path_length;
+    item.size = entry->size;
+    item.mtime = entry->mtime;
+    item.streams = cache->streams + entry->first_stream;
+    item.nb_streams = entry->nb_streams;
+
+    if(bsearch(&item, cache->items, cache->nb_items, sizeof(CacheItem), compare_items) == NULL)
+    {
+      items[nb_items++] = item;
+    }
+  } // for
+
+  qsort(items, nb_items, sizeof(CacheItem), compare_items);
+
+  memset(&header, 0, sizeof(header));
+  header.magic = CACHE_MAGIC;
+  header.version = CACHE_VERSION;
+  header.nb_entries = nb_items;
+  for(index = 0; index < nb_items; index++)
+  {
+    header.nb_streams += items[index].nb_streams;
+    header.strings_size += items[index].path_length;
+  }
+
+  // Write next to the old index and rename, so readers never see a partial file.
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache->path);
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0)
+  {
+    printf("Could not create probe cache %s\n", tmp_path);
+    free(items);
+    return -2;
+  }
+
+  ret |= write_all(fd, &header, sizeof(header));
+
+  uint32_t first_stream = 0, path_offset = 0;
+  for(index = 0; index < nb_items && ret == 0; index++)
+  {
+    CacheEntry entry;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.path_hash = items[index].path_hash;
+    entry.size = items[index].size;
+    entry.mtime = items[index].mtime;
+    entry.path_offset = path_offset;
+    entry.path_length = items[index].path_length;
+    entry.first_stream = first_stream;
+    entry.nb_streams = items[index].nb_streams;
+
+    ret |= write_all(fd, &entry, sizeof(entry));
+    first_stream += entry.nb_streams;
+    path_offset += entry.path_length;
+  } // for
+
+  for(index = 0; index < nb_items && ret == 0; index++)
+  {
+    ret |= write_all(fd, items[index].streams, items[index].nb_streams * sizeof(StreamInfo));
+  }
+
+  for(index = 0; index < nb_items && ret == 0; index++)
+  {
+    ret |= write_all(fd, items[index].path, items[index].path_length);
+  }
+
+  free(items);
+
+  if(close(fd) < 0 || ret < 0)
+  {
+    printf("Failed to write probe cache %s\n", tmp_path);
+    unlink(tmp_path);
+    return -3;
+  }
+
+  if(rename(tmp_path, cache->path) < 0)
+  {
+    printf("Failed to replace probe cache %s\n", cache->path);
+    unlink(tmp_path);
+    return -4;
+  }
+
+  return 0;
+}
+
+void probe_cache_close(ProbeCache** cache)
+{
+  ProbeCache* ptr = *cache;
+  int index;
+
+  if(ptr == NULL)
+  {
+    return;
+  }
+
+  for(index = 0; index < ptr->nb_items; index++)
+  {
+    free((char*)ptr->items[index].path);
+    free((StreamInfo*)ptr->items[index].streams);
+  }
+  free(ptr->items);
+
+  if(ptr->map != NULL)
+  {
+    munmap(ptr->map, ptr->map_size);
+  }
+
+  pthread_mutex_destroy(&ptr->lock);
+  free(ptr->path);
+  free(ptr);
+  *cache = NULL;
+}
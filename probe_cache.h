@@ -0,0 +1,39 @@
+#ifndef PROBE_CACHE_H
+#define PROBE_CACHE_H
+
+#include <stdint.h>
+
+// Per-stream result of a scan. Fixed-width fields, as this is also the
+// on-disk record of the cache.
+typedef struct _StreamInfo
+{
+  int32_t codec_type;
+  int32_t codec_id;
+  int64_t bit_rate;
+  int32_t width;
+  int32_t height;
+  int32_t sample_rate;
+  int32_t channels;
+} StreamInfo;
+
+typedef struct _ProbeCache ProbeCache;
+
+// Maps the cache file read-only. A missing or invalid file gives an empty
+// cache, which is written out by probe_cache_save().
+ProbeCache* probe_cache_open(const char* path);
+
+// Returns the number of streams copied into streams, or -1 when the file
+// is not cached or its size/mtime changed. Safe to call from many threads.
+int probe_cache_lookup(ProbeCache* cache, const char* filename, int64_t size, int64_t mtime,
+                       StreamInfo* streams, int max_streams);
+
+// Queues a fresh result. Safe to call from many threads.
+int probe_cache_store(ProbeCache* cache, const char* filename, int64_t size, int64_t mtime,
+                      const StreamInfo* streams, int nb_streams);
+
+// Merges the stored results with the mapped index and replaces the file.
+int probe_cache_save(ProbeCache* cache);
+
+void probe_cache_close(ProbeCache** cache);
+
+#endif
@@ -0,0 +1,386 @@
+#include "readahead_io.h"
+
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+#include <libavutil/error.h>
+#include <libavutil/time.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Size of the buffer handed to avio_alloc_context().
+#define READAHEAD_IO_BUFFER_SIZE (64 * 1024)
+
+typedef struct _ReadaheadBlock
+{
+  uint8_t* data;
+  int64_t pos;
+  int size;
+} ReadaheadBlock;
+
+typedef struct _ReadaheadFile
+{
+  int fd;
+  int64_t size;
+
+  ReadaheadBlock* blocks;
+  int nb_blocks;
+  int block_size;
+
+  // The blocks from head to head + count - 1 are filled, in file order.
+  // Only the caller thread moves head and offset, only the reader thread
+  // fills blocks, both under mutex.
+  int head;
+  int count;
+  int offset;
+  // File offset the reader thread continues from.
+  int64_t fill_pos;
+  // Bumped on every reset, so that a read started before it is dropped.
+  unsigned int generation;
+  int eof;
+  int error;
+  int abort;
+
+  // Logical position of the caller.
+  int64_t pos;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t thread;
+  int thread_started;
+
+  ReadaheadStats stats;
+} ReadaheadFile;
+
+static void* reader_thread(void* arg)
+{
+  ReadaheadFile* file = (ReadaheadFile*)arg;
+  ReadaheadBlock* block;
+  unsigned int generation;
+  int64_t pos;
+  ssize_t size;
+
+  pthread_mutex_lock(&file->mutex);
+  while(!file->abort)
+  {
+    if(file->count == file->nb_blocks || file->eof || file->error)
+    {
+      pthread_cond_wait(&file->cond, &file->mutex);
+      continue;
+    }
+
+    block = &file->blocks[(file->head + file->count) % file->nb_blocks];
+    pos = file->fill_pos;
+    generation = file->generation;
+
+    // The block is not visible to the caller until count covers it.
+    pthread_mutex_unlock(&file->mutex);
+    do
+    {
+      size = pread(file->fd, block->data, file->block_size, pos);
+    } while(size < 0 && errno == EINTR);
+    pthread_mutex_lock(&file->mutex);
+
+    if(generation != file->generation)
+    {
+      continue;
+    }
+
+    if(size < 0)
+    {
+      file->error = AVERROR(errno);
+    }
+    else if(size == 0)
+    {
+      file->eof = 1;
+    }
+    else
+    {
+      block->pos = pos;
+      block->size = (int)size;
+      file->fill_pos += size;
+      file->count++;
+    }
+
+    pthread_cond_broadcast(&file->cond);
+  } // while
+  pthread_mutex_unlock(&file->mutex);
+
+  return NULL;
+}
+
+static int readahead_read_packet(void* opaque, uint8_t* buf, int buf_size)
+{
+  ReadaheadFile* file = (ReadaheadFile*)opaque;
+  ReadaheadBlock* block;
+  int64_t wait_start;
+  int size;
+
+  pthread_mutex_lock(&file->mutex);
+  if(file->count > 0)
+  {
+    file->stats.hits++;
+  }
+  else if(!file->eof && !file->error)
+  {
+    file->stats.misses++;
+    wait_start = av_gettime_relative();
+    while(file->count == 0 && !file->eof && !file->error)
+    {
+      pthread_cond_wait(&file->cond, &file->mutex);
+    } // while
+    file->stats.wait_time += av_gettime_relative() - wait_start;
+  }
+
+  if(file->count == 0)
+  {
+    size = file->error ? file->error : AVERROR_EOF;
+    pthread_mutex_unlock(&file->mutex);
+    return size;
+  }
+  pthread_mutex_unlock(&file->mutex);
+
+  // The head block stays put until this thread releases it below.
+  block = &file->blocks[file->head];
+  size = FFMIN(buf_size, block->size - file->offset);
+  memcpy(buf, block->data + file->offset, size);
+
+  pthread_mutex_lock(&file->mutex);
+  file->offset += size;
+  file->pos += size;
+  file->stats.bytes_read += size;
+  if(file->offset == block->size)
+  {
+    file->head = (file->head + 1) % file->nb_blocks;
+    file->count--;
+    file->offset = 0;
+    pthread_cond_broadcast(&file->cond);
+  }
+  pthread_mutex_unlock(&file->mutex);
+
+  return size;
+}
+
+static int64_t readahead_seek(void* opaque, int64_t offset, int whence)
+{
+  ReadaheadFile* file = (ReadaheadFile*)opaque;
+  ReadaheadBlock* block;
+  int64_t pos;
+
+  switch(whence & ~AVSEEK_FORCE)
+  {
+  case AVSEEK_SIZE:
+    return file->size;
+  case SEEK_SET:
+    pos = offset;
+    break;
+  case SEEK_CUR:
+    pos = file->pos + offset;
+    break;
+  case SEEK_END:
+    pos = file->size + offset;
+    break;
+  default:
+    return AVERROR(EINVAL);
+  }
+
+  if(pos < 0)
+  {
+    return AVERROR(EINVAL);
+  }
+
+  pthread_mutex_lock(&file->mutex);
+
+  block = &file->blocks[file->head];
+  if(file->count > 0 && pos >= block->pos + file->offset && pos < file->fill_pos)
+  {
+    // Forward inside the window, drop the blocks that are skipped over.
+    while(pos >= block->pos + block->size)
+    {
+      file->head = (file->head + 1) % file->nb_blocks;
+      file->count--;
+      block = &file->blocks[file->head];
+    } // while
+
+    file->offset = (int)(pos - block->pos);
+    file->stats.window_seeks++;
+  }
+  else if(pos != file->pos || file->error)
+  {
+    // Anywhere else, start over from the new position.
+    file->generation++;
+    file->count = 0;
+    file->offset = 0;
+    file->fill_pos = pos;
+    file->eof = 0;
+    file->error = 0;
+    file->stats.reset_seeks++;
+  }
+
+  file->pos = pos;
+  pthread_cond_broadcast(&file->cond);
+  pthread_mutex_unlock(&file->mutex);
+
+  return pos;
+}
+
+static void free_file(ReadaheadFile* file)
+{
+  int index;
+
+  if(file->thread_started)
+  {
+    pthread_mutex_lock(&file->mutex);
+    file->abort = 1;
+    pthread_cond_broadcast(&file->cond);
+    pthread_mutex_unlock(&file->mutex);
+
+    pthread_join(file->thread, NULL);
+  }
+
+  if(file->blocks != NULL)
+  {
+    for(index = 0; index < file->nb_blocks; index++)
+    {
+      av_free(file->blocks[index].data);
+    }
+    av_free(file->blocks);
+  }
+
+  pthread_mutex_destroy(&file->mutex);
+  pthread_cond_destroy(&file->cond);
+
+  if(file->fd >= 0)
+  {
+    close(file->fd);
+  }
+
+  av_free(file);
+}
+
+int readahead_io_open(AVIOContext** pb, const char* filename, int nb_blocks, int block_size)
+{
+  ReadaheadFile* file;
+  uint8_t* buffer;
+  struct stat st;
+  int index;
+  int fd;
+
+  if(nb_blocks < 2 || block_size < READAHEAD_IO_BUFFER_SIZE)
+  {
+    return AVERROR(EINVAL);
+  }
+
+  fd = open(filename, O_RDONLY);
+  if(fd < 0)
+  {
+    return AVERROR(errno);
+  }
+
+  if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+  {
+    close(fd);
+    return AVERROR(EINVAL);
+  }
+
+  // Reads are large and in file order, let the kernel size its own read-ahead to match.
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  file = av_mallocz(sizeof(ReadaheadFile));
+  if(file == NULL)
+  {
+    close(fd);
+    return AVERROR(ENOMEM);
+  }
+
+  file->fd = fd;
+  file->size = st.st_size;
+  file->nb_blocks = nb_blocks;
+  file->block_size = block_size;
+  pthread_mutex_init(&file->mutex, NULL);
+  pthread_cond_init(&file->cond, NULL);
+
+  file->blocks = av_calloc(nb_blocks, sizeof(ReadaheadBlock));
+  if(file->blocks == NULL)
+  {
+    free_file(file);
+    return AVERROR(ENOMEM);
+  }
+
+  for(index = 0; index < nb_blocks; index++)
+  {
+    file->blocks[index].data = av_malloc(block_size);
+    if(file->blocks[index].data == NULL)
+    {
+      free_file(file);
+      return AVERROR(ENOMEM);
+    }
+  } // for
+
+  if(pthread_create(&file->thread, NULL, reader_thread, file) != 0)
+  {
+    free_file(file);
+    return AVERROR(EAGAIN);
+  }
+  file->thread_started = 1;
+
+  buffer = av_malloc(READAHEAD_IO_BUFFER_SIZE);
+  if(buffer == NULL)
+  {
+    free_file(file);
+    return AVERROR(ENOMEM);
+  }
+
+  *pb = avio_alloc_context(buffer, READAHEAD_IO_BUFFER_SIZE, 0, file,
+    readahead_read_packet, NULL, readahead_seek);
+  if(*pb == NULL)
+  {
+    av_free(buffer);
+    free_file(file);
+    return AVERROR(ENOMEM);
+  }
+
+  return 0;
+}
+
+void readahead_io_close(AVIOContext** pb)
+{
+  if(*pb == NULL)
+  {
+    return;
+  }
+
+  free_file((ReadaheadFile*)(*pb)->opaque);
+
+  // The buffer may have been reallocated by libavformat, free the current one.
+  av_freep(&(*pb)->buffer);
+  avio_context_free(pb);
+}
+
+void readahead_io_get_stats(AVIOContext* pb, ReadaheadStats* stats)
+{
+  ReadaheadFile* file = (ReadaheadFile*)pb->opaque;
+
+  pthread_mutex_lock(&file->mutex);
+  *stats = file->stats;
+  pthread_mutex_unlock(&file->mutex);
+}
+
+void readahead_io_print_stats(AVIOContext* pb)
+{
+  ReadaheadStats stats;
+  int64_t reads;
+
+  readahead_io_get_stats(pb, &stats);
+  reads = stats.hits + stats.misses;
+
+  printf("readahead : %" PRId64 " reads, %" PRId64 " hits (%.1f%%), %" PRId64 " misses, %.3f ms waited\n",
+    reads, stats.hits, reads > 0 ? stats.hits * 100.0 / reads : 0.0, stats.misses,
+    stats.wait_time / 1000.0);
+  printf("readahead : %" PRId64 " bytes, %" PRId64 " seeks in window, %" PRId64 " seeks restarted\n",
+    stats.bytes_read, stats.window_seeks, stats.reset_seeks);
+}
@@ -0,0 +1,32 @@
+#ifndef READAHEAD_IO_H
+#define READAHEAD_IO_H
+
+#include <libavformat/avio.h>
+
+typedef struct _ReadaheadStats
+{
+  // Reads served from a block that was already filled.
+  int64_t hits;
+  // Reads that had to wait for the reader thread.
+  int64_t misses;
+  // Time spent waiting on misses, in microseconds.
+  int64_t wait_time;
+  // Seeks that landed inside the filled window, and seeks that restarted it.
+  int64_t window_seeks;
+  int64_t reset_seeks;
+  int64_t bytes_read;
+} ReadaheadStats;
+
+// Opens a local file behind a read-only, seekable AVIOContext. A background
+// thread keeps up to nb_blocks buffers of block_size bytes filled ahead of
+// the read position. A seek outside the filled window discards it and the
+// thread starts over from the new position.
+int readahead_io_open(AVIOContext** pb, const char* filename, int nb_blocks, int block_size);
+
+void readahead_io_close(AVIOContext** pb);
+
+void readahead_io_get_stats(AVIOContext* pb, ReadaheadStats* stats);
+
+void readahead_io_print_stats(AVIOContext* pb);
+
+#endif
@@ -1,60 +1,424 @@
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
+#include <libavutil/time.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
-static AVFormatContext* fmt_ctx = NULL;
+#include "file_list.h"
+#include "media_input.h"
+#include "probe_cache.h"
 
-int main(int argc, char* argv[])
+// Only this many video/audio streams are kept per file.
+#define MAX_SCAN_STREAMS 16
+
+typedef struct _ScanResult
 {
+  ProbeStats probe;
+  int cached;
+  unsigned int nb_streams;
+  StreamInfo streams[MAX_SCAN_STREAMS];
+} ScanResult;
+
+typedef struct _ScanStats
+{
+  int files_ok;
+  int files_failed;
+  int files_cached;
+  int video_streams;
+  int audio_streams;
+  int64_t bytes_read;
+  int64_t probe_time;
+} ScanStats;
+
+typedef struct _BatchContext
+{
+  FileList* files;
+  const InputOptions* options;
+  ProbeCache* cache;
+  int next_file;
+  pthread_mutex_t lock;
+  ScanStats stats;
+} BatchContext;
+
+static int scan_file(const char* filename, const InputOptions* options, ProbeCache* cache,
+                     ScanResult* result)
+{
+  // Every call owns its AVFormatContext, so scan_file() can run on many threads at once.
+  AVFormatContext* fmt_ctx = NULL;
+  struct stat st;
+  int64_t mtime = 0;
+  int have_stat = 0;
   unsigned int index;
+  int ret;
 
-  // Print debug log in library level.
-  av_log_set_level(AV_LOG_DEBUG);
+  memset(result, 0, sizeof(*result));
 
-  if(argc < 2)
+  // Unchanged files are answered from the cache without opening them.
+  if(cache != NULL && stat(filename, &st) == 0)
   {
-    printf("usage : %s <input>\n", argv[0]);
-    return 0;
+    have_stat = 1;
+    mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    ret = probe_cache_lookup(cache, filename, st.st_size, mtime,
+      result->streams, MAX_SCAN_STREAMS);
+    if(ret >= 0)
+    {
+      result->nb_streams = ret;
+      result->cached = 1;
+      return 0;
+    }
   }
 
-  // Get fmt_ctx from given file path.
-  if(avformat_open_input(&fmt_ctx, argv[1], NULL, NULL) < 0)
+  // Get fmt_ctx from given file path and find its stream information.
+  ret = open_media_input(&fmt_ctx, filename, options, &result->probe);
+  if(ret < 0)
   {
-    printf("Could not open input file %s\n", argv[1]);
-    return -1;
+    return ret;
   }
 
-  // Find stream information from given fmt_ctx.
-  if(avformat_find_stream_info(fmt_ctx, NULL) < 0)
+  // fmt_ctx->nb_streams : number of total streams in video file.
+  for(index = 0; index < fmt_ctx->nb_streams && result->nb_streams < MAX_SCAN_STREAMS; index++)
   {
-    printf("Failed to retrieve input stream information\n");
-    return -2;
+    AVCodecParameters* avCodecParams = fmt_ctx->streams[index]->codecpar;
+    StreamInfo* info = &result->streams[result->nb_streams];
+
+    if(avCodecParams->codec_type != AVMEDIA_TYPE_VIDEO &&
+      avCodecParams->codec_type != AVMEDIA_TYPE_AUDIO)
+    {
+      continue;
+    }
+
+    info->codec_type = avCodecParams->codec_type;
+    info->codec_id = avCodecParams->codec_id;
+    info->bit_rate = avCodecParams->bit_rate;
+    info->width = avCodecParams->width;
+    info->height = avCodecParams->height;
+    info->sample_rate = avCodecParams->sample_rate;
+    info->channels = avCodecParams->channels;
+    result->nb_streams++;
+  } // for
+
+  close_media_input(&fmt_ctx);
+
+  if(cache != NULL && have_stat)
+  {
+    probe_cache_store(cache, filename, st.st_size, mtime, result->streams, result->nb_streams);
   }
 
-  // fmt_ctx->nb_streams : number of total streams in video file.
-  for(index = 0; index < fmt_ctx->nb_streams; index++)
+  return 0;
+}
+
+static void print_result(const ScanResult* result)
+{
+  unsigned int index;
+
+  for(index = 0; index < result->nb_streams; index++)
   {
-    AVCodecParameters* avCodecParams = fmt_ctx->streams[index]->codecpar;
-    if(avCodecParams->codec_type == AVMEDIA_TYPE_VIDEO)
+    const StreamInfo* info = &result->streams[index];
+    if(info->codec_type == AVMEDIA_TYPE_VIDEO)
     {
       printf("------- Video info -------\n");
-      printf("codec_id : %d\n", avCodecParams->codec_id);
-      printf("bitrate : %" PRId64 "\n", avCodecParams->bit_rate);
-      printf("width : %d / height : %d\n", avCodecParams->width, avCodecParams->height);
+      printf("codec_id : %d\n", info->codec_id);
+      printf("bitrate : %" PRId64 "\n", info->bit_rate);
+      printf("width : %d / height : %d\n", info->width, info->height);
     }
-    else if(avCodecParams->codec_type == AVMEDIA_TYPE_AUDIO)
+    else
     {
       printf("------- Audio info -------\n");
-      printf("codec_id : %d\n", avCodecParams->codec_id);
-      printf("bitrate : %" PRId64 "\n", avCodecParams->bit_rate);
-      printf("sample_rate : %d\n", avCodecParams->sample_rate);
-      printf("number of channels : %d\n", avCodecParams->channels);
+      printf("codec_id : %d\n", info->codec_id);
+      printf("bitrate : %" PRId64 "\n", info->bit_rate);
+      printf("sample_rate : %d\n", info->sample_rate);
+      printf("number of channels : %d\n", info->channels);
+    }
+  } // for
+}
+
+// One line per file, so that batch output stays readable with thousands of files.
+static void print_result_line(const char* filename, const ScanResult* result)
+{
+  unsigned int index;
+
+  printf("%s :", filename);
+  for(index = 0; index < result->nb_streams; index++)
+  {
+    const StreamInfo* info = &result->streams[index];
+    if(info->codec_type == AVMEDIA_TYPE_VIDEO)
+    {
+      printf(" [video codec_id=%d bitrate=%" PRId64 " %dx%d]",
+        info->codec_id, info->bit_rate, info->width, info->height);
+    }
+    else
+    {
+      printf(" [audio codec_id=%d bitrate=%" PRId64 " %dHz %dch]",
+        info->codec_id, info->bit_rate, info->sample_rate, info->channels);
+    }
+  } // for
+  if(result->cached)
+  {
+    printf(" (cached)\n");
+  }
+  else
+  {
+    printf(" (%" PRId64 " bytes, %.3f ms)\n",
+      result->probe.bytes_read, result->probe.probe_time / 1000.0);
+  }
+}
+
+static void* scan_worker(void* arg)
+{
+  BatchContext* batch = (BatchContext*)arg;
+  ScanStats stats = { 0 };
+  ScanResult result;
+  unsigned int index;
+  int file_index;
+
+  while(1)
+  {
+    pthread_mutex_lock(&batch->lock);
+    file_index = batch->next_file++;
+    pthread_mutex_unlock(&batch->lock);
+
+    if(file_index >= batch->files->count)
+    {
+      break;
+    }
+
+    const char* filename = batch->files->paths[file_index];
+    if(scan_file(filename, batch->options, batch->cache, &result) < 0)
+    {
+      stats.files_failed++;
+      pthread_mutex_lock(&batch->lock);
+      printf("%s : failed to probe\n", filename);
+      pthread_mutex_unlock(&batch->lock);
+      continue;
+    }
+
+    stats.files_ok++;
+    stats.files_cached += result.cached;
+    stats.bytes_read += result.probe.bytes_read;
+    stats.probe_time += result.probe.probe_time;
+    for(index = 0; index < result.nb_streams; index++)
+    {
+      if(result.streams[index].codec_type == AVMEDIA_TYPE_VIDEO)
+      {
+        stats.video_streams++;
+      }
+      else
+      {
+        stats.audio_streams++;
+      }
+    } // for
+
+    pthread_mutex_lock(&batch->lock);
+    print_result_line(filename, &result);
+    pthread_mutex_unlock(&batch->lock);
+  } // while
+
+  // Merge the counters once, instead of taking the lock for every file.
+  pthread_mutex_lock(&batch->lock);
+  batch->stats.files_ok += stats.files_ok;
+  batch->stats.files_failed += stats.files_failed;
+  batch->stats.files_cached += stats.files_cached;
+  batch->stats.video_streams += stats.video_streams;
+  batch->stats.audio_streams += stats.audio_streams;
+  batch->stats.bytes_read += stats.bytes_read;
+  batch->stats.probe_time += stats.probe_time;
+  pthread_mutex_unlock(&batch->lock);
+
+  return NULL;
+}
+
+static int run_batch(FileList* files, const InputOptions* options, ProbeCache* cache,
+                     int nb_workers)
+{
+  BatchContext batch;
+  pthread_t* workers;
+  int64_t start_time, elapsed;
+  int index, started;
+
+  if(nb_workers > files->count)
+  {
+    nb_workers = files->count;
+  }
+
+  if(nb_workers < 1)
+  {
+    printf("No input files\n");
+    return -1;
+  }
+
+  workers = calloc(nb_workers, sizeof(pthread_t));
+  if(workers == NULL)
+  {
+    return -2;
+  }
+
+  memset(&batch, 0, sizeof(batch));
+  batch.files = files;
+  batch.options = options;
+  batch.cache = cache;
+  pthread_mutex_init(&batch.lock, NULL);
+
+  start_time = av_gettime_relative();
+
+  for(started = 0; started < nb_workers; started++)
+  {
+    if(pthread_create(&workers[started], NULL, scan_worker, &batch) != 0)
+    {
+      printf("Failed to start worker thread\n");
+      break;
+    }
+  } // for
+
+  // If no thread could be started, scan on this thread.
+  if(started == 0)
+  {
+    scan_worker(&batch);
+  }
+
+  for(index = 0; index < started; index++)
+  {
+    pthread_join(workers[index], NULL);
+  }
+
+  elapsed = av_gettime_relative() - start_time;
+
+  printf("------- Batch summary -------\n");
+  printf("workers : %d\n", started > 0 ? started : 1);
+  printf("files : %d (ok %d / failed %d / cached %d)\n",
+    files->count, batch.stats.files_ok, batch.stats.files_failed, batch.stats.files_cached);
+  printf("video streams : %d / audio streams : %d\n",
+    batch.stats.video_streams, batch.stats.audio_streams);
+  int files_probed = batch.stats.files_ok - batch.stats.files_cached;
+  if(files_probed > 0)
+  {
+    printf("probe : %" PRId64 " bytes read / %.3f ms per probed file\n",
+      batch.stats.bytes_read / files_probed,
+      batch.stats.probe_time / 1000.0 / files_probed);
+  }
+  printf("elapsed : %.3f sec\n", elapsed / 1000000.0);
+  printf("files/sec : %.1f\n", elapsed > 0 ? files->count * 1000000.0 / elapsed : 0.0);
+
+  pthread_mutex_destroy(&batch.lock);
+  free(workers);
+
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  FileList files = { 0 };
+  InputOptions options;
+  ProbeCache* cache = NULL;
+  ScanResult result;
+  struct stat st;
+  int nb_workers = 0;
+  int batch_mode = 0;
+  int opt, index;
+
+  init_input_options(&options);
+
+  while((opt = getopt(argc, argv, "fp:j:l:c:")) != -1)
+  {
+    switch(opt)
+    {
+    case 'f':
+      options.fast_probe = 1;
+      break;
+    case 'p':
+      options.fast_probe = 1;
+      options.probesize = strtoll(optarg, NULL, 10);
+      break;
+    case 'j':
+      nb_workers = atoi(optarg);
+      batch_mode = 1;
+      break;
+    case 'l':
+      file_list_add_list(&files, optarg);
+      batch_mode = 1;
+      break;
+    case 'c':
+      probe_cache_close(&cache);
+      cache = probe_cache_open(optarg);
+      break;
+    default:
+      optind = argc + 1;
+      break;
+    }
+  } // while
+
+  if(optind > argc || (optind == argc && files.count == 0))
+  {
+    printf("usage : %s [-f] [-p probesize] [-c cachefile] [-j jobs] [-l filelist] <input|directory>...\n", argv[0]);
+    file_list_free(&files);
+    probe_cache_close(&cache);
+    return 0;
+  }
+
+  // Scanning a single file keeps the original behavior, including debug logs.
+  if(!batch_mode && optind == argc - 1 &&
+    (stat(argv[optind], &st) < 0 || !S_ISDIR(st.st_mode)))
+  {
+    // Print debug log in library level.
+    av_log_set_level(AV_LOG_DEBUG);
+
+    int ret = scan_file(argv[optind], &options, cache, &result);
+    if(ret == -1)
+    {
+      printf("Could not open input file %s\n", argv[optind]);
+    }
+    else if(ret == -2)
+    {
+      printf("Failed to retrieve input stream information\n");
+    }
+    else
+    {
+      print_result(&result);
+      if(!result.cached)
+      {
+        print_probe_stats(&result.probe);
+      }
+    }
+
+    if(cache != NULL)
+    {
+      probe_cache_save(cache);
+      probe_cache_close(&cache);
+    }
+
+    return ret;
+  }
+
+  for(index = optind; index < argc; index++)
+  {
+    if(stat(argv[index], &st) == 0 && S_ISDIR(st.st_mode))
+    {
+      file_list_add_directory(&files, argv[index]);
+    }
+    else
+    {
+      file_list_add(&files, argv[index]);
     }
   } // for
 
-  if(fmt_ctx != NULL)
+  // Library logs from many threads would only interleave, keep errors only.
+  av_log_set_level(AV_LOG_ERROR);
+
+  if(nb_workers <= 0)
+  {
+    nb_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+
+  run_batch(&files, &options, cache, nb_workers);
+  file_list_free(&files);
+
+  if(cache != NULL)
   {
-    avformat_close_input(&fmt_ctx);
+    probe_cache_save(cache);
+    probe_cache_close(&cache);
   }
 
   return 0;
@@ -1,6 +1,15 @@
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
+#include <libavutil/time.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "demux_thread.h"
+#include "json_util.h"
+#include "media_input.h"
+#include "seek_index.h"
 
 typedef struct _FileContext
 {
@@ -9,27 +18,86 @@ typedef struct _FileContext
   int a_index;
 } FileContext;
 
+// Packet sizes and keyframe intervals are counted in power of two buckets,
+// so a stream of any length uses the same amount of memory.
+#define SIZE_HIST_BUCKETS 24
+#define GOP_HIST_BUCKETS 16
+
+typedef struct _StreamStats
+{
+  int64_t packets;
+  int64_t bytes;
+  int64_t keyframes;
+  int64_t first_ts;
+  int64_t last_ts;
+
+  // Bitrate over fixed windows of window_ts, in stream time_base.
+  int64_t window_ts;
+  int64_t window_start;
+  int64_t window_bytes;
+  int64_t windows;
+  double window_bitrate_min;
+  double window_bitrate_max;
+  double window_bitrate_sum;
+
+  int64_t size_min;
+  int64_t size_max;
+  int64_t size_hist[SIZE_HIST_BUCKETS];
+
+  // Packets since the last keyframe, -1 before the first one.
+  int64_t gop_packets;
+  int64_t gops;
+  int64_t gop_min;
+  int64_t gop_max;
+  int64_t gop_sum;
+  int64_t gop_hist[GOP_HIST_BUCKETS];
+
+  int64_t last_dts;
+  int64_t last_duration;
+  int64_t missing_pts;
+  int64_t missing_dts;
+  int64_t dts_non_monotonic;
+  int64_t dts_gaps;
+  int64_t dts_gap_max;
+} StreamStats;
+
+typedef struct _PacketConsumer
+{
+  DemuxThread* demux;
+  SpscQueue* queue;
+  int64_t packets;
+  int64_t bytes;
+} PacketConsumer;
+
 static FileContext input_ctx;
+static InputOptions input_opts;
+
+// Depth of each per-stream packet queue in threaded mode.
+static const uint32_t demux_queue_size = 256;
 
 static int open_input(const char* filename)
 {
+  ProbeStats probe_stats;
   unsigned int index;
+  int ret;
 
   input_ctx.fmt_ctx = NULL;
   input_ctx.v_index = input_ctx.a_index = -1;
 
-  if(avformat_open_input(&input_ctx.fmt_ctx, filename, NULL, NULL) < 0)
+  ret = open_media_input(&input_ctx.fmt_ctx, filename, &input_opts, &probe_stats);
+  if(ret == -1)
   {
     printf("Could not open input file %s\n", filename);
     return -1;
   }
-
-  if(avformat_find_stream_info(input_ctx.fmt_ctx, NULL) < 0)
+  else if(ret < 0)
   {
     printf("Failed to retrieve input stream information\n");
     return -2;
   }
 
+  print_probe_stats(&probe_stats);
+
   for(index = 0; index < input_ctx.fmt_ctx->nb_streams; index++)
   {
     AVCodecParameters* avCodecParams = input_ctx.fmt_ctx->streams[index]->codecpar;
@@ -56,24 +124,535 @@ static void release()
 {
   if(input_ctx.fmt_ctx != NULL)
   {
-    avformat_close_input(&input_ctx.fmt_ctx);
+    print_input_io_stats(input_ctx.fmt_ctx);
+    close_media_input(&input_ctx.fmt_ctx);
+  }
+}
+
+static int log2_bucket(int64_t value, int nb_buckets)
+{
+  int bucket = 0;
+
+  while(value > 1 && bucket < nb_buckets - 1)
+  {
+    value >>= 1;
+    bucket++;
+  }
+
+  return bucket;
+}
+
+static void init_stream_stats(StreamStats* stats, AVStream* stream, int64_t window_us)
+{
+  memset(stats, 0, sizeof(*stats));
+  stats->first_ts = AV_NOPTS_VALUE;
+  stats->last_ts = AV_NOPTS_VALUE;
+  stats->window_start = AV_NOPTS_VALUE;
+  stats->window_ts = FFMAX(1, av_rescale_q(window_us, AV_TIME_BASE_Q, stream->time_base));
+  stats->size_min = INT64_MAX;
+  stats->gop_packets = -1;
+  stats->gop_min = INT64_MAX;
+  stats->last_dts = AV_NOPTS_VALUE;
+}
+
+static void close_window(StreamStats* stats, AVRational time_base)
+{
+  double bitrate = stats->window_bytes * 8 / (stats->window_ts * av_q2d(time_base));
+
+  if(stats->windows == 0 || bitrate < stats->window_bitrate_min)
+  {
+    stats->window_bitrate_min = bitrate;
   }
+  if(stats->windows == 0 || bitrate > stats->window_bitrate_max)
+  {
+    stats->window_bitrate_max = bitrate;
+  }
+
+  stats->window_bitrate_sum += bitrate;
+  stats->windows++;
+}
+
+static void update_stream_stats(StreamStats* stats, AVStream* stream, const AVPacket* pkt)
+{
+  int64_t ts = (pkt->dts != AV_NOPTS_VALUE) ? pkt->dts : pkt->pts;
+
+  stats->packets++;
+  stats->bytes += pkt->size;
+  stats->size_min = FFMIN(stats->size_min, pkt->size);
+  stats->size_max = FFMAX(stats->size_max, pkt->size);
+  stats->size_hist[log2_bucket(pkt->size, SIZE_HIST_BUCKETS)]++;
+
+  if(pkt->pts == AV_NOPTS_VALUE)
+  {
+    stats->missing_pts++;
+  }
+
+  if(pkt->dts == AV_NOPTS_VALUE)
+  {
+    stats->missing_dts++;
+  }
+  else
+  {
+    if(stats->last_dts != AV_NOPTS_VALUE)
+    {
+      int64_t delta = pkt->dts - stats->last_dts;
+      if(delta <= 0)
+      {
+        stats->dts_non_monotonic++;
+      }
+      else if(stats->last_duration > 0 && delta > 2 * stats->last_duration)
+      {
+        // More than one packet worth of time is missing.
+        stats->dts_gaps++;
+        stats->dts_gap_max = FFMAX(stats->dts_gap_max, delta - stats->last_duration);
+      }
+    }
+    stats->last_dts = pkt->dts;
+    stats->last_duration = pkt->duration;
+  }
+
+  if(pkt->flags & AV_PKT_FLAG_KEY)
+  {
+    stats->keyframes++;
+    if(stats->gop_packets > 0)
+    {
+      stats->gops++;
+      stats->gop_sum += stats->gop_packets;
+      stats->gop_min = FFMIN(stats->gop_min, stats->gop_packets);
+      stats->gop_max = FFMAX(stats->gop_max, stats->gop_packets);
+      stats->gop_hist[log2_bucket(stats->gop_packets, GOP_HIST_BUCKETS)]++;
+    }
+    stats->gop_packets = 0;
+  }
+
+  if(stats->gop_packets >= 0)
+  {
+    stats->gop_packets++;
+  }
+
+  if(ts == AV_NOPTS_VALUE)
+  {
+    stats->window_bytes += pkt->size;
+    return;
+  }
+
+  if(stats->first_ts == AV_NOPTS_VALUE || ts < stats->first_ts)
+  {
+    stats->first_ts = ts;
+  }
+  if(stats->last_ts == AV_NOPTS_VALUE || ts > stats->last_ts)
+  {
+    stats->last_ts = ts;
+  }
+
+  if(stats->window_start == AV_NOPTS_VALUE)
+  {
+    stats->window_start = ts;
+  }
+  else if(ts >= stats->window_start + stats->window_ts)
+  {
+    // Only complete windows count, a gap does not produce empty ones.
+    close_window(stats, stream->time_base);
+    stats->window_bytes = 0;
+    stats->window_start = ts - (ts - stats->window_start) % stats->window_ts;
+  }
+
+  stats->window_bytes += pkt->size;
+}
+
+static void write_json_histogram(FILE* fp, const int64_t* hist, int nb_buckets)
+{
+  int last = nb_buckets - 1;
+  int index;
+
+  // Trailing empty buckets are left out.
+  while(last > 0 && hist[last] == 0)
+  {
+    last--;
+  }
+
+  fputc('[', fp);
+  for(index = 0; index <= last; index++)
+  {
+    fprintf(fp, "%s%" PRId64, index ? "," : "", hist[index]);
+  }
+  fputc(']', fp);
+}
+
+static void write_stream_json(FILE* fp, const StreamStats* stats, AVStream* stream)
+{
+  AVCodecParameters* codecpar = stream->codecpar;
+  const char* type = av_get_media_type_string(codecpar->codec_type);
+  double duration = 0;
+
+  if(stats->first_ts != AV_NOPTS_VALUE)
+  {
+    duration = (stats->last_ts - stats->first_ts + stats->last_duration) * av_q2d(stream->time_base);
+  }
+
+  fprintf(fp, "    {\"index\":%d,\"type\":", stream->index);
+  json_write_string(fp, type ? type : "unknown");
+  fprintf(fp, ",\"codec\":");
+  json_write_string(fp, avcodec_get_name(codecpar->codec_id));
+  fprintf(fp, ",\"packets\":%" PRId64 ",\"bytes\":%" PRId64 ",\"keyframes\":%" PRId64
+    ",\"duration\":%.3f,\"bitrate\":%.0f,\n",
+    stats->packets, stats->bytes, stats->keyframes,
+    duration, duration > 0 ? stats->bytes * 8 / duration : 0.0);
+
+  fprintf(fp, "     \"window_bitrate\":{\"windows\":%" PRId64 ",\"min\":%.0f,\"max\":%.0f,\"mean\":%.0f},\n",
+    stats->windows, stats->window_bitrate_min, stats->window_bitrate_max,
+    stats->windows ? stats->window_bitrate_sum / stats->windows : 0.0);
+
+  fprintf(fp, "     \"packet_size\":{\"min\":%" PRId64 ",\"max\":%" PRId64 ",\"mean\":%.1f,\"log2_hist\":",
+    stats->packets ? stats->size_min : 0, stats->size_max,
+    stats->packets ? (double)stats->bytes / stats->packets : 0.0);
+  write_json_histogram(fp, stats->size_hist, SIZE_HIST_BUCKETS);
+  fprintf(fp, "},\n");
+
+  fprintf(fp, "     \"gop\":{\"count\":%" PRId64 ",\"min\":%" PRId64 ",\"max\":%" PRId64 ",\"mean\":%.1f,\"log2_hist\":",
+    stats->gops, stats->gops ? stats->gop_min : 0, stats->gop_max,
+    stats->gops ? (double)stats->gop_sum / stats->gops : 0.0);
+  write_json_histogram(fp, stats->gop_hist, GOP_HIST_BUCKETS);
+  fprintf(fp, "},\n");
+
+  fprintf(fp, "     \"timestamps\":{\"missing_pts\":%" PRId64 ",\"missing_dts\":%" PRId64
+    ",\"dts_non_monotonic\":%" PRId64 ",\"dts_gaps\":%" PRId64 ",\"dts_gap_max\":%.6f}}",
+    stats->missing_pts, stats->missing_dts, stats->dts_non_monotonic, stats->dts_gaps,
+    stats->dts_gap_max * av_q2d(stream->time_base));
+}
+
+// Reads every packet without printing, then writes one JSON summary.
+static int run_packet_stats(const char* filename, const char* json_path, int64_t window_us)
+{
+  AVFormatContext* fmt_ctx = input_ctx.fmt_ctx;
+  unsigned int nb_streams = fmt_ctx->nb_streams;
+  StreamStats* stats;
+  AVPacket pkt;
+  int64_t start_time, elapsed;
+  unsigned int index;
+  FILE* fp;
+
+  stats = calloc(nb_streams, sizeof(StreamStats));
+  if(stats == NULL)
+  {
+    return -1;
+  }
+
+  for(index = 0; index < nb_streams; index++)
+  {
+    init_stream_stats(&stats[index], fmt_ctx->streams[index], window_us);
+  }
+
+  start_time = av_gettime_relative();
+
+  while(av_read_frame(fmt_ctx, &pkt) >= 0)
+  {
+    // Streams showing up after the header are not tracked.
+    if((unsigned int)pkt.stream_index < nb_streams)
+    {
+      update_stream_stats(&stats[pkt.stream_index], fmt_ctx->streams[pkt.stream_index], &pkt);
+    }
+    av_packet_unref(&pkt);
+  } // while
+
+  elapsed = av_gettime_relative() - start_time;
+
+  fp = fopen(json_path, "w");
+  if(fp == NULL)
+  {
+    printf("Could not create %s\n", json_path);
+    free(stats);
+    return -2;
+  }
+
+  fprintf(fp, "{\"file\":");
+  json_write_string(fp, filename);
+  fprintf(fp, ",\"window\":%.3f,\"elapsed\":%.3f,\"bytes_read\":%" PRId64 ",\n  \"streams\":[\n",
+    window_us / 1000000.0, elapsed / 1000000.0,
+    fmt_ctx->pb != NULL ? fmt_ctx->pb->bytes_read : 0);
+
+  for(index = 0; index < nb_streams; index++)
+  {
+    write_stream_json(fp, &stats[index], fmt_ctx->streams[index]);
+    fprintf(fp, "%s\n", index + 1 < nb_streams ? "," : "");
+  }
+
+  fprintf(fp, "  ]}\n");
+  fclose(fp);
+  free(stats);
+
+  printf("Packet statistics written to %s in %.3f sec\n", json_path, elapsed / 1000000.0);
+
+  return 0;
+}
+
+static void* consume_packets(void* arg)
+{
+  PacketConsumer* consumer = (PacketConsumer*)arg;
+  AVPacket* pkt;
+
+  while((pkt = (AVPacket*)spsc_queue_pop(consumer->queue)) != NULL)
+  {
+    consumer->packets++;
+    consumer->bytes += pkt->size;
+    demux_thread_release_packet(consumer->demux, &pkt);
+  } // while
+
+  return NULL;
+}
+
+// av_read_frame() runs on a demux thread, video and audio packets are
+// consumed on their own threads in parallel.
+static int run_threaded_demux()
+{
+  int indexes[2] = { input_ctx.v_index, input_ctx.a_index };
+  const char* names[2] = { "Video", "Audio" };
+  PacketConsumer consumers[2];
+  pthread_t threads[2];
+  int started[2] = { 0, 0 };
+  DemuxThread demux;
+  int64_t start_time;
+  int index;
+
+  start_time = av_gettime_relative();
+
+  if(demux_thread_start(&demux, input_ctx.fmt_ctx, indexes, 2, demux_queue_size) < 0)
+  {
+    printf("Failed to start demux thread\n");
+    return -1;
+  }
+
+  for(index = 0; index < 2; index++)
+  {
+    memset(&consumers[index], 0, sizeof(PacketConsumer));
+    consumers[index].demux = &demux;
+    consumers[index].queue = demux_thread_queue(&demux, indexes[index]);
+    if(consumers[index].queue == NULL)
+    {
+      continue;
+    }
+
+    if(pthread_create(&threads[index], NULL, consume_packets, &consumers[index]) != 0)
+    {
+      printf("Failed to start consumer thread\n");
+      spsc_queue_abort(consumers[index].queue);
+      continue;
+    }
+    started[index] = 1;
+  } // for
+
+  for(index = 0; index < 2; index++)
+  {
+    if(started[index])
+    {
+      pthread_join(threads[index], NULL);
+    }
+  }
+
+  demux_thread_join(&demux);
+
+  for(index = 0; index < 2; index++)
+  {
+    if(consumers[index].queue != NULL)
+    {
+      printf("%s packets : %" PRId64 " (%" PRId64 " bytes)\n",
+        names[index], consumers[index].packets, consumers[index].bytes);
+    }
+  }
+
+  demux_thread_print_stats(&demux);
+  printf("elapsed : %.3f sec\n", (av_gettime_relative() - start_time) / 1000000.0);
+
+  demux_thread_free(&demux);
+
+  return 0;
+}
+
+// Reads the whole file once and writes <input>.kidx.
+static int build_seek_index(const char* filename)
+{
+  AVFormatContext* fmt_ctx = input_ctx.fmt_ctx;
+  SeekIndexWriter* writer;
+  int64_t* packet_counts;
+  int64_t start_time, keyframes = 0;
+  char index_path[4096];
+  AVPacket pkt;
+  int ret = 0;
+
+  writer = seek_index_writer_alloc(fmt_ctx);
+  packet_counts = calloc(fmt_ctx->nb_streams, sizeof(int64_t));
+  if(writer == NULL || packet_counts == NULL)
+  {
+    seek_index_writer_free(&writer);
+    free(packet_counts);
+    return -1;
+  }
+
+  start_time = av_gettime_relative();
+
+  while(av_read_frame(fmt_ctx, &pkt) >= 0)
+  {
+    if((unsigned int)pkt.stream_index < fmt_ctx->nb_streams)
+    {
+      if(pkt.flags & AV_PKT_FLAG_KEY)
+      {
+        keyframes++;
+      }
+
+      seek_index_writer_add(writer, &pkt, packet_counts[pkt.stream_index]++);
+    }
+    av_packet_unref(&pkt);
+  } // while
+
+  seek_index_path(filename, index_path, sizeof(index_path));
+  if(seek_index_writer_save(writer, index_path, filename) < 0)
+  {
+    ret = -2;
+  }
+  else
+  {
+    printf("Index of %" PRId64 " keyframes written to %s in %.3f sec\n",
+      keyframes, index_path, (av_gettime_relative() - start_time) / 1000000.0);
+  }
+
+  seek_index_writer_free(&writer);
+  free(packet_counts);
+
+  return ret;
+}
+
+// Seeks to the keyframe at or before the given time using <input>.kidx.
+static int seek_with_index(const char* filename, double seconds)
+{
+  AVFormatContext* fmt_ctx = input_ctx.fmt_ctx;
+  int stream_index = (input_ctx.v_index >= 0) ? input_ctx.v_index : input_ctx.a_index;
+  AVStream* stream = fmt_ctx->streams[stream_index];
+  SeekIndexEntry entry;
+  SeekIndex* index;
+  char index_path[4096];
+  int64_t ts, start_time;
+
+  ts = av_rescale_q((int64_t)(seconds * AV_TIME_BASE), AV_TIME_BASE_Q, stream->time_base);
+  if(stream->start_time != AV_NOPTS_VALUE)
+  {
+    ts += stream->start_time;
+  }
+
+  start_time = av_gettime_relative();
+
+  seek_index_path(filename, index_path, sizeof(index_path));
+  index = seek_index_open(index_path, filename);
+  if(index == NULL)
+  {
+    printf("No valid index %s, seeking without it\n", index_path);
+    if(av_seek_frame(fmt_ctx, stream_index, ts, AVSEEK_FLAG_BACKWARD) < 0)
+    {
+      printf("Failed to seek\n");
+      return -1;
+    }
+    printf("Seek done in %.3f ms\n", (av_gettime_relative() - start_time) / 1000.0);
+    return 0;
+  }
+
+  if(seek_index_seek(fmt_ctx, index, stream_index, ts, &entry) < 0)
+  {
+    printf("Failed to seek\n");
+    seek_index_close(&index);
+    return -2;
+  }
+
+  printf("Seek to keyframe pts %" PRId64 " (%.3f sec) at byte %" PRId64 ", packet #%" PRId64 " in %.3f ms\n",
+    entry.pts, entry.pts * av_q2d(stream->time_base), entry.pos, entry.packet_no,
+    (av_gettime_relative() - start_time) / 1000.0);
+
+  seek_index_close(&index);
+
+  return 0;
 }
 
 int main(int argc, char* argv[])
 {
-  int ret;
+  const char* stats_path = NULL;
+  int64_t window_us = 1000000;
+  double seek_seconds = -1;
+  int write_index = 0;
+  int threaded = 0;
+  int ret, opt;
 
   av_log_set_level(AV_LOG_DEBUG);
 
-  if(argc < 2)
+  init_input_options(&input_opts);
+  while((opt = getopt(argc, argv, "fmas:w:ik:t")) != -1)
   {
-    printf("usage : %s <input>\n", argv[0]);
+    switch(opt)
+    {
+    case 'f':
+      input_opts.fast_probe = 1;
+      break;
+    case 'm':
+      input_opts.io_mode = INPUT_IO_MMAP;
+      break;
+    case 'a':
+      input_opts.io_mode = INPUT_IO_READAHEAD;
+      break;
+    case 's':
+      stats_path = optarg;
+      break;
+    case 'w':
+      window_us = (int64_t)(atof(optarg) * 1000000);
+      break;
+    case 'i':
+      write_index = 1;
+      break;
+    case 'k':
+      seek_seconds = atof(optarg);
+      break;
+    case 't':
+      threaded = 1;
+      break;
+    default:
+      optind = argc + 1;
+      break;
+    }
+  } // while
+
+  if(argc - optind < 1)
+  {
+    printf("usage : %s [-f] [-m | -a] [-s stats.json [-w window_sec]] [-i | -k seek_sec] [-t] <input>\n", argv[0]);
     return 0;
   }
 
-  if(open_input(argv[1]) < 0)
+  // Debug logs for every packet would dominate the statistics pass.
+  if(stats_path != NULL || write_index || threaded)
+  {
+    av_log_set_level(AV_LOG_ERROR);
+  }
+
+  if(open_input(argv[optind]) < 0)
+  {
+    goto main_end;
+  }
+
+  if(stats_path != NULL)
+  {
+    run_packet_stats(argv[optind], stats_path, FFMAX(window_us, 1000));
+    goto main_end;
+  }
+
+  if(write_index)
+  {
+    build_seek_index(argv[optind]);
+    goto main_end;
+  }
+
+  if(seek_seconds >= 0 && seek_with_index(argv[optind], seek_seconds) < 0)
+  {
+    goto main_end;
+  }
+
+  if(threaded)
   {
+    run_threaded_demux();
     goto main_end;
   }
 
@@ -1,6 +1,27 @@
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
+#include <libavutil/opt.h>
+#include <libavutil/parseutils.h>
+#include <libavutil/time.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "faststart.h"
+#include "file_list.h"
+#include "interleaver.h"
+#include "media_input.h"
+#include "seek_index.h"
+#include "segment_writer.h"
+#include "writebehind_io.h"
+
+// Remuxing is bound by I/O, more jobs than this per device only add seeking.
+#define JOBS_PER_DEVICE 4
+#define MAX_DEVICES 64
 
 typedef struct _FileContext
 {
@@ -9,41 +30,151 @@ typedef struct _FileContext
   int a_index;
 } FileContext;
 
-static FileContext inputFile, outputFile;
+// One input to one output. Every job owns its contexts, so that many jobs
+// can run at once.
+typedef struct _RemuxJob
+{
+  const char* input_name;
+  const char* output_name;
+  const InputOptions* options;
+  // Prints probe stats, the output layout and the end of input.
+  int verbose;
+  // Segment mode: output_name is the playlist, 0 writes a single file.
+  double segment_duration;
+  // "mpegts", or "mp4" for fragmented MP4 with an initialization segment.
+  const char* segment_format;
+  // Range to copy in AV_TIME_BASE from the start of the input, AV_NOPTS_VALUE
+  // for its start or end.
+  int64_t range_start;
+  int64_t range_end;
+  // Memory budget of the interleaving queue, in bytes.
+  int64_t mux_budget;
+  // Read audio through a second context on the same input, see open_audio_cursor().
+  int use_cursors;
+  // Write the output file through writebehind_io, with these WRITEBEHIND_IO_* flags.
+  int write_behind;
+  int write_flags;
+  // Put the MP4 index in front, see faststart.h.
+  int faststart;
+  // Set by run_concat_job(), create_output() only knows the first input.
+  int concat;
+
+  FileContext input;
+  FileContext output;
+  Interleaver interleaver;
+
+  AVFormatContext* audio_cursor;
+  // Next packet of the video (0) and audio (1) cursor.
+  AVPacket cursor_pkt[2];
+  int cursor_ready[2];
+  int cursor_eof[2];
+
+  int segmenting;
+  SegmentWriter writer;
+  int segment_index;
+  // Start of the current segment and end of the last packet, in AV_TIME_BASE.
+  int64_t segment_start;
+  int64_t segment_end;
+
+  // Absolute range end, and the timestamp that becomes 0 in the output.
+  int64_t range_end_ts;
+  int64_t range_offset;
+
+  int64_t packets;
+  int64_t bytes_read;
+  int64_t bytes_written;
+  int64_t peak_buffered;
+  int64_t elapsed;
+} RemuxJob;
+
+typedef struct _BatchStats
+{
+  int jobs_ok;
+  int jobs_failed;
+  int64_t packets;
+  int64_t bytes_read;
+  int64_t bytes_written;
+  int64_t peak_buffered;
+} BatchStats;
+
+typedef struct _BatchContext
+{
+  FileList* files;
+  // Every job starts as a copy of this one.
+  const RemuxJob* job_template;
+  const char* output_dir;
+  const char* extension;
+  int next_file;
+  pthread_mutex_t lock;
+  BatchStats stats;
+} BatchContext;
+
+static InputOptions input_opts;
+
+enum
+{
+  OPT_START = 256,
+  OPT_END,
+};
+
+static const struct option long_options[] =
+{
+  { "start", required_argument, NULL, OPT_START },
+  { "end", required_argument, NULL, OPT_END },
+  { NULL, 0, NULL, 0 },
+};
+
+// Finished segments kept in memory before the read loop waits for the disk.
+static const uint32_t segment_queue_size = 16;
+// Default memory budget of the interleaving queue, in MiB.
+static const int default_mux_budget = 64;
+// Output buffers of the write-behind mode, one is filled while the other is written.
+static const int writebehind_blocks = 2;
+static const int writebehind_block_size = 4 * 1024 * 1024;
+// Larger indexes make the output fragmented instead.
+static const int64_t max_moov_size = 32 * 1024 * 1024;
 
-static int open_input(const char* fileName)
+static int open_input(RemuxJob* job)
 {
+  FileContext* input = &job->input;
+  ProbeStats probe_stats;
   unsigned int index;
+  int ret;
 
-  inputFile.fmt_ctx = NULL;
-  inputFile.a_index = inputFile.v_index = -1;
+  input->fmt_ctx = NULL;
+  input->a_index = input->v_index = -1;
 
-  if(avformat_open_input(&inputFile.fmt_ctx, fileName, NULL, NULL) < 0)
+  ret = open_media_input(&input->fmt_ctx, job->input_name, job->options, &probe_stats);
+  if(ret == -1)
   {
-    printf("Could not open input file %s\n", fileName);
+    printf("Could not open input file %s\n", job->input_name);
     return -1;
   }
-
-  if(avformat_find_stream_info(inputFile.fmt_ctx, NULL) < 0)
+  else if(ret < 0)
   {
     printf("Failed to retrieve input stream information\n");
     return -2;
   }
 
-  for(index = 0; index < inputFile.fmt_ctx->nb_streams; index++)
+  if(job->verbose)
   {
-    AVCodecParameters* avCodecParams = inputFile.fmt_ctx->streams[index]->codecpar;
-    if(avCodecParams->codec_type == AVMEDIA_TYPE_VIDEO && inputFile.v_index < 0)
+    print_probe_stats(&probe_stats);
+  }
+
+  for(index = 0; index < input->fmt_ctx->nb_streams; index++)
+  {
+    AVCodecParameters* avCodecParams = input->fmt_ctx->streams[index]->codecpar;
+    if(avCodecParams->codec_type == AVMEDIA_TYPE_VIDEO && input->v_index < 0)
     {
-      inputFile.v_index = index;
+      input->v_index = index;
     }
-    else if(avCodecParams->codec_type == AVMEDIA_TYPE_AUDIO && inputFile.a_index < 0)
+    else if(avCodecParams->codec_type == AVMEDIA_TYPE_AUDIO && input->a_index < 0)
     {
-      inputFile.a_index = index;
+      input->a_index = index;
     }
   } // for
 
-  if(inputFile.v_index < 0 && inputFile.a_index < 0)
+  if(input->v_index < 0 && input->a_index < 0)
   {
     printf("Failed to retrieve input stream information\n");
     return -3;
@@ -52,15 +183,290 @@ static int open_input(const char* fileName)
   return 0;
 }
 
-static int create_output(const char* fileName)
+// <playlist name without extension>_<index>.<ts|m4s>, or _init.mp4 for index -1.
+static void make_segment_name(const RemuxJob* job, char* name, size_t size, int index)
+{
+  const char* base = strrchr(job->output_name, '/');
+  const char* dot;
+  int length;
+
+  base = (base != NULL) ? base + 1 : job->output_name;
+  dot = strrchr(base, '.');
+  length = (dot != NULL && dot != base) ? (int)(dot - base) : (int)strlen(base);
+
+  if(index < 0)
+  {
+    snprintf(name, size, "%.*s_init.mp4", length, base);
+  }
+  else
+  {
+    snprintf(name, size, "%.*s_%05d.%s", length, base, index,
+      strcmp(job->segment_format, "mp4") == 0 ? "m4s" : "ts");
+  }
+}
+
+// The muxer writes into a dynamic buffer, which is handed to the segment
+// writer whenever a segment is complete and replaced by a new one.
+static int start_segments(RemuxJob* job)
+{
+  AVFormatContext* fmt_ctx = job->output.fmt_ctx;
+  AVDictionary* muxer_opts = NULL;
+  int is_mp4 = (strcmp(job->segment_format, "mp4") == 0);
+  char name[1024];
+  uint8_t* data;
+  int size, ret;
+
+  job->segment_index = 0;
+  job->segment_start = job->segment_end = AV_NOPTS_VALUE;
+
+  job->segmenting = 1;
+  if(segment_writer_start(&job->writer, job->output_name, job->segment_duration,
+      segment_queue_size) < 0)
+  {
+    printf("Failed to start segment writer\n");
+    return -6;
+  }
+
+  if(avio_open_dyn_buf(&fmt_ctx->pb) < 0)
+  {
+    return -7;
+  }
+
+  if(is_mp4)
+  {
+    // Every flush ends a fragment, the moov box alone is the initialization segment.
+    av_dict_set(&muxer_opts, "movflags", "frag_custom+empty_moov+default_base_moof", 0);
+  }
+
+  ret = avformat_write_header(fmt_ctx, &muxer_opts);
+  av_dict_free(&muxer_opts);
+  if(ret < 0)
+  {
+    printf("Failed writing header into output file\n");
+    return -5;
+  }
+
+  if(is_mp4)
+  {
+    make_segment_name(job, name, sizeof(name), -1);
+    size = avio_close_dyn_buf(fmt_ctx->pb, &data);
+    fmt_ctx->pb = NULL;
+
+    if(segment_writer_submit(&job->writer, name, data, size, -1) < 0 ||
+      avio_open_dyn_buf(&fmt_ctx->pb) < 0)
+    {
+      return -8;
+    }
+  }
+
+  return 0;
+}
+
+// Hands the current segment, which ends at end_time, to the writer.
+static int cut_segment(RemuxJob* job, int64_t end_time, int last)
+{
+  AVFormatContext* fmt_ctx = job->output.fmt_ctx;
+  char name[1024];
+  uint8_t* data;
+  double duration;
+  int size;
+
+  // Everything read so far belongs to this segment, drain the interleaving
+  // queue and then the muxer itself. After the trailer both are empty.
+  if(!last && (interleaver_flush(&job->interleaver) < 0 || av_write_frame(fmt_ctx, NULL) < 0))
+  {
+    return -1;
+  }
+
+  duration = (job->segment_start != AV_NOPTS_VALUE && end_time != AV_NOPTS_VALUE) ?
+    (end_time - job->segment_start) / 1000000.0 : 0.0;
+
+  make_segment_name(job, name, sizeof(name), job->segment_index++);
+  size = avio_close_dyn_buf(fmt_ctx->pb, &data);
+  fmt_ctx->pb = NULL;
+
+  if(segment_writer_submit(&job->writer, name, data, size, duration) < 0)
+  {
+    return -2;
+  }
+
+  job->segment_start = end_time;
+  if(last)
+  {
+    return 0;
+  }
+
+  if(avio_open_dyn_buf(&fmt_ctx->pb) < 0)
+  {
+    return -3;
+  }
+
+  if(strcmp(job->segment_format, "mpegts") == 0)
+  {
+    // Every segment starts with PAT and PMT, so that it can be played alone.
+    av_opt_set(fmt_ctx->priv_data, "mpegts_flags", "+resend_headers", 0);
+  }
+
+  return 0;
+}
+
+// Cuts in front of the first video keyframe, or any packet if there is no
+// video, once the current segment is long enough.
+static int split_segment(RemuxJob* job, const AVPacket* pkt, const AVStream* in_stream)
+{
+  int64_t ts = (pkt->pts != AV_NOPTS_VALUE) ? pkt->pts : pkt->dts;
+  int64_t end;
+
+  if(ts == AV_NOPTS_VALUE)
+  {
+    return 0;
+  }
+
+  ts = av_rescale_q(ts, in_stream->time_base, AV_TIME_BASE_Q);
+  end = ts + av_rescale_q(pkt->duration, in_stream->time_base, AV_TIME_BASE_Q);
+  if(job->segment_end == AV_NOPTS_VALUE || end > job->segment_end)
+  {
+    job->segment_end = end;
+  }
+
+  if(job->segment_start == AV_NOPTS_VALUE)
+  {
+    job->segment_start = ts;
+    return 0;
+  }
+
+  if(job->input.v_index >= 0 &&
+    (pkt->stream_index != job->input.v_index || !(pkt->flags & AV_PKT_FLAG_KEY)))
+  {
+    return 0;
+  }
+
+  if(ts - job->segment_start < (int64_t)(job->segment_duration * 1000000))
+  {
+    return 0;
+  }
+
+  return cut_segment(job, ts, 0);
+}
+
+// Expected samples of every output stream, -1 where they can't be told.
+// Video packets of the range, counted in the .kidx of sample02 from the
+// keyframe the copy starts at. Packets after the keyframe at the end can
+// still be decoded before range_end, so the count runs on to the keyframe
+// after that one. -1 without a valid index.
+static int64_t range_video_samples(const RemuxJob* job, const AVStream* in_stream)
+{
+  AVFormatContext* fmt_ctx = job->input.fmt_ctx;
+  int64_t start_time = (fmt_ctx->start_time != AV_NOPTS_VALUE) ? fmt_ctx->start_time : 0;
+  int64_t first = 0, last = -1;
+  SeekIndexEntry entry;
+  SeekIndex* index;
+  char index_path[4096];
+
+  seek_index_path(job->input_name, index_path, sizeof(index_path));
+  index = seek_index_open(index_path, job->input_name);
+  if(index == NULL)
+  {
+    return -1;
+  }
+
+  if(job->range_start != AV_NOPTS_VALUE)
+  {
+    if(seek_index_lookup(index, in_stream->index, av_rescale_q(job->range_start + start_time,
+      AV_TIME_BASE_Q, in_stream->time_base), &entry) < 0)
+    {
+      first = -1;
+    }
+    else
+    {
+      first = entry.packet_no;
+    }
+  }
+
+  if(job->range_end != AV_NOPTS_VALUE &&
+    seek_index_lookup_next(index, in_stream->index, av_rescale_q(job->range_end + start_time,
+      AV_TIME_BASE_Q, in_stream->time_base), &entry) == 0 &&
+    seek_index_lookup_next(index, in_stream->index, entry.pts + 1, &entry) == 0)
+  {
+    last = entry.packet_no;
+  }
+  else if(in_stream->nb_frames > 0)
+  {
+    // Up to the end of the input.
+    last = in_stream->nb_frames;
+  }
+  seek_index_close(&index);
+
+  if(first < 0 || last < first)
+  {
+    return -1;
+  }
+
+  return last - first;
+}
+
+static void guess_output_samples(const RemuxJob* job, int64_t* nb_samples)
+{
+  const FileContext* input = &job->input;
+  const FileContext* output = &job->output;
+  int whole = (job->range_start == AV_NOPTS_VALUE && job->range_end == AV_NOPTS_VALUE);
+  int64_t duration = input->fmt_ctx->duration;
+  unsigned int index;
+
+  if(duration != AV_NOPTS_VALUE && job->range_end != AV_NOPTS_VALUE)
+  {
+    duration = FFMIN(duration, job->range_end);
+  }
+  if(duration != AV_NOPTS_VALUE && job->range_start != AV_NOPTS_VALUE)
+  {
+    duration -= job->range_start;
+  }
+
+  for(index = 0; index < output->fmt_ctx->nb_streams; index++)
+  {
+    AVStream* in_stream = input->fmt_ctx->streams[
+      (index == output->v_index) ? input->v_index : input->a_index];
+
+    if(job->concat || duration == AV_NOPTS_VALUE)
+    {
+      nb_samples[index] = -1;
+    }
+    else if(index == output->v_index)
+    {
+      // A short guess would leave a file without index, so video that can't
+      // be counted goes fragmented instead.
+      nb_samples[index] = whole ? faststart_video_samples(in_stream,
+        faststart_guess_samples(in_stream->codecpar, in_stream->avg_frame_rate, duration)) :
+        range_video_samples(job, in_stream);
+    }
+    else if(whole && in_stream->nb_frames > 0)
+    {
+      nb_samples[index] = in_stream->nb_frames;
+    }
+    else
+    {
+      nb_samples[index] = faststart_guess_samples(in_stream->codecpar,
+        in_stream->avg_frame_rate, duration);
+    }
+  } // for
+}
+
+static int create_output(RemuxJob* job)
 {
+  FileContext* input = &job->input;
+  FileContext* output = &job->output;
+  AVDictionary* muxer_opts = NULL;
+  int64_t nb_samples[2];
   unsigned int index;
   int out_index;
+  int layout;
+  int ret;
 
-  outputFile.fmt_ctx = NULL;
-  outputFile.a_index = outputFile.v_index = -1;
+  output->fmt_ctx = NULL;
+  output->a_index = output->v_index = -1;
 
-  if(avformat_alloc_output_context2(&outputFile.fmt_ctx, NULL, NULL, fileName) < 0)
+  if(avformat_alloc_output_context2(&output->fmt_ctx, NULL,
+      job->segment_duration > 0 ? job->segment_format : NULL, job->output_name) < 0)
   {
     printf("Could not create output context\n");
     return -1;
@@ -69,18 +475,18 @@ static int create_output(const char* fileName)
   // stream index starts from 0.
   out_index = 0;
   // this copy video/audio streams from input video.
-  for(index = 0; index < inputFile.fmt_ctx->nb_streams; index++)
+  for(index = 0; index < input->fmt_ctx->nb_streams; index++)
   {
     // Make sure we only copy streams which is checked before.
-    if(index != inputFile.v_index && index != inputFile.a_index)
+    if(index != input->v_index && index != input->a_index)
     {
       continue;
     }
 
-    AVStream* in_stream = inputFile.fmt_ctx->streams[index];
+    AVStream* in_stream = input->fmt_ctx->streams[index];
     AVCodecParameters *in_codecpar = in_stream->codecpar;
 
-    AVStream* out_stream = avformat_new_stream(outputFile.fmt_ctx, NULL);
+    AVStream* out_stream = avformat_new_stream(output->fmt_ctx, NULL);
     if(out_stream == NULL)
     {
       printf("Failed to allocate output stream\n");
@@ -96,118 +502,1158 @@ static int create_output(const char* fileName)
     // Remove codec tag info for compatibility with ffmpeg.
     out_stream->codecpar->codec_tag = 0;
 
-    if(index == inputFile.v_index)
+    if(index == input->v_index)
     {
-      outputFile.v_index = out_index++;
+      output->v_index = out_index++;
     }
     else
     {
-      outputFile.a_index = out_index++;
+      output->a_index = out_index++;
     }
   } // for
 
-  if(!(outputFile.fmt_ctx->oformat->flags & AVFMT_NOFILE))
+  if(job->segment_duration > 0)
+  {
+    return start_segments(job);
+  }
+
+  if(!(output->fmt_ctx->oformat->flags & AVFMT_NOFILE))
   {
     // This actually open the file
-    if(avio_open(&outputFile.fmt_ctx->pb, fileName, AVIO_FLAG_WRITE) < 0)
+    if(job->write_behind)
+    {
+      ret = writebehind_io_open(&output->fmt_ctx->pb, job->output_name,
+        writebehind_blocks, writebehind_block_size, job->write_flags);
+    }
+    else
     {
-      printf("Failed to create output file %s\n", fileName);
+      ret = avio_open(&output->fmt_ctx->pb, job->output_name, AVIO_FLAG_WRITE);
+    }
+
+    if(ret < 0)
+    {
+      printf("Failed to create output file %s\n", job->output_name);
       return -4;
     }
   }
 
+  if(job->faststart)
+  {
+    guess_output_samples(job, nb_samples);
+    layout = faststart_set_options(&muxer_opts, output->fmt_ctx, nb_samples, max_moov_size);
+    if(job->verbose)
+    {
+      printf("faststart : %s layout\n", faststart_layout_name(layout));
+    }
+  }
+
   // write the header for output video container.
-  if(avformat_write_header(outputFile.fmt_ctx, NULL) < 0)
+  ret = avformat_write_header(output->fmt_ctx, &muxer_opts);
+  av_dict_free(&muxer_opts);
+  if(ret < 0)
   {
     printf("Failed writing header into output file\n");
-    return -5;  
+    return -5;
   }
 
   return 0;
 }
 
-static void release()
+static int range_stream(const RemuxJob* job)
 {
-  if(inputFile.fmt_ctx != NULL)
+  return (job->input.v_index >= 0) ? job->input.v_index : job->input.a_index;
+}
+
+// Jumps to the last keyframe at or before range_start, through the .kidx
+// index of sample02 when there is a valid one.
+static int seek_range_start(RemuxJob* job)
+{
+  AVFormatContext* fmt_ctx = job->input.fmt_ctx;
+  int stream_index = range_stream(job);
+  AVStream* stream = fmt_ctx->streams[stream_index];
+  int64_t start = job->range_start;
+  SeekIndexEntry entry;
+  SeekIndex* index;
+  char index_path[4096];
+  int ret;
+
+  if(fmt_ctx->start_time != AV_NOPTS_VALUE)
   {
-    avformat_close_input(&inputFile.fmt_ctx);
+    start += fmt_ctx->start_time;
   }
 
-  if(outputFile.fmt_ctx != NULL)
+  seek_index_path(job->input_name, index_path, sizeof(index_path));
+  index = seek_index_open(index_path, job->input_name);
+  if(index != NULL)
   {
-    if(!(outputFile.fmt_ctx->oformat->flags & AVFMT_NOFILE))
+    ret = seek_index_seek(fmt_ctx, index, stream_index,
+      av_rescale_q(start, AV_TIME_BASE_Q, stream->time_base), &entry);
+    seek_index_close(&index);
+
+    if(ret >= 0 && job->verbose)
     {
-      avio_closep(&outputFile.fmt_ctx->pb);
+      printf("range : keyframe at %.3f sec from %s\n",
+        entry.pts * av_q2d(stream->time_base), index_path);
     }
-    avformat_free_context(outputFile.fmt_ctx);
   }
+  else
+  {
+    // With stream_index -1 the timestamps are in AV_TIME_BASE.
+    ret = avformat_seek_file(fmt_ctx, -1, INT64_MIN, start, start, 0);
+  }
+
+  // Audio packets before the video keyframe are dropped anyway.
+  if(ret >= 0 && job->audio_cursor != NULL)
+  {
+    ret = avformat_seek_file(job->audio_cursor, -1, INT64_MIN, start, start, 0);
+  }
+
+  if(ret < 0)
+  {
+    printf("Failed to seek to %.3f sec\n", job->range_start / (double)AV_TIME_BASE);
+    return -1;
+  }
+
+  return 0;
 }
 
-int main(int argc, char* argv[])
+// Returns 1 to copy pkt with rebased timestamps, 0 to drop it, or
+// AVERROR_EOF once the stream of pkt passed the end of the range. The copy
+// ends with the range stream; the other one only stops there.
+static int apply_range(RemuxJob* job, AVPacket* pkt, const AVStream* in_stream)
 {
-  int ret;
+  int64_t ts = (pkt->pts != AV_NOPTS_VALUE) ? pkt->pts : pkt->dts;
+  int64_t dts = (pkt->dts != AV_NOPTS_VALUE) ? pkt->dts : pkt->pts;
+  int64_t offset;
+
+  if(ts == AV_NOPTS_VALUE)
+  {
+    return job->range_offset != AV_NOPTS_VALUE;
+  }
+
+  // Decoding order, so that no kept frame loses a reference.
+  if(job->range_end_ts != AV_NOPTS_VALUE &&
+    av_compare_ts(dts, in_stream->time_base, job->range_end_ts, AV_TIME_BASE_Q) >= 0)
+  {
+    return AVERROR_EOF;
+  }
 
-  av_log_set_level(AV_LOG_DEBUG);
+  if(job->range_offset == AV_NOPTS_VALUE)
+  {
+    // The clip starts at the first keyframe after the seek.
+    if(pkt->stream_index != range_stream(job) || !(pkt->flags & AV_PKT_FLAG_KEY))
+    {
+      return 0;
+    }
 
-  if(argc < 3)
+    job->range_offset = av_rescale_q(ts, in_stream->time_base, AV_TIME_BASE_Q);
+  }
+  else if(pkt->stream_index != range_stream(job) &&
+    av_compare_ts(ts, in_stream->time_base, job->range_offset, AV_TIME_BASE_Q) < 0)
   {
-    printf("usage : %s <input> <output>\n", argv[0]);
     return 0;
   }
 
-  if(open_input(argv[1]) < 0)
+  offset = av_rescale_q(job->range_offset, AV_TIME_BASE_Q, in_stream->time_base);
+  if(pkt->pts != AV_NOPTS_VALUE)
+  {
+    pkt->pts -= offset;
+  }
+  if(pkt->dts != AV_NOPTS_VALUE)
+  {
+    pkt->dts -= offset;
+  }
+
+  return 1;
+}
+
+// With badly interleaved inputs, audio stored far from its video for
+// example, a single demuxer hands over long runs of one stream that must be
+// buffered until the other stream catches up. A second context on the same
+// file reads audio at its own position instead, each context discarding the
+// other stream, so that packets come out in time order with nothing buffered.
+static int open_audio_cursor(RemuxJob* job)
+{
+  unsigned int index;
+
+  if(job->input.v_index < 0 || job->input.a_index < 0)
   {
-    goto main_end;
+    return 0;
   }
 
-  if(create_output(argv[2]) < 0)
+  if(open_media_input(&job->audio_cursor, job->input_name, job->options, NULL) < 0 ||
+    job->audio_cursor->nb_streams != job->input.fmt_ctx->nb_streams)
   {
-    goto main_end;
+    printf("Could not open audio read cursor for %s\n", job->input_name);
+    return -1;
   }
 
-  // dump output container, which i just make from above.
-  av_dump_format(outputFile.fmt_ctx, 0, outputFile.fmt_ctx->url, 1);
+  for(index = 0; index < job->input.fmt_ctx->nb_streams; index++)
+  {
+    if(index != job->input.v_index)
+    {
+      job->input.fmt_ctx->streams[index]->discard = AVDISCARD_ALL;
+    }
 
-  AVPacket pkt;
-  int out_stream_index;
+    if(index != job->input.a_index)
+    {
+      job->audio_cursor->streams[index]->discard = AVDISCARD_ALL;
+    }
+  } // for
 
-  while(1)
+  job->cursor_ready[0] = job->cursor_ready[1] = 0;
+  job->cursor_eof[0] = job->cursor_eof[1] = 0;
+
+  return 0;
+}
+
+// Tells the interleaver that the output stream of input stream
+// in_index gets no more packets.
+static int end_output_stream(RemuxJob* job, int in_index)
+{
+  return interleaver_end_stream(&job->interleaver,
+    (in_index == job->input.v_index) ? job->output.v_index : job->output.a_index);
+}
+
+static int read_input_packet(RemuxJob* job, AVPacket* pkt)
+{
+  AVFormatContext* contexts[2] = { job->input.fmt_ctx, job->audio_cursor };
+  int64_t ts[2];
+  int index, next = -1;
+
+  if(job->audio_cursor == NULL)
+  {
+    return av_read_frame(job->input.fmt_ctx, pkt);
+  }
+
+  for(index = 0; index < 2; index++)
   {
-    ret = av_read_frame(inputFile.fmt_ctx, &pkt);
-    if(ret == AVERROR_EOF)
+    if(!job->cursor_ready[index] && !job->cursor_eof[index])
     {
-      printf("End of frame\n");
-      break;
+      if(av_read_frame(contexts[index], &job->cursor_pkt[index]) < 0)
+      {
+        // Each context reads one stream, which ends here.
+        job->cursor_eof[index] = 1;
+        end_output_stream(job, (index == 0) ? job->input.v_index : job->input.a_index);
+      }
+      else
+      {
+        job->cursor_ready[index] = 1;
+      }
     }
 
-    if(pkt.stream_index != inputFile.v_index && 
-      pkt.stream_index != inputFile.a_index)
+    if(!job->cursor_ready[index])
     {
-      av_packet_unref(&pkt);
       continue;
     }
 
-    AVStream* in_stream = inputFile.fmt_ctx->streams[pkt.stream_index];
-    out_stream_index = (pkt.stream_index == inputFile.v_index) ? 
-            outputFile.v_index : outputFile.a_index;
-    AVStream* out_stream = outputFile.fmt_ctx->streams[out_stream_index];
+    AVPacket* head = &job->cursor_pkt[index];
+    ts[index] = (head->dts != AV_NOPTS_VALUE) ? head->dts : head->pts;
 
-    av_packet_rescale_ts(&pkt, in_stream->time_base, out_stream->time_base);
+    if(next < 0 || ts[index] == AV_NOPTS_VALUE || (ts[next] != AV_NOPTS_VALUE &&
+      av_compare_ts(ts[index], contexts[index]->streams[head->stream_index]->time_base,
+        ts[next], contexts[next]->streams[job->cursor_pkt[next].stream_index]->time_base) < 0))
+    {
+      next = index;
+    }
+  } // for
 
-    pkt.stream_index = out_stream_index;
+  if(next < 0)
+  {
+    return AVERROR_EOF;
+  }
 
-    if(av_interleaved_write_frame(outputFile.fmt_ctx, &pkt) < 0)
-    {
-      printf("Error occurred when writing packet into file\n");
-      break;
-    }   
-  } // while
+  av_packet_move_ref(pkt, &job->cursor_pkt[next]);
+  job->cursor_ready[next] = 0;
 
-  // Writes remain informations, which it is called trailer.
-  av_write_trailer(outputFile.fmt_ctx);
+  return 0;
+}
+
+static int copy_packets(RemuxJob* job)
+{
+  FileContext* input = &job->input;
+  FileContext* output = &job->output;
+  AVPacket pkt;
+  int out_stream_index;
+  int use_range = (job->range_start != AV_NOPTS_VALUE || job->range_end != AV_NOPTS_VALUE);
+  int ret;
+
+  if(interleaver_init(&job->interleaver, output->fmt_ctx, job->mux_budget) < 0)
+  {
+    return -5;
+  }
+
+  if(job->use_cursors && open_audio_cursor(job) < 0)
+  {
+    return -6;
+  }
+
+  if(use_range)
+  {
+    int64_t start_time = (input->fmt_ctx->start_time != AV_NOPTS_VALUE) ?
+      input->fmt_ctx->start_time : 0;
+
+    job->range_end_ts = (job->range_end != AV_NOPTS_VALUE) ?
+      job->range_end + start_time : AV_NOPTS_VALUE;
+    // Without a start, timestamps are kept as they are.
+    job->range_offset = (job->range_start != AV_NOPTS_VALUE) ? AV_NOPTS_VALUE : 0;
+
+    if(job->range_start != AV_NOPTS_VALUE && seek_range_start(job) < 0)
+    {
+      return -4;
+    }
+  }
+
+  while(1)
+  {
+    ret = read_input_packet(job, &pkt);
+    if(ret < 0)
+    {
+      if(ret == AVERROR_EOF && job->verbose)
+      {
+        printf("End of frame\n");
+      }
+      break;
+    }
+
+    if(pkt.stream_index != input->v_index &&
+      pkt.stream_index != input->a_index)
+    {
+      av_packet_unref(&pkt);
+      continue;
+    }
+
+    AVStream* in_stream = input->fmt_ctx->streams[pkt.stream_index];
+    if(use_range)
+    {
+      ret = apply_range(job, &pkt, in_stream);
+      if(ret <= 0)
+      {
+        int stream_index = pkt.stream_index;
+        av_packet_unref(&pkt);
+        if(ret == AVERROR_EOF && stream_index == range_stream(job))
+        {
+          break;
+        }
+        else if(ret == AVERROR_EOF && end_output_stream(job, stream_index) < 0)
+        {
+          printf("Error occurred when writing packet into file\n");
+          return -1;
+        }
+        continue;
+      }
+    }
+
+    if(job->segmenting && split_segment(job, &pkt, in_stream) < 0)
+    {
+      printf("Error occurred when cutting segment\n");
+      av_packet_unref(&pkt);
+      return -3;
+    }
+
+    out_stream_index = (pkt.stream_index == input->v_index) ?
+            output->v_index : output->a_index;
+    AVStream* out_stream = output->fmt_ctx->streams[out_stream_index];
+
+    av_packet_rescale_ts(&pkt, in_stream->time_base, out_stream->time_base);
+
+    pkt.stream_index = out_stream_index;
+    job->packets++;
+
+    if(interleaver_write(&job->interleaver, &pkt) < 0)
+    {
+      printf("Error occurred when writing packet into file\n");
+      return -1;
+    }
+  } // while
+
+  // Writes remain informations, which it is called trailer.
+  if(interleaver_flush(&job->interleaver) < 0 || av_write_trailer(output->fmt_ctx) < 0)
+  {
+    return -2;
+  }
+
+  if(job->segmenting)
+  {
+    return cut_segment(job, job->segment_end, 1);
+  }
+
+  return 0;
+}
+
+// Returns < 0 if the segment writer failed.
+static int release(RemuxJob* job)
+{
+  uint8_t* data;
+  int ret = 0;
+  int index;
+
+  job->peak_buffered = job->interleaver.peak_bytes;
+  if(job->verbose && job->interleaver.streams != NULL)
+  {
+    interleaver_print_stats(&job->interleaver);
+  }
+  interleaver_uninit(&job->interleaver);
+
+  if(job->audio_cursor != NULL)
+  {
+    for(index = 0; index < 2; index++)
+    {
+      if(job->cursor_ready[index])
+      {
+        av_packet_unref(&job->cursor_pkt[index]);
+        job->cursor_ready[index] = 0;
+      }
+    }
+
+    if(job->audio_cursor->pb != NULL)
+    {
+      job->bytes_read += job->audio_cursor->pb->bytes_read;
+    }
+    close_media_input(&job->audio_cursor);
+  }
+
+  if(job->input.fmt_ctx != NULL)
+  {
+    if(job->input.fmt_ctx->pb != NULL)
+    {
+      job->bytes_read += job->input.fmt_ctx->pb->bytes_read;
+    }
+
+    if(job->verbose)
+    {
+      print_input_io_stats(job->input.fmt_ctx);
+    }
+    close_media_input(&job->input.fmt_ctx);
+  }
+
+  if(job->segmenting)
+  {
+    if(job->output.fmt_ctx != NULL && job->output.fmt_ctx->pb != NULL)
+    {
+      // A segment that was never finished.
+      avio_close_dyn_buf(job->output.fmt_ctx->pb, &data);
+      av_free(data);
+      job->output.fmt_ctx->pb = NULL;
+    }
+
+    ret = segment_writer_finish(&job->writer);
+    job->bytes_written = job->writer.bytes_written;
+    if(job->verbose)
+    {
+      segment_writer_print_stats(&job->writer);
+    }
+    job->segmenting = 0;
+  }
+
+  if(job->output.fmt_ctx != NULL)
+  {
+    if(!(job->output.fmt_ctx->oformat->flags & AVFMT_NOFILE))
+    {
+      if(job->output.fmt_ctx->pb != NULL)
+      {
+        job->bytes_written = avio_tell(job->output.fmt_ctx->pb);
+      }
+
+      if(job->write_behind)
+      {
+        if(job->verbose && job->output.fmt_ctx->pb != NULL)
+        {
+          writebehind_io_print_stats(job->output.fmt_ctx->pb);
+        }
+
+        // Write errors of the background thread show up here.
+        if(writebehind_io_close(&job->output.fmt_ctx->pb) < 0)
+        {
+          printf("Failed writing output file %s\n", job->output_name);
+          ret = -1;
+        }
+      }
+      else
+      {
+        avio_closep(&job->output.fmt_ctx->pb);
+      }
+    }
+    avformat_free_context(job->output.fmt_ctx);
+    job->output.fmt_ctx = NULL;
+  }
+
+  return ret;
+}
+
+static int run_remux_job(RemuxJob* job)
+{
+  int64_t start_time = av_gettime_relative();
+  int ret;
+
+  job->input.fmt_ctx = job->output.fmt_ctx = NULL;
+  job->packets = job->bytes_read = job->bytes_written = job->peak_buffered = 0;
+
+  ret = open_input(job);
+  if(ret == 0)
+  {
+    ret = create_output(job);
+  }
+
+  if(ret == 0)
+  {
+    if(job->verbose)
+    {
+      // dump output container, which i just make from above.
+      av_dump_format(job->output.fmt_ctx, 0, job->output.fmt_ctx->url, 1);
+    }
+
+    ret = copy_packets(job);
+  }
+
+  if(release(job) < 0 && ret == 0)
+  {
+    ret = -6;
+  }
+  job->elapsed = av_gettime_relative() - start_time;
+
+  return ret;
+}
+
+// Opens the next input of a concatenation while the current one is copied.
+typedef struct _InputOpener
+{
+  RemuxJob job;
+  pthread_t thread;
+  int started;
+  int ret;
+} InputOpener;
+
+static void* input_opener_thread(void* arg)
+{
+  InputOpener* opener = (InputOpener*)arg;
+
+  opener->ret = open_input(&opener->job);
+
+  return NULL;
+}
+
+static void start_input_opener(InputOpener* opener, const RemuxJob* job, const char* input_name)
+{
+  opener->job = *job;
+  opener->job.input_name = input_name;
+  opener->job.verbose = 0;
+  opener->ret = -1;
+
+  opener->started = (pthread_create(&opener->thread, NULL, input_opener_thread, opener) == 0);
+  if(!opener->started)
+  {
+    // Open it now, without overlap.
+    input_opener_thread(opener);
+  }
+}
+
+static int join_input_opener(InputOpener* opener, FileContext* input)
+{
+  if(opener->started)
+  {
+    pthread_join(opener->thread, NULL);
+    opener->started = 0;
+  }
+
+  *input = opener->job.input;
+  return opener->ret;
+}
+
+static int same_parameters(const AVCodecParameters* a, const AVCodecParameters* b)
+{
+  if(a->codec_id != b->codec_id || a->format != b->format ||
+    a->extradata_size != b->extradata_size ||
+    (a->extradata_size > 0 && memcmp(a->extradata, b->extradata, a->extradata_size) != 0))
+  {
+    return 0;
+  }
+
+  if(a->codec_type == AVMEDIA_TYPE_VIDEO)
+  {
+    return a->width == b->width && a->height == b->height;
+  }
+
+  return a->sample_rate == b->sample_rate && a->channels == b->channels &&
+    a->channel_layout == b->channel_layout;
+}
+
+// Stream copy needs the same streams with the same codec parameters,
+// including the extradata that went into the output header.
+static int check_compatible(const RemuxJob* job, const FileContext* input)
+{
+  AVFormatContext* out_ctx = job->output.fmt_ctx;
+
+  if((input->v_index >= 0) != (job->output.v_index >= 0) ||
+    (input->a_index >= 0) != (job->output.a_index >= 0))
+  {
+    return 0;
+  }
+
+  if(input->v_index >= 0 && !same_parameters(
+      input->fmt_ctx->streams[input->v_index]->codecpar,
+      out_ctx->streams[job->output.v_index]->codecpar))
+  {
+    return 0;
+  }
+
+  if(input->a_index >= 0 && !same_parameters(
+      input->fmt_ctx->streams[input->a_index]->codecpar,
+      out_ctx->streams[job->output.a_index]->codecpar))
+  {
+    return 0;
+  }
+
+  return 1;
+}
+
+// Copies the current input, shifted so that its start lands on *offset.
+// On return *offset is the end of the latest packet, where the next
+// input continues.
+static int concat_input(RemuxJob* job, int64_t* offset)
+{
+  FileContext* input = &job->input;
+  FileContext* output = &job->output;
+  int64_t start = (input->fmt_ctx->start_time != AV_NOPTS_VALUE) ? input->fmt_ctx->start_time : 0;
+  int64_t end = *offset;
+  AVPacket pkt;
+  int out_stream_index;
+
+  while(av_read_frame(input->fmt_ctx, &pkt) >= 0)
+  {
+    if(pkt.stream_index != input->v_index &&
+      pkt.stream_index != input->a_index)
+    {
+      av_packet_unref(&pkt);
+      continue;
+    }
+
+    AVStream* in_stream = input->fmt_ctx->streams[pkt.stream_index];
+    int64_t shift = av_rescale_q(*offset - start, AV_TIME_BASE_Q, in_stream->time_base);
+    int64_t ts;
+
+    if(pkt.pts != AV_NOPTS_VALUE)
+    {
+      pkt.pts += shift;
+    }
+    if(pkt.dts != AV_NOPTS_VALUE)
+    {
+      pkt.dts += shift;
+    }
+
+    ts = (pkt.pts != AV_NOPTS_VALUE) ? pkt.pts : pkt.dts;
+    if(ts != AV_NOPTS_VALUE)
+    {
+      end = FFMAX(end, av_rescale_q(ts + pkt.duration, in_stream->time_base, AV_TIME_BASE_Q));
+    }
+
+    if(job->segmenting && split_segment(job, &pkt, in_stream) < 0)
+    {
+      printf("Error occurred when cutting segment\n");
+      av_packet_unref(&pkt);
+      return -3;
+    }
+
+    out_stream_index = (pkt.stream_index == input->v_index) ?
+            output->v_index : output->a_index;
+    AVStream* out_stream = output->fmt_ctx->streams[out_stream_index];
+
+    av_packet_rescale_ts(&pkt, in_stream->time_base, out_stream->time_base);
+
+    pkt.stream_index = out_stream_index;
+    job->packets++;
+
+    if(interleaver_write(&job->interleaver, &pkt) < 0)
+    {
+      printf("Error occurred when writing packet into file\n");
+      return -1;
+    }
+  } // while
+
+  *offset = end;
+  return 0;
+}
+
+// Joins input_names into job->output_name. The output takes its streams
+// from the first input, every later input must match them.
+static int run_concat_job(RemuxJob* job, char** input_names, int nb_inputs)
+{
+  int64_t start_time = av_gettime_relative();
+  InputOpener opener;
+  FileContext next_input;
+  int64_t offset = 0;
+  int index, ret;
+
+  memset(&opener, 0, sizeof(opener));
+  job->input.fmt_ctx = job->output.fmt_ctx = NULL;
+  job->packets = job->bytes_read = job->bytes_written = job->peak_buffered = 0;
+  job->input_name = input_names[0];
+  job->concat = 1;
+
+  ret = open_input(job);
+  if(ret == 0)
+  {
+    ret = create_output(job);
+  }
+
+  if(ret == 0 && interleaver_init(&job->interleaver, job->output.fmt_ctx, job->mux_budget) < 0)
+  {
+    ret = -5;
+  }
+
+  for(index = 0; ret == 0 && index < nb_inputs; index++)
+  {
+    if(index + 1 < nb_inputs)
+    {
+      start_input_opener(&opener, job, input_names[index + 1]);
+    }
+
+    if(index > 0 && !check_compatible(job, &job->input))
+    {
+      printf("%s does not match the codec parameters of %s\n", job->input_name, input_names[0]);
+      ret = -7;
+    }
+
+    if(ret == 0)
+    {
+      if(job->verbose)
+      {
+        printf("concat : %s at %.3f sec\n", job->input_name, offset / (double)AV_TIME_BASE);
+      }
+      ret = concat_input(job, &offset);
+    }
+
+    if(job->input.fmt_ctx->pb != NULL)
+    {
+      job->bytes_read += job->input.fmt_ctx->pb->bytes_read;
+    }
+    if(job->verbose)
+    {
+      print_input_io_stats(job->input.fmt_ctx);
+    }
+    close_media_input(&job->input.fmt_ctx);
+
+    if(index + 1 < nb_inputs)
+    {
+      if(join_input_opener(&opener, &next_input) < 0)
+      {
+        close_media_input(&next_input.fmt_ctx);
+        ret = (ret < 0) ? ret : -1;
+        continue;
+      }
+
+      if(ret < 0)
+      {
+        close_media_input(&next_input.fmt_ctx);
+        continue;
+      }
+
+      job->input = next_input;
+      job->input_name = input_names[index + 1];
+    }
+  } // for
+
+  if(ret == 0 && (interleaver_flush(&job->interleaver) < 0 ||
+    av_write_trailer(job->output.fmt_ctx) < 0))
+  {
+    ret = -2;
+  }
+
+  if(ret == 0 && job->segmenting)
+  {
+    ret = cut_segment(job, job->segment_end, 1);
+  }
+
+  if(release(job) < 0 && ret == 0)
+  {
+    ret = -6;
+  }
+  job->input_name = input_names[0];
+  job->elapsed = av_gettime_relative() - start_time;
+
+  return ret;
+}
+
+static void print_job(const RemuxJob* job)
+{
+  printf("%s -> %s : %" PRId64 " packets, %.1f MB read, %.1f MB written, %.1f MB peak buffered, %.3f sec, %.1f MB/s\n",
+    job->input_name, job->output_name, job->packets,
+    job->bytes_read / 1048576.0, job->bytes_written / 1048576.0, job->peak_buffered / 1048576.0,
+    job->elapsed / 1000000.0,
+    job->elapsed > 0 ? job->bytes_read / 1048576.0 * 1000000.0 / job->elapsed : 0.0);
+}
+
+// <output_dir>/<input name without extension>.<extension>
+static void make_output_name(char* output_name, size_t size, const char* output_dir,
+                             const char* input_name, const char* extension)
+{
+  const char* base = strrchr(input_name, '/');
+  const char* dot;
+  int length;
+
+  base = (base != NULL) ? base + 1 : input_name;
+  dot = strrchr(base, '.');
+  length = (dot != NULL && dot != base) ? (int)(dot - base) : (int)strlen(base);
+
+  snprintf(output_name, size, "%s/%.*s.%s", output_dir, length, base, extension);
+}
+
+static void* remux_worker(void* arg)
+{
+  BatchContext* batch = (BatchContext*)arg;
+  BatchStats stats = { 0 };
+  char output_name[4096];
+  RemuxJob job;
+  int file_index;
+
+  job = *batch->job_template;
+
+  while(1)
+  {
+    pthread_mutex_lock(&batch->lock);
+    file_index = batch->next_file++;
+    pthread_mutex_unlock(&batch->lock);
+
+    if(file_index >= batch->files->count)
+    {
+      break;
+    }
+
+    job.input_name = batch->files->paths[file_index];
+    make_output_name(output_name, sizeof(output_name), batch->output_dir,
+      job.input_name, batch->extension);
+    job.output_name = output_name;
+
+    if(run_remux_job(&job) < 0)
+    {
+      stats.jobs_failed++;
+      pthread_mutex_lock(&batch->lock);
+      printf("%s : failed to remux\n", job.input_name);
+      pthread_mutex_unlock(&batch->lock);
+      continue;
+    }
+
+    stats.jobs_ok++;
+    stats.packets += job.packets;
+    stats.bytes_read += job.bytes_read;
+    stats.bytes_written += job.bytes_written;
+    stats.peak_buffered = FFMAX(stats.peak_buffered, job.peak_buffered);
+
+    pthread_mutex_lock(&batch->lock);
+    print_job(&job);
+    pthread_mutex_unlock(&batch->lock);
+  } // while
+
+  // Merge the counters once, instead of taking the lock for every job.
+  pthread_mutex_lock(&batch->lock);
+  batch->stats.jobs_ok += stats.jobs_ok;
+  batch->stats.jobs_failed += stats.jobs_failed;
+  batch->stats.packets += stats.packets;
+  batch->stats.bytes_read += stats.bytes_read;
+  batch->stats.bytes_written += stats.bytes_written;
+  batch->stats.peak_buffered = FFMAX(batch->stats.peak_buffered, stats.peak_buffered);
+  pthread_mutex_unlock(&batch->lock);
+
+  return NULL;
+}
+
+// One job per core, but no more than JOBS_PER_DEVICE for each device the
+// inputs and the output directory live on.
+static int default_workers(const FileList* files, const char* output_dir)
+{
+  dev_t devices[MAX_DEVICES];
+  int nb_devices = 0;
+  int nb_workers;
+  struct stat st;
+  int index, device;
+
+  for(index = -1; index < files->count && nb_devices < MAX_DEVICES; index++)
+  {
+    if(stat(index < 0 ? output_dir : files->paths[index], &st) < 0)
+    {
+      continue;
+    }
+
+    for(device = 0; device < nb_devices && devices[device] != st.st_dev; device++);
+    if(device == nb_devices)
+    {
+      devices[nb_devices++] = st.st_dev;
+    }
+  } // for
+
+  nb_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if(nb_devices > 0 && nb_workers > nb_devices * JOBS_PER_DEVICE)
+  {
+    nb_workers = nb_devices * JOBS_PER_DEVICE;
+  }
+
+  return nb_workers;
+}
+
+static int run_batch(FileList* files, const RemuxJob* job_template, const char* output_dir,
+                     const char* extension, int nb_workers)
+{
+  BatchContext batch;
+  pthread_t* workers;
+  int64_t start_time, elapsed;
+  int index, started;
+
+  if(nb_workers > files->count)
+  {
+    nb_workers = files->count;
+  }
+
+  if(nb_workers < 1)
+  {
+    printf("No input files\n");
+    return -1;
+  }
+
+  workers = calloc(nb_workers, sizeof(pthread_t));
+  if(workers == NULL)
+  {
+    return -2;
+  }
+
+  memset(&batch, 0, sizeof(batch));
+  batch.files = files;
+  batch.job_template = job_template;
+  batch.output_dir = output_dir;
+  batch.extension = extension;
+  pthread_mutex_init(&batch.lock, NULL);
+
+  start_time = av_gettime_relative();
+
+  for(started = 0; started < nb_workers; started++)
+  {
+    if(pthread_create(&workers[started], NULL, remux_worker, &batch) != 0)
+    {
+      printf("Failed to start worker thread\n");
+      break;
+    }
+  } // for
+
+  // If no thread could be started, remux on this thread.
+  if(started == 0)
+  {
+    remux_worker(&batch);
+  }
+
+  for(index = 0; index < started; index++)
+  {
+    pthread_join(workers[index], NULL);
+  }
+
+  elapsed = av_gettime_relative() - start_time;
+
+  printf("------- Batch summary -------\n");
+  printf("workers : %d\n", started > 0 ? started : 1);
+  printf("jobs : %d (ok %d / failed %d)\n",
+    files->count, batch.stats.jobs_ok, batch.stats.jobs_failed);
+  printf("packets : %" PRId64 "\n", batch.stats.packets);
+  printf("peak interleave buffer : %.1f MB\n", batch.stats.peak_buffered / 1048576.0);
+  printf("read : %.1f MB / written : %.1f MB\n",
+    batch.stats.bytes_read / 1048576.0, batch.stats.bytes_written / 1048576.0);
+  printf("elapsed : %.3f sec\n", elapsed / 1000000.0);
+  if(elapsed > 0)
+  {
+    printf("throughput : %.1f MB/s read, %.2f jobs/sec\n",
+      batch.stats.bytes_read / 1048576.0 * 1000000.0 / elapsed,
+      files->count * 1000000.0 / elapsed);
+  }
+
+  pthread_mutex_destroy(&batch.lock);
+  free(workers);
+
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  FileList files = { 0 };
+  const char* output_dir = NULL;
+  const char* extension = "mp4";
+  int nb_workers = 0;
+  double segment_duration = 0;
+  const char* segment_format = "mpegts";
+  int64_t range_start = AV_NOPTS_VALUE;
+  int64_t range_end = AV_NOPTS_VALUE;
+  int mux_budget = default_mux_budget;
+  int use_cursors = 0;
+  int concat = 0;
+  int write_behind = 0;
+  int write_flags = 0;
+  int faststart = 0;
+  RemuxJob job;
+  struct stat st;
+  int opt, index;
+
+  init_input_options(&input_opts);
+  while((opt = getopt_long(argc, argv, "fmacb:e:j:l:s:S:M:pwdyDF", long_options, NULL)) != -1)
+  {
+    switch(opt)
+    {
+    case 'f':
+      input_opts.fast_probe = 1;
+      break;
+    case 'm':
+      input_opts.io_mode = INPUT_IO_MMAP;
+      break;
+    case 'a':
+      input_opts.io_mode = INPUT_IO_READAHEAD;
+      break;
+    case 'c':
+      concat = 1;
+      break;
+    case 'b':
+      output_dir = optarg;
+      break;
+    case 'e':
+      extension = optarg;
+      break;
+    case 'j':
+      nb_workers = atoi(optarg);
+      break;
+    case 'l':
+      file_list_add_list(&files, optarg);
+      break;
+    case 's':
+      segment_duration = atof(optarg);
+      break;
+    case 'M':
+      mux_budget = atoi(optarg);
+      break;
+    case 'p':
+      use_cursors = 1;
+      break;
+    case 'w':
+      write_behind = 1;
+      break;
+    case 'd':
+      write_behind = 1;
+      write_flags |= WRITEBEHIND_IO_DIRECT;
+      break;
+    case 'y':
+      write_behind = 1;
+      write_flags |= WRITEBEHIND_IO_SYNC_CLOSE;
+      break;
+    case 'D':
+      write_behind = 1;
+      write_flags |= WRITEBEHIND_IO_SYNC_BLOCKS;
+      break;
+    case 'F':
+      faststart = 1;
+      break;
+    case 'S':
+      segment_format = (strcmp(optarg, "mp4") == 0) ? "mp4" : "mpegts";
+      break;
+    case OPT_START:
+    case OPT_END:
+      // Seconds, or [HH:]MM:SS[.m...]
+      if(av_parse_time(opt == OPT_START ? &range_start : &range_end, optarg, 1) < 0)
+      {
+        printf("Invalid time %s\n", optarg);
+        optind = argc + 1;
+      }
+      break;
+    default:
+      optind = argc + 1;
+      break;
+    }
+  } // while
+
+  if(optind > argc || (output_dir == NULL && !concat && argc - optind < 2) ||
+    (output_dir != NULL && optind == argc && files.count == 0) ||
+    (concat && (output_dir != NULL || argc - optind + files.count < 3)))
+  {
+    printf("usage : %s [-f] [-m | -a] [-M budget_mb] [-p] [-w] [-d] [-y] [-D] [-F] [--start time] [--end time] [-s segment_sec [-S ts|mp4]] <input> <output|playlist.m3u8>\n", argv[0]);
+    printf("        %s [-f] [-m | -a] [-M budget_mb] [-p] [-w] [-d] [-y] [-D] [-F] [--start time] [--end time] [-s segment_sec [-S ts|mp4]] -b output_dir [-e extension] [-j jobs] [-l filelist] <input|directory>...\n", argv[0]);
+    printf("        %s [-f] [-m | -a] [-M budget_mb] [-w] [-d] [-y] [-D] [-F] [-s segment_sec [-S ts|mp4]] -c [-l filelist] <input>... <output|playlist.m3u8>\n", argv[0]);
+    file_list_free(&files);
+    return 0;
+  }
+
+  memset(&job, 0, sizeof(job));
+  job.options = &input_opts;
+  job.segment_duration = segment_duration;
+  job.segment_format = segment_format;
+  job.range_start = range_start;
+  job.range_end = range_end;
+  job.mux_budget = (int64_t)FFMAX(mux_budget, 1) * 1024 * 1024;
+  job.use_cursors = use_cursors;
+  job.write_behind = write_behind;
+  job.write_flags = write_flags;
+  job.faststart = faststart;
+
+  if(concat)
+  {
+    // The inputs of the list come first, the last argument is the output.
+    for(index = optind; index < argc - 1; index++)
+    {
+      file_list_add(&files, argv[index]);
+    }
+
+    av_log_set_level(AV_LOG_DEBUG);
+
+    job.output_name = argv[argc - 1];
+    job.verbose = 1;
+    job.range_start = job.range_end = AV_NOPTS_VALUE;
+    job.use_cursors = 0;
+
+    if(files.count >= 2 && run_concat_job(&job, files.paths, files.count) == 0)
+    {
+      print_job(&job);
+    }
+
+    file_list_free(&files);
+    return 0;
+  }
+
+  if(output_dir == NULL)
+  {
+    av_log_set_level(AV_LOG_DEBUG);
+
+    job.input_name = argv[optind];
+    job.output_name = argv[optind + 1];
+    job.verbose = 1;
+
+    if(run_remux_job(&job) == 0)
+    {
+      print_job(&job);
+    }
+
+    file_list_free(&files);
+    return 0;
+  }
+
+  for(index = optind; index < argc; index++)
+  {
+    if(stat(argv[index], &st) == 0 && S_ISDIR(st.st_mode))
+    {
+      file_list_add_directory(&files, argv[index]);
+    }
+    else
+    {
+      file_list_add(&files, argv[index]);
+    }
+  } // for
+
+  // Library logs from many threads would only interleave, keep errors only.
+  av_log_set_level(AV_LOG_ERROR);
+
+  if(nb_workers <= 0)
+  {
+    nb_workers = default_workers(&files, output_dir);
+  }
+
+  // Each job writes its playlist, the segments are named after it.
+  if(segment_duration > 0)
+  {
+    extension = "m3u8";
+  }
 
-main_end:
-  release();
+  run_batch(&files, &job, output_dir, extension, nb_workers);
+  file_list_free(&files);
 
   return 0;
 }
@@ -3,6 +3,18 @@
 #include <libavutil/common.h>
 #include <libavutil/avutil.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "decode_options.h"
+#include "demux_thread.h"
+#include "frame_hash.h"
+#include "gop_decoder.h"
+#include "json_util.h"
+#include "latency_hist.h"
+#include "media_input.h"
+#include "seek_index.h"
 
 typedef struct _FileContext
 {
@@ -13,7 +25,61 @@ typedef struct _FileContext
   int a_index;
 } FileContext;
 
+typedef struct _DecodeWorker
+{
+  DemuxThread* demux;
+  SpscQueue* queue;
+  AVCodecContext* codec_ctx;
+  int64_t frames;
+} DecodeWorker;
+
+// Benchmark figures of one stream. busy is the time spent inside
+// avcodec_send_packet() and avcodec_receive_frame(), in nanoseconds.
+typedef struct _StreamBench
+{
+  int64_t frames;
+  int64_t pixels;
+  int64_t samples;
+  int64_t busy;
+  LatencyHist send_hist;
+  LatencyHist receive_hist;
+} StreamBench;
+
+// Frame hashing figures of one stream, time in nanoseconds.
+typedef struct _StreamHash
+{
+  int64_t frames;
+  int64_t bytes;
+  int64_t time;
+} StreamHash;
+
 static FileContext inputFile;
+static InputOptions input_opts;
+static DecodeOptions decode_opts;
+// Decoded frames come from frame_pool when -P gives it a size in MiB.
+static FramePool frame_pool;
+static int frame_pool_mb = 0;
+
+// Depth of each per-stream packet queue in threaded mode.
+static const uint32_t demux_queue_size = 256;
+
+// With -b, frames are not printed and every decoder call is timed instead.
+// Video and audio; in threaded mode each is only touched by its own worker.
+static int bench_mode = 0;
+static StreamBench stream_bench[2];
+
+// With -k, only video keyframes are decoded, one every keyframe_interval
+// seconds, or every one of them at 0. Negative means off.
+static double keyframe_interval = -1.0;
+
+// With -g, the video is decoded by this many decoders on ranges of the file.
+static int gop_workers = 0;
+
+// With -H, every frame is hashed into a framemd5-style line of hash_file
+// instead of being printed. One fprintf() per line, so with -t the lines of
+// the two streams interleave but each stream's stay in order.
+static FILE* hash_file = NULL;
+static StreamHash stream_hash[2];
 
 static int open_decoder(AVCodecContext **codec_ctx, AVStream* stream)
 {
@@ -42,34 +108,44 @@ static int open_decoder(AVCodecContext **codec_ctx, AVStream* stream)
     (*codec_ctx)->framerate = av_guess_frame_rate(inputFile.fmt_ctx, stream, NULL);
   }
 
+  apply_decode_options(*codec_ctx, &decode_opts);
+
   // Open the codec using decoder
   if(avcodec_open2(*codec_ctx, decoder, NULL) < 0)
   {
     return -4;
   }
 
+  printf("%s decoder : %s, %d threads, %s threading\n",
+    av_get_media_type_string((*codec_ctx)->codec_type), decoder->name,
+    (*codec_ctx)->thread_count, thread_type_name((*codec_ctx)->active_thread_type));
+
   return 0;
 }
 
 static int open_input(const char* filename)
 {
+  ProbeStats probe_stats;
   unsigned int index;
+  int ret;
   inputFile.fmt_ctx = NULL;
   inputFile.a_codec_ctx = inputFile.v_codec_ctx = NULL;
   inputFile.a_index = inputFile.v_index = -1;
 
-  if(avformat_open_input(&inputFile.fmt_ctx, filename, NULL, NULL) < 0)
+  ret = open_media_input(&inputFile.fmt_ctx, filename, &input_opts, &probe_stats);
+  if(ret == -1)
   {
     printf("Could not open input file %s\n", filename);
     return -1;
   }
-
-  if(avformat_find_stream_info(inputFile.fmt_ctx, NULL) < 0)
+  else if(ret < 0)
   {
     printf("Failed to retrieve input stream information\n");
     return -2;
   }
 
+  print_probe_stats(&probe_stats);
+
   for(index = 0; index < inputFile.fmt_ctx->nb_streams; index++)
   {
     AVStream* stream = inputFile.fmt_ctx->streams[index];
@@ -116,52 +192,405 @@ static void release()
 
   if(inputFile.fmt_ctx != NULL)
   {
-    avformat_close_input(&inputFile.fmt_ctx);
+    print_input_io_stats(inputFile.fmt_ctx);
+    close_media_input(&inputFile.fmt_ctx);
+  }
+}
+
+// One printf() per frame, so that lines of parallel decoders do not mix.
+static void print_frame(AVCodecContext* codec_ctx, AVFrame* frame)
+{
+  if(codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO)
+  {
+    printf("-----------------------\n"
+      "Video : frame->width, height : %dx%d\n"
+      "Video : frame->sample_aspect_ratio : %d/%d\n",
+      frame->width, frame->height,
+      frame->sample_aspect_ratio.num, frame->sample_aspect_ratio.den);
+  }
+  else
+  {
+    printf("-----------------------\n"
+      "Audio : frame->nb_samples : %d\n"
+      "Audio : frame->channels : %d\n",
+      frame->nb_samples, frame->channels);
+  }
+}
+
+static void count_frame(StreamBench* bench, AVFrame* frame)
+{
+  bench->frames++;
+  bench->pixels += (int64_t)frame->width * frame->height;
+  bench->samples += frame->nb_samples;
+}
+
+// Writes the line of one decoded frame : stream index, dts, pts, duration,
+// bytes hashed and the hash of the visible picture or samples.
+static void hash_frame(AVCodecContext* codec_ctx, AVFrame* frame)
+{
+  int is_video = (codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO);
+  StreamHash* stats = &stream_hash[is_video ? 0 : 1];
+  uint8_t hash[FRAME_HASH_SIZE];
+  char hash_str[FRAME_HASH_SIZE * 2 + 1];
+  int64_t start_time = latency_now();
+  int64_t size;
+
+  size = frame_hash_frame(frame, hash);
+  stats->time += latency_now() - start_time;
+  if(size < 0)
+  {
+    fprintf(hash_file, "%d, can't hash this %s frame\n", is_video ? inputFile.v_index : inputFile.a_index,
+      av_get_media_type_string(codec_ctx->codec_type));
+    return;
   }
+
+  stats->frames++;
+  stats->bytes += size;
+
+  frame_hash_to_string(hash, hash_str);
+  fprintf(hash_file, "%d, %10" PRId64 ", %10" PRId64 ", %8" PRId64 ", %8" PRId64 ", %s\n",
+    is_video ? inputFile.v_index : inputFile.a_index, frame->pkt_dts,
+    frame->best_effort_timestamp, frame->pkt_duration, size, hash_str);
 }
 
+// Submits pkt, or NULL to flush at the end of the stream, and prints every
+// frame the decoder has ready. A frame-threaded decoder holds back several
+// frames and then returns them in a burst, so it must be drained until EAGAIN.
+// With -H the frames are hashed rather than printed.
+// In bench mode the frames are counted instead, and each call is timed; a
+// receive that comes back empty adds to busy but not to the histogram.
+// Returns the number of frames, or a negative error.
 static int decode_packet(AVCodecContext* codec_ctx, AVPacket* pkt, AVFrame* frame)
 {
+  StreamBench* bench = NULL;
+  int64_t start_time = 0, elapsed;
+  int frames = 0;
   int ret;
 
+  if(bench_mode)
+  {
+    bench = &stream_bench[codec_ctx->codec_type == AVMEDIA_TYPE_VIDEO ? 0 : 1];
+    start_time = latency_now();
+  }
+
   // submit the packet to the decoder
-  if(avcodec_send_packet(codec_ctx, pkt) < 0)
+  ret = avcodec_send_packet(codec_ctx, pkt);
+  if(bench != NULL)
+  {
+    elapsed = latency_now() - start_time;
+    bench->busy += elapsed;
+    latency_hist_add(&bench->send_hist, elapsed);
+  }
+
+  if(ret < 0)
   {
     return -1;
   }
 
   // Get all the available frames from the decoder
-  ret = avcodec_receive_frame(codec_ctx, frame);
-  if(ret < 0)
+  while(1)
+  {
+    if(bench != NULL)
+    {
+      start_time = latency_now();
+    }
+
+    ret = avcodec_receive_frame(codec_ctx, frame);
+    if(bench != NULL)
+    {
+      elapsed = latency_now() - start_time;
+      bench->busy += elapsed;
+      if(ret >= 0)
+      {
+        latency_hist_add(&bench->receive_hist, elapsed);
+      }
+    }
+
+    if(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+    {
+      break;
+    }
+    else if(ret < 0)
+    {
+      return ret;
+    }
+
+    if(hash_file != NULL)
+    {
+      hash_frame(codec_ctx, frame);
+    }
+
+    if(bench != NULL)
+    {
+      count_frame(bench, frame);
+    }
+    else if(hash_file == NULL)
+    {
+      print_frame(codec_ctx, frame);
+    }
+    av_frame_unref(frame);
+    frames++;
+  } // while
+
+  return frames;
+}
+
+static double per_second(int64_t count, int64_t nanoseconds)
+{
+  return nanoseconds > 0 ? count * 1000000000.0 / nanoseconds : 0.0;
+}
+
+// Throughput over the wall time of the whole decode, and over the time spent
+// in decoder calls, which leaves out demuxing and, with -t, waiting.
+static void print_bench_report(int64_t elapsed)
+{
+  AVCodecContext* codec_ctxs[2] = { inputFile.v_codec_ctx, inputFile.a_codec_ctx };
+  int index;
+
+  printf("------- Decode benchmark : %.3f sec -------\n", elapsed / 1000000000.0);
+  for(index = 0; index < 2; index++)
+  {
+    const StreamBench* bench = &stream_bench[index];
+    if(codec_ctxs[index] == NULL)
+    {
+      continue;
+    }
+
+    if(index == 0)
+    {
+      printf("Video %s : %" PRId64 " frames / %.1f fps / %.2f MP/s (%.1f fps / %.2f MP/s in decoder calls)\n",
+        codec_ctxs[index]->codec->name, bench->frames, per_second(bench->frames, elapsed),
+        per_second(bench->pixels, elapsed) / 1000000.0, per_second(bench->frames, bench->busy),
+        per_second(bench->pixels, bench->busy) / 1000000.0);
+    }
+    else
+    {
+      printf("Audio %s : %" PRId64 " frames / %.1f fps / %.0f samples/s (%.0f samples/s in decoder calls)\n",
+        codec_ctxs[index]->codec->name, bench->frames, per_second(bench->frames, elapsed),
+        per_second(bench->samples, elapsed), per_second(bench->samples, bench->busy));
+    }
+
+    latency_hist_print(&bench->send_hist, "  send_packet");
+    latency_hist_print(&bench->receive_hist, "  receive_frame");
+  } // for
+}
+
+static void write_hash_header()
+{
+  AVCodecContext* codec_ctxs[2] = { inputFile.v_codec_ctx, inputFile.a_codec_ctx };
+  int indexes[2] = { inputFile.v_index, inputFile.a_index };
+  AVStream* stream;
+  int index;
+
+  fprintf(hash_file, "#format: frame checksums\n#version: 2\n#hash: FH128\n");
+  for(index = 0; index < 2; index++)
   {
-    return ret;
+    if(codec_ctxs[index] == NULL)
+    {
+      continue;
+    }
+
+    stream = inputFile.fmt_ctx->streams[indexes[index]];
+    fprintf(hash_file, "#tb %d: %d/%d\n#media_type %d: %s\n", indexes[index],
+      stream->time_base.num, stream->time_base.den,
+      indexes[index], av_get_media_type_string(codec_ctxs[index]->codec_type));
+    if(index == 0)
+    {
+      fprintf(hash_file, "#dimensions %d: %dx%d\n#sar %d: %d/%d\n",
+        indexes[index], codec_ctxs[index]->width, codec_ctxs[index]->height,
+        indexes[index], codec_ctxs[index]->sample_aspect_ratio.num,
+        codec_ctxs[index]->sample_aspect_ratio.den);
+    }
+    else
+    {
+      fprintf(hash_file, "#sample_rate %d: %d\n#channels %d: %d\n",
+        indexes[index], codec_ctxs[index]->sample_rate, indexes[index], codec_ctxs[index]->channels);
+    }
+  } // for
+
+  fprintf(hash_file, "#stream#, dts,        pts, duration,     size, hash\n");
+}
+
+// Hashing throughput, and its share of the whole run, which should stay
+// small enough not to slow down a multi-threaded decoder.
+static void print_hash_report(int64_t elapsed)
+{
+  int index;
+
+  printf("------- Frame hash : %s -------\n", frame_hash_name());
+  for(index = 0; index < 2; index++)
+  {
+    const StreamHash* stats = &stream_hash[index];
+    if(stats->frames == 0)
+    {
+      continue;
+    }
+
+    printf("%s : %" PRId64 " frames / %.1f MiB in %.3f sec / %.0f MiB/s / %.1f%% of the run\n",
+      index == 0 ? "Video" : "Audio", stats->frames, stats->bytes / 1048576.0,
+      stats->time / 1000000000.0, per_second(stats->bytes, stats->time) / 1048576.0,
+      elapsed > 0 ? stats->time * 100.0 / elapsed : 0.0);
+  } // for
+}
+
+static int write_bench_json(const char* path, const char* filename, int threaded, int64_t elapsed)
+{
+  AVCodecContext* codec_ctxs[2] = { inputFile.v_codec_ctx, inputFile.a_codec_ctx };
+  int index, first = 1;
+  FILE* fp;
+
+  fp = fopen(path, "w");
+  if(fp == NULL)
+  {
+    printf("Could not create %s\n", path);
+    return -1;
   }
 
+  fprintf(fp, "{\"file\":");
+  json_write_string(fp, filename);
+  fprintf(fp, ",\"ffmpeg\":");
+  json_write_string(fp, av_version_info());
+  fprintf(fp, ",\"threaded\":%d,\"elapsed\":%.6f,\n  \"streams\":[\n", threaded, elapsed / 1000000000.0);
+
+  for(index = 0; index < 2; index++)
+  {
+    const StreamBench* bench = &stream_bench[index];
+    AVCodecContext* codec_ctx = codec_ctxs[index];
+    if(codec_ctx == NULL)
+    {
+      continue;
+    }
+
+    fprintf(fp, "%s    {\"type\":", first ? "" : ",\n");
+    json_write_string(fp, av_get_media_type_string(codec_ctx->codec_type));
+    fprintf(fp, ",\"codec\":");
+    json_write_string(fp, codec_ctx->codec->name);
+    fprintf(fp, ",\"threads\":%d,\"thread_type\":", codec_ctx->thread_count);
+    json_write_string(fp, thread_type_name(codec_ctx->active_thread_type));
+    fprintf(fp, ",\"frames\":%" PRId64 ",\"fps\":%.3f,\"megapixels_per_sec\":%.3f,"
+      "\"samples_per_sec\":%.1f,\"busy\":%.6f,\n",
+      bench->frames, per_second(bench->frames, elapsed), per_second(bench->pixels, elapsed) / 1000000.0,
+      per_second(bench->samples, elapsed), bench->busy / 1000000000.0);
+    fprintf(fp, "     \"send_packet\":");
+    latency_hist_write_json(fp, &bench->send_hist);
+    fprintf(fp, ",\n     \"receive_frame\":");
+    latency_hist_write_json(fp, &bench->receive_hist);
+    fprintf(fp, "}");
+    first = 0;
+  } // for
+
+  fprintf(fp, "\n  ]}\n");
+  fclose(fp);
+
+  printf("Benchmark results written to %s\n", path);
+
   return 0;
 }
 
-int main(int argc, char* argv[])
+static void* decode_worker(void* arg)
 {
+  DecodeWorker* worker = (DecodeWorker*)arg;
+  AVFrame* frame = av_frame_alloc();
+  AVPacket* pkt;
   int ret;
 
-  av_log_set_level(AV_LOG_DEBUG);
+  if(frame == NULL)
+  {
+    spsc_queue_abort(worker->queue);
+    return NULL;
+  }
 
-  if(argc < 2)
+  while((pkt = (AVPacket*)spsc_queue_pop(worker->queue)) != NULL)
   {
-    printf("usage : %s <input>\n", argv[0]);
-    return 0;
+    ret = decode_packet(worker->codec_ctx, pkt, frame);
+    if(ret > 0)
+    {
+      worker->frames += ret;
+    }
+    demux_thread_release_packet(worker->demux, &pkt);
+  } // while
+
+  // flush the decoder
+  ret = decode_packet(worker->codec_ctx, NULL, frame);
+  if(ret > 0)
+  {
+    worker->frames += ret;
   }
 
-  if(open_input(argv[1]) < 0)
+  av_frame_free(&frame);
+  return NULL;
+}
+
+// Packets are read on a demux thread; video and audio decode in parallel.
+static int run_threaded_decode()
+{
+  int indexes[2] = { inputFile.v_index, inputFile.a_index };
+  AVCodecContext* codec_ctxs[2] = { inputFile.v_codec_ctx, inputFile.a_codec_ctx };
+  DecodeWorker workers[2];
+  pthread_t threads[2];
+  int started[2] = { 0, 0 };
+  DemuxThread demux;
+  int index;
+
+  if(demux_thread_start(&demux, inputFile.fmt_ctx, indexes, 2, demux_queue_size) < 0)
   {
-    goto main_end;
+    printf("Failed to start demux thread\n");
+    return -1;
   }
 
-  // AVFrame is used to store raw frame, which is decoded from packet.
-  AVFrame* decoded_frame = av_frame_alloc();
-  if(decoded_frame == NULL) goto main_end;
-  
+  for(index = 0; index < 2; index++)
+  {
+    workers[index].demux = &demux;
+    workers[index].queue = demux_thread_queue(&demux, indexes[index]);
+    workers[index].codec_ctx = codec_ctxs[index];
+    workers[index].frames = 0;
+    if(workers[index].queue == NULL || workers[index].codec_ctx == NULL)
+    {
+      continue;
+    }
+
+    if(pthread_create(&threads[index], NULL, decode_worker, &workers[index]) != 0)
+    {
+      printf("Failed to start decoder thread\n");
+      spsc_queue_abort(workers[index].queue);
+      continue;
+    }
+    started[index] = 1;
+  } // for
+
+  for(index = 0; index < 2; index++)
+  {
+    if(started[index])
+    {
+      pthread_join(threads[index], NULL);
+    }
+  }
+
+  demux_thread_join(&demux);
+
+  printf("End of frame\n");
+  printf("Video frames : %" PRId64 " / Audio frames : %" PRId64 "\n",
+    workers[0].frames, workers[1].frames);
+  demux_thread_print_stats(&demux);
+
+  demux_thread_free(&demux);
+
+  return 0;
+}
+
+// Packets are read and decoded one by one on the main thread.
+static int run_decode()
+{
+  AVFrame* decoded_frame;
   AVPacket pkt;
+  int ret;
+
+  // AVFrame is used to store raw frame, which is decoded from packet.
+  decoded_frame = av_frame_alloc();
+  if(decoded_frame == NULL)
+  {
+    return -1;
+  }
 
   while(1)
   {
@@ -174,29 +603,11 @@ int main(int argc, char* argv[])
 
     if(pkt.stream_index == inputFile.v_index)
     {
-      ret = decode_packet(inputFile.v_codec_ctx, &pkt, decoded_frame);
-      if (ret >= 0)
-      {
-        printf("-----------------------\n");
-        printf("Video : frame->width, height : %dx%d\n",
-          decoded_frame->width, decoded_frame->height);
-        printf("Video : frame->sample_aspect_ratio : %d/%d\n",
-          decoded_frame->sample_aspect_ratio.num, decoded_frame->sample_aspect_ratio.den);
-        av_frame_unref(decoded_frame);
-      }
+      decode_packet(inputFile.v_codec_ctx, &pkt, decoded_frame);
     }
     else if(pkt.stream_index == inputFile.a_index)
     {
-      ret = decode_packet(inputFile.a_codec_ctx, &pkt, decoded_frame);
-      if (ret >= 0)
-      {
-        printf("-----------------------\n");
-        printf("Audio : frame->nb_samples : %d\n",
-          decoded_frame->nb_samples);
-        printf("Audio : frame->channels : %d\n",
-          decoded_frame->channels);
-        av_frame_unref(decoded_frame);
-      }
+      decode_packet(inputFile.a_codec_ctx, &pkt, decoded_frame);
     }
 
     av_packet_unref(&pkt);
@@ -214,8 +625,393 @@ int main(int argc, char* argv[])
 
   av_frame_free(&decoded_frame);
 
+  return 0;
+}
+
+// Seeks to the first keyframe of the video stream at or after target, in
+// stream time_base, through the .kidx index of sample02 when there is one.
+static int seek_keyframe(const SeekIndex* index, int64_t target)
+{
+  SeekIndexEntry entry;
+
+  if(index != NULL)
+  {
+    if(seek_index_lookup_next(index, inputFile.v_index, target, &entry) < 0)
+    {
+      return AVERROR_EOF;
+    }
+
+    return seek_index_seek(inputFile.fmt_ctx, index, inputFile.v_index, entry.pts, &entry);
+  }
+
+  return avformat_seek_file(inputFile.fmt_ctx, inputFile.v_index, target, target, INT64_MAX, 0);
+}
+
+// Reads up to the next video keyframe with a timestamp of at least target.
+// Everything else that gets through the demuxer is dropped here.
+static int read_keyframe(AVPacket* pkt, int64_t target, int64_t* packets)
+{
+  int64_t ts;
+  int ret;
+
+  while((ret = av_read_frame(inputFile.fmt_ctx, pkt)) >= 0)
+  {
+    (*packets)++;
+    ts = (pkt->pts != AV_NOPTS_VALUE) ? pkt->pts : pkt->dts;
+    if(pkt->stream_index == inputFile.v_index && (pkt->flags & AV_PKT_FLAG_KEY) &&
+      (ts == AV_NOPTS_VALUE || ts >= target))
+    {
+      return 0;
+    }
+
+    av_packet_unref(pkt);
+  } // while
+
+  return ret;
+}
+
+// Decodes only video keyframes, one every interval seconds, or all of them
+// with an interval of 0. The decoder skips non-key frames, the demuxer is
+// told to discard them, and the file is seeked from keyframe to keyframe so
+// that the bytes in between are not read at all. Inputs that can't seek are
+// read through, keeping only the keyframes that are due.
+static int run_keyframe_decode(const char* filename, double interval)
+{
+  AVFormatContext* fmt_ctx = inputFile.fmt_ctx;
+  AVStream* stream;
+  AVFrame* frame;
+  AVPacket pkt;
+  SeekIndex* index = NULL;
+  char index_path[4096];
+  int64_t interval_ts, target, ts;
+  int64_t keyframes = 0, frames = 0, packets = 0, seeks = 0;
+  int seeking;
+  unsigned int stream_index;
+  int ret;
+
+  if(inputFile.v_codec_ctx == NULL)
+  {
+    printf("Keyframe mode needs a video stream\n");
+    return -1;
+  }
+
+  stream = fmt_ctx->streams[inputFile.v_index];
+  for(stream_index = 0; stream_index < fmt_ctx->nb_streams; stream_index++)
+  {
+    fmt_ctx->streams[stream_index]->discard = AVDISCARD_ALL;
+  }
+  stream->discard = AVDISCARD_NONKEY;
+  inputFile.v_codec_ctx->skip_frame = AVDISCARD_NONKEY;
+
+  frame = av_frame_alloc();
+  if(frame == NULL)
+  {
+    return -2;
+  }
+
+  // An interval under one tick of the time base is every keyframe; seeking
+  // would land on the same one over and over.
+  interval_ts = (int64_t)(interval / av_q2d(stream->time_base));
+  seeking = (interval_ts > 0);
+  target = (stream->start_time != AV_NOPTS_VALUE) ? stream->start_time : 0;
+
+  if(seeking)
+  {
+    seek_index_path(filename, index_path, sizeof(index_path));
+    index = seek_index_open(index_path, filename);
+    if(index != NULL && seek_index_entries(index, inputFile.v_index) <= 0)
+    {
+      seek_index_close(&index);
+    }
+    printf("Keyframe mode : one frame every %.3f sec, seeking %s\n", interval,
+      index != NULL ? "through the .kidx index" : "by timestamp");
+  }
+
+  while(1)
+  {
+    if(seeking)
+    {
+      ret = seek_keyframe(index, target);
+      if(ret < 0 && seeks == 0 && ret != AVERROR_EOF)
+      {
+        printf("Input can't seek, reading through it\n");
+        seeking = 0;
+      }
+      else if(ret < 0)
+      {
+        break;
+      }
+      else
+      {
+        seeks++;
+      }
+    }
+
+    if(read_keyframe(&pkt, target, &packets) < 0)
+    {
+      break;
+    }
+
+    ts = (pkt.pts != AV_NOPTS_VALUE) ? pkt.pts : pkt.dts;
+    keyframes++;
+    ret = decode_packet(inputFile.v_codec_ctx, &pkt, frame);
+    av_packet_unref(&pkt);
+    if(ret < 0)
+    {
+      break;
+    }
+    frames += ret;
+
+    if(interval_ts > 0)
+    {
+      // Each keyframe stands alone, so the frame threads are drained right
+      // away rather than holding frames back until the next seek.
+      ret = decode_packet(inputFile.v_codec_ctx, NULL, frame);
+      if(ret > 0)
+      {
+        frames += ret;
+      }
+      avcodec_flush_buffers(inputFile.v_codec_ctx);
+
+      target = ((ts != AV_NOPTS_VALUE) ? ts : target) + interval_ts;
+    }
+  } // while
+
+  // flush the decoder
+  ret = decode_packet(inputFile.v_codec_ctx, NULL, frame);
+  if(ret > 0)
+  {
+    frames += ret;
+  }
+
+  printf("End of frame\n");
+  printf("Keyframes : %" PRId64 " decoded into %" PRId64 " frames, %" PRId64 " packets read, %" PRId64 " seeks\n",
+    keyframes, frames, packets, seeks);
+  if(fmt_ctx->pb != NULL)
+  {
+    printf("Read %.1f MiB of %.1f MiB\n",
+      fmt_ctx->pb->bytes_read / 1048576.0, avio_size(fmt_ctx->pb) / 1048576.0);
+  }
+
+  seek_index_close(&index);
+  av_frame_free(&frame);
+
+  return 0;
+}
+
+static int deliver_gop_frame(void* opaque, AVFrame* frame)
+{
+  if(hash_file != NULL)
+  {
+    hash_frame(inputFile.v_codec_ctx, frame);
+  }
+
+  if(bench_mode)
+  {
+    count_frame(&stream_bench[0], frame);
+  }
+  else if(hash_file == NULL)
+  {
+    print_frame(inputFile.v_codec_ctx, frame);
+  }
+
+  return 0;
+}
+
+// Splits the video at closed GOPs and decodes the ranges in parallel, each
+// with its own AVFormatContext and AVCodecContext. Frames still come out in
+// presentation order. Audio is not decoded.
+static int run_gop_decode(const char* filename, int nb_workers)
+{
+  GopDecodeStats stats;
+  int ret;
+
+  if(inputFile.v_codec_ctx == NULL)
+  {
+    printf("GOP split mode needs a video stream\n");
+    return -1;
+  }
+
+  ret = gop_decode_file(filename, &input_opts, &decode_opts, nb_workers,
+    deliver_gop_frame, NULL, &stats);
+  if(ret < 0)
+  {
+    printf("Error occurred while decoding\n");
+  }
+
+  printf("End of frame\n");
+  gop_decode_print_stats(&stats);
+
+  return ret;
+}
+
+int main(int argc, char* argv[])
+{
+  const char* bench_json = NULL;
+  const char* hash_path = NULL;
+  const char* hash_impl = "auto";
+  int64_t start_time, elapsed;
+  int threaded = 0;
+  int opt;
+
+  av_log_set_level(AV_LOG_DEBUG);
+
+  init_input_options(&input_opts);
+  init_decode_options(&decode_opts);
+  while((opt = getopt(argc, argv, "fmatT:Y:P:bo:k:g:H:I:")) != -1)
+  {
+    switch(opt)
+    {
+    case 'f':
+      input_opts.fast_probe = 1;
+      break;
+    case 'm':
+      input_opts.io_mode = INPUT_IO_MMAP;
+      break;
+    case 'a':
+      input_opts.io_mode = INPUT_IO_READAHEAD;
+      break;
+    case 't':
+      threaded = 1;
+      break;
+    case 'T':
+      decode_opts.thread_count = atoi(optarg);
+      break;
+    case 'Y':
+      if(parse_thread_type(optarg, &decode_opts.thread_type) < 0)
+      {
+        optind = argc + 1;
+      }
+      break;
+    case 'P':
+      frame_pool_mb = atoi(optarg);
+      break;
+    case 'b':
+      bench_mode = 1;
+      break;
+    case 'o':
+      bench_mode = 1;
+      bench_json = optarg;
+      break;
+    case 'k':
+      keyframe_interval = atof(optarg);
+      break;
+    case 'g':
+      gop_workers = atoi(optarg);
+      break;
+    case 'H':
+      hash_path = optarg;
+      break;
+    case 'I':
+      hash_impl = optarg;
+      break;
+    default:
+      optind = argc + 1;
+      break;
+    }
+  } // while
+
+  if(argc - optind < 1)
+  {
+    printf("usage : %s [-f] [-m | -a] [-t] [-T threads] [-Y frame|slice|auto] [-P pool_mb] [-b] [-o bench.json] [-k seconds] [-g workers] [-H hashes.txt | -] [-I auto|avx2|sse2|scalar] <input>\n", argv[0]);
+    printf("        -b times every decoder call instead of printing frames, -o also writes the results as JSON\n");
+    printf("        -k decodes one keyframe every given seconds, or every keyframe with 0\n");
+    printf("        -g decodes the video split at closed GOPs over that many decoders\n");
+    printf("        -H writes a hash of every frame instead of printing it, -I picks the hash code\n");
+    return 0;
+  }
+
+  if(bench_mode)
+  {
+    // Decoder debug output would be timed along with the decoding.
+    av_log_set_level(AV_LOG_ERROR);
+    memset(stream_bench, 0, sizeof(stream_bench));
+  }
+
+  if(hash_path != NULL)
+  {
+    if(frame_hash_select(hash_impl) < 0)
+    {
+      return -1;
+    }
+
+    // The debug output would end up between the hash lines on stdout.
+    av_log_set_level(AV_LOG_ERROR);
+    memset(stream_hash, 0, sizeof(stream_hash));
+  }
+
+  if(frame_pool_mb > 0)
+  {
+    if(frame_pool_init(&frame_pool, (int64_t)frame_pool_mb * 1024 * 1024) < 0)
+    {
+      return -1;
+    }
+    decode_opts.frame_pool = &frame_pool;
+  }
+
+  if(open_input(argv[optind]) < 0)
+  {
+    goto main_end;
+  }
+
+  if(hash_path != NULL)
+  {
+    hash_file = (strcmp(hash_path, "-") == 0) ? stdout : fopen(hash_path, "w");
+    if(hash_file == NULL)
+    {
+      printf("Could not create %s\n", hash_path);
+      goto main_end;
+    }
+    write_hash_header();
+  }
+
+  start_time = latency_now();
+  if(keyframe_interval >= 0)
+  {
+    run_keyframe_decode(argv[optind], keyframe_interval);
+  }
+  else if(gop_workers > 0)
+  {
+    run_gop_decode(argv[optind], gop_workers);
+  }
+  else if(threaded)
+  {
+    run_threaded_decode();
+  }
+  else
+  {
+    run_decode();
+  }
+
+  elapsed = latency_now() - start_time;
+  if(hash_file != NULL)
+  {
+    print_hash_report(elapsed);
+    if(hash_file != stdout)
+    {
+      fclose(hash_file);
+    }
+    hash_file = NULL;
+  }
+
+  if(bench_mode)
+  {
+    print_bench_report(elapsed);
+    if(bench_json != NULL)
+    {
+      write_bench_json(bench_json, argv[optind], threaded, elapsed);
+    }
+  }
+
 main_end:
   release();
 
+  // After the decoders, which may hold on to pooled frames.
+  if(decode_opts.frame_pool != NULL)
+  {
+    frame_pool_print_stats(&frame_pool);
+    frame_pool_uninit(&frame_pool);
+  }
+
   return 0;
 }
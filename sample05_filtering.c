@@ -3,6 +3,11 @@
 #include <libavutil/common.h>
 #include <libavutil/avutil.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "decode_options.h"
+#include "media_input.h"
 
 #include <libavfilter/avfilter.h>
 #include <libavfilter/buffersink.h>
@@ -25,6 +30,11 @@ typedef struct _FilterContext
 } FilterContext;
 
 static FileContext inputFile;
+static InputOptions input_opts;
+static DecodeOptions decode_opts;
+// Decoded frames come from frame_pool when -P gives it a size in MiB.
+static FramePool frame_pool;
+static int frame_pool_mb = 0;
 static FilterContext vfilter_ctx, afilter_ctx;
 
 static const int dst_width = 480;
@@ -56,6 +66,8 @@ static int open_decoder(AVCodecContext **codec_ctx, AVStream* stream)
     (*codec_ctx)->framerate = av_guess_frame_rate(inputFile.fmt_ctx, stream, NULL);
   }
 
+  apply_decode_options(*codec_ctx, &decode_opts);
+
   if(avcodec_open2(*codec_ctx, decoder, NULL) < 0)
   {
     return -4;
@@ -66,23 +78,27 @@ static int open_decoder(AVCodecContext **codec_ctx, AVStream* stream)
 
 static int open_input(const char* filename)
 {
+  ProbeStats probe_stats;
   unsigned int index;
+  int ret;
   inputFile.fmt_ctx = NULL;
   inputFile.a_codec_ctx = inputFile.v_codec_ctx = NULL;
   inputFile.a_index = inputFile.v_index = -1;
 
-  if(avformat_open_input(&inputFile.fmt_ctx, filename, NULL, NULL) < 0)
+  ret = open_media_input(&inputFile.fmt_ctx, filename, &input_opts, &probe_stats);
+  if(ret == -1)
   {
     printf("Could not open input file %s\n", filename);
     return -1;
   }
-
-  if(avformat_find_stream_info(inputFile.fmt_ctx, NULL) < 0)
+  else if(ret < 0)
   {
     printf("Failed to retrieve input stream information\n");
     return -2;
   }
 
+  print_probe_stats(&probe_stats);
+
   for(index = 0; index < inputFile.fmt_ctx->nb_streams; index++)
   {
     AVStream* stream = inputFile.fmt_ctx->streams[index];
@@ -339,7 +355,8 @@ static void release()
 
   if(inputFile.fmt_ctx != NULL)
   {
-    avformat_close_input(&inputFile.fmt_ctx);
+    print_input_io_stats(inputFile.fmt_ctx);
+    close_media_input(&inputFile.fmt_ctx);
   }
 
   if(afilter_ctx.filter_graph != NULL)
@@ -353,37 +370,158 @@ static void release()
   }
 }
 
-static int decode_packet(AVCodecContext* codec_ctx, AVPacket* pkt, AVFrame* frame)
+// Puts a decoded frame into the filter graph of its stream and prints what
+// comes out.
+static int filter_frame(int stream_index, AVFrame* decoded_frame, AVFrame* filtered_frame)
 {
-  int ret;
+  FilterContext* filter_ctx;
+
+  if(stream_index == inputFile.v_index)
+  {
+    filter_ctx = &vfilter_ctx;
+    printf("[before] Video : resolution : %dx%d\n"
+      , decoded_frame->width, decoded_frame->height);
+  }
+  else
+  {
+    filter_ctx = &afilter_ctx;
+    printf("[before] Audio : sample_rate : %d / channels : %d\n"
+      , decoded_frame->sample_rate, decoded_frame->channels);
+  }
 
-  if(avcodec_send_packet(codec_ctx, pkt) < 0)
+  // put frame into filter.
+  if(av_buffersrc_add_frame(filter_ctx->src_ctx, decoded_frame) < 0)
   {
+    printf("Error occurred when putting frame into filter context\n");
     return -1;
   }
 
-  ret = avcodec_receive_frame(codec_ctx, frame);
+  while(1)
+  {
+    // Get frame from filter, if it returns < 0 then filter is currently empty.
+    if(av_buffersink_get_frame(filter_ctx->sink_ctx, filtered_frame) < 0)
+    {
+      break;
+    }
+
+    if(stream_index == inputFile.v_index)
+    {
+      printf("[after] Video : resolution : %dx%d\n"
+        , filtered_frame->width, filtered_frame->height);
+    }
+    else
+    {
+      printf("[after] Audio : sample_rate : %d / channels : %d\n"
+        , filtered_frame->sample_rate, filtered_frame->channels);
+    }
+
+    av_frame_unref(filtered_frame);
+  } // while
+
+  return 0;
+}
+
+// Submits pkt, or NULL to flush at the end of the stream, and filters every
+// frame the decoder has ready, until it asks for more input. Corrupt data is
+// skipped; only decoder and filter failures are returned.
+static int decode_packet(AVCodecContext* codec_ctx, int stream_index, AVPacket* pkt,
+                         AVFrame* decoded_frame, AVFrame* filtered_frame)
+{
+  int ret;
+
+  ret = avcodec_send_packet(codec_ctx, pkt);
   if(ret < 0)
   {
-    return ret;
+    if(ret != AVERROR_EOF)
+    {
+      printf("Failed to decode %s packet, skipped\n", av_get_media_type_string(codec_ctx->codec_type));
+    }
+    return 0;
   }
 
-  return 0;
+  while(1)
+  {
+    ret = avcodec_receive_frame(codec_ctx, decoded_frame);
+    if(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+    {
+      return 0;
+    }
+    else if(ret == AVERROR_INVALIDDATA)
+    {
+      printf("Failed to decode %s frame, skipped\n", av_get_media_type_string(codec_ctx->codec_type));
+      return 0;
+    }
+    else if(ret < 0)
+    {
+      return ret;
+    }
+
+    ret = filter_frame(stream_index, decoded_frame, filtered_frame);
+    av_frame_unref(decoded_frame);
+    if(ret < 0)
+    {
+      return ret;
+    }
+  } // while
 }
 
 int main(int argc, char* argv[])
 {
-  int ret;
+  int ret, opt;
 
   av_log_set_level(AV_LOG_DEBUG);
 
-  if(argc < 2)
+  init_input_options(&input_opts);
+  // The filter graphs are built from the decoder formats before any frame.
+  input_opts.need_formats = 1;
+  init_decode_options(&decode_opts);
+  while((opt = getopt(argc, argv, "fmaT:Y:P:")) != -1)
   {
-    printf("usage : %s <input>\n", argv[0]);
+    switch(opt)
+    {
+    case 'f':
+      input_opts.fast_probe = 1;
+      break;
+    case 'm':
+      input_opts.io_mode = INPUT_IO_MMAP;
+      break;
+    case 'a':
+      input_opts.io_mode = INPUT_IO_READAHEAD;
+      break;
+    case 'T':
+      decode_opts.thread_count = atoi(optarg);
+      break;
+    case 'Y':
+      if(parse_thread_type(optarg, &decode_opts.thread_type) < 0)
+      {
+        optind = argc + 1;
+      }
+      break;
+    case 'P':
+      frame_pool_mb = atoi(optarg);
+      break;
+    default:
+      optind = argc + 1;
+      break;
+    }
+  } // while
+
+  if(argc - optind < 1)
+  {
+    printf("usage : %s [-f] [-m | -a] [-T threads] [-Y frame|slice|auto] [-P pool_mb] <input>\n", argv[0]);
     return 0;
   }
 
-  if(open_input(argv[1]) < 0)
+  if(frame_pool_mb > 0)
+  {
+    if(frame_pool_init(&frame_pool, (int64_t)frame_pool_mb * 1024 * 1024) < 0)
+    {
+      return -1;
+    }
+    decode_opts.frame_pool = &frame_pool;
+  }
+
+  if(open_input(argv[optind]) < 0)
   {
     goto main_end;
   }
@@ -434,55 +572,18 @@ int main(int argc, char* argv[])
     {
       codec_ctx = inputFile.a_codec_ctx;
     }
-
-    ret = decode_packet(codec_ctx, &pkt, decoded_frame);
-    if(ret >= 0)
+    else
     {
-      FilterContext* filter_ctx;
-      
-      if(stream_index == inputFile.v_index)
-      {
-        filter_ctx = &vfilter_ctx;
-        printf("[before] Video : resolution : %dx%d\n"
-          , decoded_frame->width, decoded_frame->height);
-      }
-      else if(stream_index == inputFile.a_index)
-      {
-        filter_ctx = &afilter_ctx;
-        printf("[before] Audio : sample_rate : %d / channels : %d\n"
-          , decoded_frame->sample_rate, decoded_frame->channels);
-      }
-
-      // put frame into filter.
-      if(av_buffersrc_add_frame(filter_ctx->src_ctx, decoded_frame) < 0)
-      {
-        printf("Error occurred when putting frame into filter context\n");
-        break;
-      }
+      av_packet_unref(&pkt);
+      continue;
+    }
 
-      while(1)
-      {
-        // Get frame from filter, if it returns < 0 then filter is currently empty.
-        if(av_buffersink_get_frame(filter_ctx->sink_ctx, filtered_frame) < 0)
-        {
-          break;
-        }
-
-        if(stream_index == inputFile.v_index)
-        {
-          printf("[after] Video : resolution : %dx%d\n"
-            , filtered_frame->width, filtered_frame->height);
-        }
-        else if(stream_index == inputFile.a_index)
-        {
-          printf("[after] Audio : sample_rate : %d / channels : %d\n"
-            , filtered_frame->sample_rate, filtered_frame->channels);
-        }
-
-        av_frame_unref(filtered_frame);
-      } // while
-      av_frame_unref(decoded_frame);
-    } // if
+    ret = decode_packet(codec_ctx, stream_index, &pkt, decoded_frame, filtered_frame);
+    if(ret < 0)
+    {
+      av_packet_unref(&pkt);
+      break;
+    }
 
     av_packet_unref(&pkt);
   } // while
@@ -490,11 +591,11 @@ int main(int argc, char* argv[])
   // flush the decoder
   if(inputFile.v_codec_ctx != NULL)
   {
-    decode_packet(inputFile.v_codec_ctx, NULL, decoded_frame);
+    decode_packet(inputFile.v_codec_ctx, inputFile.v_index, NULL, decoded_frame, filtered_frame);
   }
   if(inputFile.a_codec_ctx != NULL)
   {
-    decode_packet(inputFile.a_codec_ctx, NULL, decoded_frame);
+    decode_packet(inputFile.a_codec_ctx, inputFile.a_index, NULL, decoded_frame, filtered_frame);
   }
 
   av_frame_free(&decoded_frame);
@@ -502,5 +603,13 @@ int main(int argc, char* argv[])
 
 main_end:
   release();
+
+  // After the decoders, which may hold on to pooled frames.
+  if(decode_opts.frame_pool != NULL)
+  {
+    frame_pool_print_stats(&frame_pool);
+    frame_pool_uninit(&frame_pool);
+  }
+
   return 0;
 }
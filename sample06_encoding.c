@@ -3,7 +3,20 @@
 #include <libavutil/common.h>
 #include <libavutil/avutil.h>
 #include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "decode_options.h"
+#include "demux_thread.h"
+#include "faststart.h"
+#include "interleaver.h"
+#include "media_input.h"
+#include "packet_pool.h"
+#include "writebehind_io.h"
 
 #include <libavfilter/avfilter.h>
 #include <libavfilter/buffersink.h>
@@ -25,8 +38,60 @@ typedef struct _FilterContext
   AVFilterContext* sink_ctx;
 } FilterContext;
 
+enum
+{
+  STAGE_DECODE,
+  STAGE_FILTER,
+  STAGE_ENCODE,
+  NB_STAGES
+};
+
+// Times in microseconds. busy is the wall time of the stage minus the time
+// it waited for input (starved) and for room in its output queue (blocked).
+typedef struct _StageStats
+{
+  const char* name;
+  int64_t busy;
+  int64_t starved;
+  int64_t blocked;
+  int64_t items;
+} StageStats;
+
+// decode, filter and encode threads of one stream. packets belongs to the
+// demux thread, the other queues carry AVFrame and AVPacket pointers.
+typedef struct _StreamPipeline
+{
+  int active;
+  int in_index;
+  int out_index;
+  AVCodecContext* dec_ctx;
+  FilterContext* filter_ctx;
+  AVCodecContext* enc_ctx;
+  SpscQueue* packets;
+  SpscQueue decoded;
+  SpscQueue filtered;
+  SpscQueue encoded;
+  pthread_t threads[NB_STAGES];
+  int started[NB_STAGES];
+  StageStats stats[NB_STAGES];
+} StreamPipeline;
+
 static FileContext inputFile, outputFile;
+static InputOptions input_opts;
+static DecodeOptions decode_opts;
+// Decoded frames come from frame_pool when -P gives it a size in MiB.
+static FramePool frame_pool;
+static int frame_pool_mb = 0;
+static PacketPool packet_pool;
+static Interleaver interleaver;
 static FilterContext vfilter_ctx, afilter_ctx;
+static DemuxThread demux;
+static StreamPipeline pipelines[2];
+static StageStats mux_stats;
+static atomic_int pipeline_failed;
+// The mux stage sleeps on mux_cond while both encoded queues are empty.
+static pthread_mutex_t mux_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mux_cond = PTHREAD_COND_INITIALIZER;
 
 static const int dst_width = 480;
 static const int dst_height = 320;
@@ -34,6 +99,24 @@ static const int dst_vbit_rate = 1500000;
 static const int dst_abit_rate = 128000;
 static const int64_t dst_ch_layout = AV_CH_LAYOUT_STEREO;
 static const int dst_sample_rate = 32000;
+// Memory budget of the interleaving queue.
+static const int64_t mux_budget = 16 * 1024 * 1024;
+// Queue sizes between the stages. Decoded frames are large, so only a few
+// are buffered; compressed packets are cheap.
+static const uint32_t demux_queue_size = 256;
+static const uint32_t frame_queue_size = 8;
+static const uint32_t packet_queue_size = 64;
+
+// Write the output through writebehind_io, with these WRITEBEHIND_IO_* flags.
+static int write_behind = 0;
+static int write_flags = 0;
+static const int writebehind_blocks = 2;
+static const int writebehind_block_size = 4 * 1024 * 1024;
+
+// Put the MP4 index in front, see faststart.h. Indexes near this size, and
+// video whose frame count can't be trusted, make the output fragmented.
+static int faststart = 0;
+static const int64_t max_moov_size = 32 * 1024 * 1024;
 
 static int open_decoder(AVCodecContext **codec_ctx, AVStream* stream)
 {
@@ -59,6 +142,8 @@ static int open_decoder(AVCodecContext **codec_ctx, AVStream* stream)
     (*codec_ctx)->framerate = av_guess_frame_rate(inputFile.fmt_ctx, stream, NULL);
   }
 
+  apply_decode_options(*codec_ctx, &decode_opts);
+
   if(avcodec_open2(*codec_ctx, decoder, NULL) < 0)
   {
     return -4;
@@ -69,23 +154,27 @@ static int open_decoder(AVCodecContext **codec_ctx, AVStream* stream)
 
 static int open_input(const char* filename)
 {
+  ProbeStats probe_stats;
   unsigned int index;
+  int ret;
   inputFile.fmt_ctx = NULL;
   inputFile.a_codec_ctx = inputFile.v_codec_ctx = NULL;
   inputFile.a_index = inputFile.v_index = -1;
 
-  if(avformat_open_input(&inputFile.fmt_ctx, filename, NULL, NULL) < 0)
+  ret = open_media_input(&inputFile.fmt_ctx, filename, &input_opts, &probe_stats);
+  if(ret == -1)
   {
     printf("Could not open input file %s\n", filename);
     return -1;
   }
-
-  if(avformat_find_stream_info(inputFile.fmt_ctx, NULL) < 0)
+  else if(ret < 0)
   {
     printf("Failed to retrieve input stream information\n");
     return -2;
   }
 
+  print_probe_stats(&probe_stats);
+
   for(index = 0; index < inputFile.fmt_ctx->nb_streams; index++)
   {
     AVStream* stream = inputFile.fmt_ctx->streams[index];
@@ -120,8 +209,11 @@ static int open_input(const char* filename)
 
 static int create_output(const char* filename)
 {
+  AVDictionary* muxer_opts = NULL;
+  int64_t nb_samples[2];
   unsigned int index;
   int out_index;
+  int ret;
 
   outputFile.fmt_ctx = NULL;
   outputFile.a_codec_ctx = outputFile.v_codec_ctx = NULL;
@@ -205,6 +297,9 @@ static int create_output(const char* filename)
       out_codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
     }
 
+    // Encoded payloads are taken from recycled buffers instead of malloc().
+    packet_pool_attach_encoder(&packet_pool, out_codec_ctx);
+
     if(avcodec_open2(out_codec_ctx, encoder, NULL) < 0)
     {
       printf("Failed to open encoder\n");
@@ -222,14 +317,50 @@ static int create_output(const char* filename)
 
   if(!(outputFile.fmt_ctx->oformat->flags & AVFMT_NOFILE))
   {
-    if(avio_open(&outputFile.fmt_ctx->pb, filename, AVIO_FLAG_WRITE) < 0)
+    if(write_behind)
+    {
+      ret = writebehind_io_open(&outputFile.fmt_ctx->pb, filename,
+        writebehind_blocks, writebehind_block_size, write_flags);
+    }
+    else
+    {
+      ret = avio_open(&outputFile.fmt_ctx->pb, filename, AVIO_FLAG_WRITE);
+    }
+
+    if(ret < 0)
     {
       printf("Failed to create output file %s\n", filename);
       return -4;
     }
   }
 
-  if(avformat_write_header(outputFile.fmt_ctx, NULL) < 0)
+  if(faststart)
+  {
+    // The filters keep the frame rate, the audio is counted in encoder frames.
+    AVRational frame_rate = (inputFile.v_index >= 0) ?
+      inputFile.fmt_ctx->streams[inputFile.v_index]->avg_frame_rate : (AVRational){ 0, 1 };
+
+    for(index = 0; index < outputFile.fmt_ctx->nb_streams; index++)
+    {
+      nb_samples[index] = faststart_guess_samples(outputFile.fmt_ctx->streams[index]->codecpar,
+        frame_rate, inputFile.fmt_ctx->duration);
+    }
+
+    // A short guess would leave a file without index, so video that can't
+    // be counted goes fragmented instead.
+    if(inputFile.v_index >= 0 && outputFile.v_index >= 0)
+    {
+      nb_samples[outputFile.v_index] = faststart_video_samples(
+        inputFile.fmt_ctx->streams[inputFile.v_index], nb_samples[outputFile.v_index]);
+    }
+
+    ret = faststart_set_options(&muxer_opts, outputFile.fmt_ctx, nb_samples, max_moov_size);
+    printf("faststart : %s layout\n", faststart_layout_name(ret));
+  }
+
+  ret = avformat_write_header(outputFile.fmt_ctx, &muxer_opts);
+  av_dict_free(&muxer_opts);
+  if(ret < 0)
   {
     printf("Failed writing header into output file\n");
     return -5;  
@@ -346,6 +477,8 @@ static int init_video_filter()
 
   avfilter_inout_free(&inputs);
   avfilter_inout_free(&outputs);
+
+  return 0;
 }
 
 static int init_audio_filter()
@@ -441,6 +574,8 @@ static int init_audio_filter()
 
   avfilter_inout_free(&inputs);
   avfilter_inout_free(&outputs);
+
+  return 0;
 }
 
 static void release()
@@ -457,7 +592,8 @@ static void release()
 
   if(inputFile.fmt_ctx != NULL)
   {
-    avformat_close_input(&inputFile.fmt_ctx);
+    print_input_io_stats(inputFile.fmt_ctx);
+    close_media_input(&inputFile.fmt_ctx);
   }
 
   if(outputFile.v_codec_ctx != NULL)
@@ -474,7 +610,22 @@ static void release()
   {
     if(!(outputFile.fmt_ctx->oformat->flags & AVFMT_NOFILE))
     {
-      avio_closep(&outputFile.fmt_ctx->pb);
+      if(write_behind)
+      {
+        if(outputFile.fmt_ctx->pb != NULL)
+        {
+          writebehind_io_print_stats(outputFile.fmt_ctx->pb);
+        }
+
+        if(writebehind_io_close(&outputFile.fmt_ctx->pb) < 0)
+        {
+          printf("Failed writing output file\n");
+        }
+      }
+      else
+      {
+        avio_closep(&outputFile.fmt_ctx->pb);
+      }
     }
     avformat_free_context(outputFile.fmt_ctx);
   }
@@ -490,220 +641,673 @@ static void release()
   }
 }
 
-static int decode_packet(AVCodecContext* codec_ctx, AVPacket* pkt, AVFrame* frame)
+// Called after an encoded packet was queued, an encoder finished or the
+// pipeline failed.
+static void wake_mux()
 {
-  int ret;
+  pthread_mutex_lock(&mux_lock);
+  pthread_cond_broadcast(&mux_cond);
+  pthread_mutex_unlock(&mux_lock);
+}
+
+static void fail_pipeline()
+{
+  int index;
 
-  if(avcodec_send_packet(codec_ctx, pkt) < 0)
+  if(atomic_exchange(&pipeline_failed, 1))
   {
-    return -1;
+    return;
   }
 
-  ret = avcodec_receive_frame(codec_ctx, frame);
-  if(ret < 0)
+  // Every stage waiting on a queue gives up.
+  demux_thread_abort(&demux);
+  for(index = 0; index < 2; index++)
   {
-    return ret;
+    spsc_queue_abort(&pipelines[index].decoded);
+    spsc_queue_abort(&pipelines[index].filtered);
+    spsc_queue_abort(&pipelines[index].encoded);
   }
+  wake_mux();
+}
 
-  return 0;
+static void* stage_pop(SpscQueue* queue, StageStats* stats)
+{
+  int64_t start_time = av_gettime_relative();
+  void* item = spsc_queue_pop(queue);
+
+  stats->starved += av_gettime_relative() - start_time;
+  return item;
 }
 
-static int encode_frame(AVCodecContext* codec_ctx, AVFrame* frame, AVPacket *pkt)
+static int stage_push(SpscQueue* queue, void* item, StageStats* stats)
 {
-  int ret;
+  int64_t start_time = av_gettime_relative();
+  int ret = spsc_queue_push(queue, item);
 
-  if(avcodec_send_frame(codec_ctx, frame) < 0)
+  stats->blocked += av_gettime_relative() - start_time;
+  stats->items++;
+  return ret;
+}
+
+// Closes the output queue of a stage, so that the next stage flushes, or
+// stops the whole pipeline if the stage failed.
+static void finish_stage(StageStats* stats, SpscQueue* output, int ret, int64_t start_time)
+{
+  stats->busy = av_gettime_relative() - start_time - stats->starved - stats->blocked;
+
+  if(ret < 0 || atomic_load(&pipeline_failed))
   {
-    return -1;
+    if(ret < 0)
+    {
+      printf("%s stage failed\n", stats->name);
+    }
+    fail_pipeline();
+    return;
   }
 
-  ret = avcodec_receive_packet(codec_ctx, pkt);
+  spsc_queue_close(output);
+}
+
+// Submits pkt, or NULL to flush at the end of the stream, and queues every
+// frame the decoder has ready for the filter stage. Corrupt data is skipped
+// rather than failing the whole transcode.
+static int decode_packet(StreamPipeline* pipeline, AVPacket* pkt, AVFrame* frame)
+{
+  const char* type = av_get_media_type_string(pipeline->dec_ctx->codec_type);
+  AVFrame* decoded_frame;
+  int ret;
+
+  ret = avcodec_send_packet(pipeline->dec_ctx, pkt);
   if(ret < 0)
   {
-    return ret;
+    if(ret != AVERROR_EOF)
+    {
+      printf("Failed to decode %s packet, skipped\n", type);
+    }
+    return 0;
   }
 
-  return 0;
+  while(1)
+  {
+    ret = avcodec_receive_frame(pipeline->dec_ctx, frame);
+    if(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+    {
+      return 0;
+    }
+    else if(ret == AVERROR_INVALIDDATA)
+    {
+      printf("Failed to decode %s frame, skipped\n", type);
+      return 0;
+    }
+    else if(ret < 0)
+    {
+      return ret;
+    }
+
+    decoded_frame = av_frame_alloc();
+    if(decoded_frame == NULL)
+    {
+      av_frame_unref(frame);
+      return -2;
+    }
+    av_frame_move_ref(decoded_frame, frame);
+
+    if(stage_push(&pipeline->decoded, decoded_frame, &pipeline->stats[STAGE_DECODE]) < 0)
+    {
+      av_frame_free(&decoded_frame);
+      return -3;
+    }
+  } // while
 }
 
+static void* decode_stage(void* arg)
+{
+  StreamPipeline* pipeline = (StreamPipeline*)arg;
+  StageStats* stats = &pipeline->stats[STAGE_DECODE];
+  AVStream* in_stream = inputFile.fmt_ctx->streams[pipeline->in_index];
+  int64_t start_time = av_gettime_relative();
+  AVFrame* frame = av_frame_alloc();
+  AVPacket* pkt;
+  int ret = (frame != NULL) ? 0 : -1;
+
+  while(ret >= 0 && (pkt = (AVPacket*)stage_pop(pipeline->packets, stats)) != NULL)
+  {
+    av_packet_rescale_ts(pkt, in_stream->time_base, pipeline->dec_ctx->time_base);
+    ret = decode_packet(pipeline, pkt, frame);
+    demux_thread_release_packet(&demux, &pkt);
+  } // while
+
+  // flush the decoder, unless the input ended because of a failure.
+  if(ret >= 0 && !atomic_load(&pipeline_failed))
+  {
+    ret = decode_packet(pipeline, NULL, frame);
+  }
 
-static int encode_write_frame(AVFrame* frame, int out_stream_index)
+  av_frame_free(&frame);
+  finish_stage(stats, &pipeline->decoded, ret, start_time);
+  return NULL;
+}
+
+// Submits frame, or NULL to flush, and queues what comes out of the filter graph.
+static int filter_frame(StreamPipeline* pipeline, AVFrame* frame)
 {
-  AVStream* stream = outputFile.fmt_ctx->streams[out_stream_index];
-  AVCodecContext* codec_ctx = (out_stream_index == outputFile.v_index) ?
-                    outputFile.v_codec_ctx : outputFile.a_codec_ctx;
-  AVPacket encoded_pkt;
+  AVFrame* filtered_frame;
   int ret;
-  
-  av_init_packet(&encoded_pkt);
-  encoded_pkt.data = NULL;
-  encoded_pkt.size = 0;
 
-  if(frame != NULL) frame->pict_type = AV_PICTURE_TYPE_NONE;
-
-  ret = encode_frame(codec_ctx, frame, &encoded_pkt);
-  if(ret >= 0)
+  if(av_buffersrc_add_frame(pipeline->filter_ctx->src_ctx, frame) < 0)
   {
-    encoded_pkt.stream_index = out_stream_index;
-    av_packet_rescale_ts(&encoded_pkt, codec_ctx->time_base, stream->time_base);
+    printf("Error occurred when putting frame into filter context\n");
+    return -1;
+  }
 
-    if(av_interleaved_write_frame(outputFile.fmt_ctx, &encoded_pkt) < 0)
+  while(1)
+  {
+    filtered_frame = av_frame_alloc();
+    if(filtered_frame == NULL)
     {
-      printf("Error occurred when writing packet into file\n");
       return -2;
     }
 
-    av_packet_unref(&encoded_pkt);
+    ret = av_buffersink_get_frame(pipeline->filter_ctx->sink_ctx, filtered_frame);
+    if(ret < 0)
+    {
+      av_frame_free(&filtered_frame);
+      return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
+    }
+
+    if(stage_push(&pipeline->filtered, filtered_frame, &pipeline->stats[STAGE_FILTER]) < 0)
+    {
+      av_frame_free(&filtered_frame);
+      return -3;
+    }
+  } // while
+}
+
+static void* filter_stage(void* arg)
+{
+  StreamPipeline* pipeline = (StreamPipeline*)arg;
+  StageStats* stats = &pipeline->stats[STAGE_FILTER];
+  int64_t start_time = av_gettime_relative();
+  AVFrame* frame;
+  int ret = 0;
+
+  while(ret >= 0 && (frame = (AVFrame*)stage_pop(&pipeline->decoded, stats)) != NULL)
+  {
+    ret = filter_frame(pipeline, frame);
+    av_frame_free(&frame);
+  } // while
+
+  if(ret >= 0 && !atomic_load(&pipeline_failed))
+  {
+    ret = filter_frame(pipeline, NULL);
   }
 
-  return 0;
+  finish_stage(stats, &pipeline->filtered, ret, start_time);
+  return NULL;
 }
 
-static int filter_encode_write_frame(AVFrame* frame, int out_stream_index)
+// Submits frame, or NULL to flush, and queues every packet the encoder has
+// ready for the muxer, in the time base of the output stream.
+static int encode_frame(StreamPipeline* pipeline, AVFrame* frame)
 {
-  AVStream* out_stream = outputFile.fmt_ctx->streams[out_stream_index];
-  AVCodecContext* out_codec_ctx = (out_stream_index == outputFile.v_index) ?
-                    outputFile.v_codec_ctx : outputFile.a_codec_ctx;
-  FilterContext* filterContext = (out_stream_index == outputFile.v_index) ? 
-                    &vfilter_ctx : &afilter_ctx;
+  AVStream* stream = outputFile.fmt_ctx->streams[pipeline->out_index];
+  AVPacket* encoded_pkt;
+  int ret;
 
-  AVFrame* filtered_frame = av_frame_alloc();
-  if(filtered_frame == NULL)
+  if(frame != NULL)
   {
-    return -1;
+    frame->pict_type = AV_PICTURE_TYPE_NONE;
   }
 
-  if(av_buffersrc_add_frame(filterContext->src_ctx, frame) < 0)
+  if(avcodec_send_frame(pipeline->enc_ctx, frame) < 0)
   {
-    printf("Error occurred when putting frame into filter context\n");
-    return -2;
+    return -1;
   }
 
   while(1)
   {
-    if(av_buffersink_get_frame(filterContext->sink_ctx, filtered_frame) < 0)
+    encoded_pkt = packet_pool_get(&packet_pool);
+    if(encoded_pkt == NULL)
     {
-      break;
+      return -2;
     }
 
-    if(encode_write_frame(filtered_frame, out_stream_index) < 0)
+    ret = avcodec_receive_packet(pipeline->enc_ctx, encoded_pkt);
+    if(ret < 0)
     {
-      break;
+      packet_pool_put(&packet_pool, &encoded_pkt);
+      return (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) ? 0 : ret;
     }
 
-    av_frame_unref(filtered_frame);
-  } // while
+    encoded_pkt->stream_index = pipeline->out_index;
+    av_packet_rescale_ts(encoded_pkt, pipeline->enc_ctx->time_base, stream->time_base);
 
-  av_frame_free(&filtered_frame);
-  return 0;
+    if(stage_push(&pipeline->encoded, encoded_pkt, &pipeline->stats[STAGE_ENCODE]) < 0)
+    {
+      packet_pool_put(&packet_pool, &encoded_pkt);
+      return -3;
+    }
+    wake_mux();
+  } // while
 }
 
-int main(int argc, char* argv[])
+static void* encode_stage(void* arg)
 {
-  int ret;
+  StreamPipeline* pipeline = (StreamPipeline*)arg;
+  StageStats* stats = &pipeline->stats[STAGE_ENCODE];
+  int64_t start_time = av_gettime_relative();
+  AVFrame* frame;
+  int ret = 0;
 
-  av_log_set_level(AV_LOG_DEBUG);
+  while(ret >= 0 && (frame = (AVFrame*)stage_pop(&pipeline->filtered, stats)) != NULL)
+  {
+    ret = encode_frame(pipeline, frame);
+    av_frame_free(&frame);
+  } // while
 
-  if(argc < 3)
+  if(ret >= 0 && !atomic_load(&pipeline_failed))
   {
-    printf("usage : %s <input>\n", argv[0]);
-    return 0;
+    ret = encode_frame(pipeline, NULL);
   }
 
-  if(open_input(argv[1]) < 0 || create_output(argv[2]) < 0)
+  finish_stage(stats, &pipeline->encoded, ret, start_time);
+  wake_mux();
+  return NULL;
+}
+
+// A packet is queued by an encoder, or one finished since the mux stage
+// last looked.
+static int mux_has_work(const int* ended)
+{
+  int index;
+
+  for(index = 0; index < 2; index++)
   {
-    goto main_end;
-  }
+    StreamPipeline* pipeline = &pipelines[index];
+    if(pipeline->active && (spsc_queue_depth(&pipeline->encoded) > 0 ||
+      (!ended[index] && spsc_queue_done(&pipeline->encoded))))
+    {
+      return 1;
+    }
+  } // for
 
-  if(init_video_filter() < 0 || init_audio_filter() < 0)
+  return 0;
+}
+
+// Takes from the queues of both encoders, so that a stream that has nothing
+// to deliver never holds up the other, and sleeps until an encoder wakes it
+// when both are empty. The interleaver puts them in order, and is told when
+// an encoder is done so that it stops waiting for its stream.
+static void* mux_stage(void* arg)
+{
+  StageStats* stats = (StageStats*)arg;
+  int64_t start_time = av_gettime_relative();
+  int64_t idle_start;
+  AVPacket* pkt;
+  int ended[2] = { 0, 0 };
+  int index, got, done;
+  int ret = 0;
+
+  while(ret >= 0 && !atomic_load(&pipeline_failed))
   {
-    goto main_end;
+    got = 0;
+    done = 1;
+    for(index = 0; index < 2; index++)
+    {
+      StreamPipeline* pipeline = &pipelines[index];
+      if(!pipeline->active)
+      {
+        continue;
+      }
+
+      while(ret >= 0 && (pkt = (AVPacket*)spsc_queue_try_pop(&pipeline->encoded)) != NULL)
+      {
+        got = 1;
+        stats->items++;
+        ret = interleaver_write(&interleaver, pkt);
+        packet_pool_put(&packet_pool, &pkt);
+      } // while
+
+      if(ret >= 0 && !ended[index] && spsc_queue_done(&pipeline->encoded))
+      {
+        ended[index] = 1;
+        ret = interleaver_end_stream(&interleaver, pipeline->out_index);
+      }
+      done &= ended[index];
+    } // for
+
+    if(done && !got)
+    {
+      break;
+    }
+
+    if(!got)
+    {
+      idle_start = av_gettime_relative();
+      pthread_mutex_lock(&mux_lock);
+      while(!atomic_load(&pipeline_failed) && !mux_has_work(ended))
+      {
+        pthread_cond_wait(&mux_cond, &mux_lock);
+      } // while
+      pthread_mutex_unlock(&mux_lock);
+      stats->starved += av_gettime_relative() - idle_start;
+    }
+  } // while
+
+  if(ret < 0)
+  {
+    printf("Error occurred when writing packet into file\n");
+  }
+  else if(!atomic_load(&pipeline_failed))
+  {
+    ret = interleaver_flush(&interleaver);
   }
 
-  AVFrame* decoded_frame = av_frame_alloc();
-  if(decoded_frame == NULL)
+  stats->busy = av_gettime_relative() - start_time - stats->starved;
+  if(ret < 0)
   {
-    goto main_end;
+    fail_pipeline();
   }
-  
-  AVPacket pkt;
-  int out_stream_index;
 
-  while(1)
-  { 
-    ret = av_read_frame(inputFile.fmt_ctx, &pkt);
-    if(ret == AVERROR_EOF)
+  return NULL;
+}
+
+static void print_stage_stats(const StageStats* stats)
+{
+  printf("%-14s %10.3f %10.3f %10.3f %10" PRId64 "\n", stats->name,
+    stats->busy / 1000.0, stats->starved / 1000.0, stats->blocked / 1000.0, stats->items);
+}
+
+// The stage that is busy nearly all the time is the bottleneck. The stages
+// before it block on full queues, the stages after it starve.
+static void print_pipeline_stats(int64_t elapsed)
+{
+  StageStats demux_stats = { "demux", demux.read_time, 0, demux.blocked_time, demux.packets };
+  int index, stage;
+
+  printf("------- Pipeline : %.3f ms -------\n", elapsed / 1000.0);
+  printf("%-14s %10s %10s %10s %10s\n", "stage", "busy ms", "starved ms", "blocked ms", "items");
+  print_stage_stats(&demux_stats);
+
+  for(index = 0; index < 2; index++)
+  {
+    if(!pipelines[index].active)
     {
-      printf("End of frame\n");
-      break;
+      continue;
     }
 
-    if(pkt.stream_index != inputFile.v_index && 
-      pkt.stream_index != inputFile.a_index)
+    for(stage = 0; stage < NB_STAGES; stage++)
     {
-      av_packet_unref(&pkt);
-      continue;
+      print_stage_stats(&pipelines[index].stats[stage]);
     }
+  } // for
+
+  print_stage_stats(&mux_stats);
+}
+
+static int init_pipeline(StreamPipeline* pipeline, int in_index, int out_index,
+                          AVCodecContext* dec_ctx, FilterContext* filter_ctx,
+                          AVCodecContext* enc_ctx, const char* const* stage_names)
+{
+  int stage;
 
-    AVStream* in_stream = inputFile.fmt_ctx->streams[pkt.stream_index];
-    AVCodecContext* in_codec_ctx = (pkt.stream_index == inputFile.v_index) ?
-                    inputFile.v_codec_ctx : inputFile.a_codec_ctx;
+  pipeline->in_index = in_index;
+  pipeline->out_index = out_index;
+  pipeline->dec_ctx = dec_ctx;
+  pipeline->filter_ctx = filter_ctx;
+  pipeline->enc_ctx = enc_ctx;
+  pipeline->packets = demux_thread_queue(&demux, in_index);
 
-    out_stream_index = (pkt.stream_index == inputFile.v_index) ? 
-            outputFile.v_index : outputFile.a_index;
+  for(stage = 0; stage < NB_STAGES; stage++)
+  {
+    pipeline->stats[stage].name = stage_names[stage];
+  }
 
-    av_packet_rescale_ts(&pkt, in_stream->time_base, in_codec_ctx->time_base);
-    
-    ret = decode_packet(in_codec_ctx, &pkt, decoded_frame);
-    if(ret >= 0)
+  if(pipeline->packets == NULL ||
+    spsc_queue_init(&pipeline->decoded, frame_queue_size) < 0 ||
+    spsc_queue_init(&pipeline->filtered, frame_queue_size) < 0 ||
+    spsc_queue_init(&pipeline->encoded, packet_queue_size) < 0)
+  {
+    return -1;
+  }
+
+  pipeline->active = 1;
+  return 0;
+}
+
+static void free_pipeline(StreamPipeline* pipeline)
+{
+  AVFrame* frame;
+  AVPacket* pkt;
+
+  // Whatever a failure left behind in the queues.
+  while((frame = (AVFrame*)spsc_queue_try_pop(&pipeline->decoded)) != NULL)
+  {
+    av_frame_free(&frame);
+  }
+  while((frame = (AVFrame*)spsc_queue_try_pop(&pipeline->filtered)) != NULL)
+  {
+    av_frame_free(&frame);
+  }
+  while((pkt = (AVPacket*)spsc_queue_try_pop(&pipeline->encoded)) != NULL)
+  {
+    packet_pool_put(&packet_pool, &pkt);
+  }
+
+  spsc_queue_uninit(&pipeline->decoded);
+  spsc_queue_uninit(&pipeline->filtered);
+  spsc_queue_uninit(&pipeline->encoded);
+}
+
+// demux -> decode -> filter -> encode -> mux, with a thread per stage and
+// stream, and bounded queues in between. A full queue blocks the stage in
+// front of it, which is the backpressure. At the end of the input every
+// stage flushes its codec or filter and closes its output queue.
+static int run_pipeline()
+{
+  static const char* const video_stages[NB_STAGES] = { "video decode", "video filter", "video encode" };
+  static const char* const audio_stages[NB_STAGES] = { "audio decode", "audio filter", "audio encode" };
+  static void* (*const stage_main[NB_STAGES])(void*) = { decode_stage, filter_stage, encode_stage };
+  int indexes[2] = { inputFile.v_index, inputFile.a_index };
+  int64_t start_time = av_gettime_relative();
+  pthread_t mux_thread;
+  int mux_started = 0;
+  int index, stage;
+
+  memset(pipelines, 0, sizeof(pipelines));
+  memset(&mux_stats, 0, sizeof(mux_stats));
+  mux_stats.name = "mux";
+  atomic_store(&pipeline_failed, 0);
+
+  if(demux_thread_start(&demux, inputFile.fmt_ctx, indexes, 2, demux_queue_size) < 0)
+  {
+    printf("Failed to start demux thread\n");
+    return -1;
+  }
+
+  if(init_pipeline(&pipelines[0], inputFile.v_index, outputFile.v_index,
+      inputFile.v_codec_ctx, &vfilter_ctx, outputFile.v_codec_ctx, video_stages) < 0 ||
+    init_pipeline(&pipelines[1], inputFile.a_index, outputFile.a_index,
+      inputFile.a_codec_ctx, &afilter_ctx, outputFile.a_codec_ctx, audio_stages) < 0)
+  {
+    printf("Failed to create pipeline queues\n");
+    fail_pipeline();
+  }
+
+  for(index = 0; index < 2; index++)
+  {
+    for(stage = 0; stage < NB_STAGES && pipelines[index].active; stage++)
     {
-      ret = filter_encode_write_frame(decoded_frame, out_stream_index);
-      av_frame_unref(decoded_frame);
-      if(ret < 0)
+      if(pthread_create(&pipelines[index].threads[stage], NULL,
+          stage_main[stage], &pipelines[index]) != 0)
       {
-        printf("c\n");
-        av_packet_unref(&pkt);
+        printf("Failed to start %s thread\n", pipelines[index].stats[stage].name);
+        fail_pipeline();
         break;
       }
-    } // if
+      pipelines[index].started[stage] = 1;
+    } // for
+  } // for
 
-    av_packet_unref(&pkt);
-  } // while
+  if(pthread_create(&mux_thread, NULL, mux_stage, &mux_stats) == 0)
+  {
+    mux_started = 1;
+  }
+  else
+  {
+    printf("Failed to start mux thread\n");
+    fail_pipeline();
+  }
 
-  // Flush all remaining frames in encoder and filter.
-  int index;
-  for(index = 0; index < inputFile.fmt_ctx->nb_streams; index++)
+  for(index = 0; index < 2; index++)
   {
-    if(pkt.stream_index != inputFile.v_index &&
-      pkt.stream_index != inputFile.a_index)
+    for(stage = 0; stage < NB_STAGES; stage++)
     {
-      continue;
+      if(pipelines[index].started[stage])
+      {
+        pthread_join(pipelines[index].threads[stage], NULL);
+      }
     }
+  } // for
 
-    // Flush filter
-    out_stream_index = (index == inputFile.v_index) ? 
-            outputFile.v_index : outputFile.a_index;
-    ret = filter_encode_write_frame(NULL, out_stream_index);
-    if(ret < 0)
+  if(mux_started)
+  {
+    pthread_join(mux_thread, NULL);
+  }
+  demux_thread_join(&demux);
+
+  print_pipeline_stats(av_gettime_relative() - start_time);
+  demux_thread_print_stats(&demux);
+
+  for(index = 0; index < 2; index++)
+  {
+    free_pipeline(&pipelines[index]);
+  }
+  demux_thread_free(&demux);
+
+  return atomic_load(&pipeline_failed) ? -2 : 0;
+}
+
+int main(int argc, char* argv[])
+{
+  int ret, opt;
+
+  av_log_set_level(AV_LOG_DEBUG);
+
+  init_input_options(&input_opts);
+  // The filter graphs are built from the decoder formats before any frame.
+  input_opts.need_formats = 1;
+  init_decode_options(&decode_opts);
+  while((opt = getopt(argc, argv, "fmawdyDFT:Y:P:")) != -1)
+  {
+    switch(opt)
     {
-      printf("Error occurred while flusing filter context\n");
+    case 'f':
+      input_opts.fast_probe = 1;
+      break;
+    case 'm':
+      input_opts.io_mode = INPUT_IO_MMAP;
+      break;
+    case 'a':
+      input_opts.io_mode = INPUT_IO_READAHEAD;
+      break;
+    case 'w':
+      write_behind = 1;
+      break;
+    case 'd':
+      write_behind = 1;
+      write_flags |= WRITEBEHIND_IO_DIRECT;
+      break;
+    case 'y':
+      write_behind = 1;
+      write_flags |= WRITEBEHIND_IO_SYNC_CLOSE;
+      break;
+    case 'D':
+      write_behind = 1;
+      write_flags |= WRITEBEHIND_IO_SYNC_BLOCKS;
+      break;
+    case 'F':
+      faststart = 1;
+      break;
+    case 'T':
+      decode_opts.thread_count = atoi(optarg);
+      break;
+    case 'Y':
+      if(parse_thread_type(optarg, &decode_opts.thread_type) < 0)
+      {
+        optind = argc + 1;
+      }
+      break;
+    case 'P':
+      frame_pool_mb = atoi(optarg);
+      break;
+    default:
+      optind = argc + 1;
       break;
     }
+  } // while
 
-    // flush encoder
-    ret = encode_write_frame(NULL, out_stream_index);
-    if(ret < 0)
+  if(argc - optind < 2)
+  {
+    printf("usage : %s [-f] [-m | -a] [-w] [-d] [-y] [-D] [-F] [-T threads] [-Y frame|slice|auto] [-P pool_mb] <input> <output>\n", argv[0]);
+    return 0;
+  }
+
+  if(frame_pool_mb > 0)
+  {
+    if(frame_pool_init(&frame_pool, (int64_t)frame_pool_mb * 1024 * 1024) < 0)
     {
-      printf("Error occurred while flusing codec context\n");
-      break;
+      return -1;
     }
+    decode_opts.frame_pool = &frame_pool;
   }
-  
-  // Writing trailer.
-  av_write_trailer(outputFile.fmt_ctx);
-  av_frame_free(&decoded_frame);
+
+  // Enough free packets for the encoded queues of both streams.
+  if(packet_pool_init(&packet_pool, 2 * packet_queue_size) < 0)
+  {
+    return -1;
+  }
+
+  if(open_input(argv[optind]) < 0 || create_output(argv[optind + 1]) < 0)
+  {
+    goto main_end;
+  }
+
+  if(interleaver_init(&interleaver, outputFile.fmt_ctx, mux_budget) < 0)
+  {
+    goto main_end;
+  }
+
+  if(init_video_filter() < 0 || init_audio_filter() < 0)
+  {
+    goto main_end;
+  }
+
+  ret = run_pipeline();
+  if(ret < 0)
+  {
+    printf("Error occurred while transcoding\n");
+  }
+
+  // Writing trailer. With -F this is where moov goes into the reserved room.
+  if(av_write_trailer(outputFile.fmt_ctx) < 0)
+  {
+    printf("Failed writing trailer into output file%s\n",
+      faststart ? ", the index may not have fit the reserved moov room and the file can't be played" : "");
+  }
+  packet_pool_print_stats(&packet_pool);
+  interleaver_print_stats(&interleaver);
 main_end:
   release();
 
+  // After the decoders, which may hold on to pooled frames.
+  if(decode_opts.frame_pool != NULL)
+  {
+    frame_pool_print_stats(&frame_pool);
+    frame_pool_uninit(&frame_pool);
+  }
+  interleaver_uninit(&interleaver);
+  packet_pool_uninit(&packet_pool);
+
   return 0;
 }
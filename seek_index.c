@@ -0,0 +1,441 @@
+#include "seek_index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// File layout, native byte order:
+//   IndexHeader
+//   IndexStream[nb_streams]
+//   SeekIndexEntry[], per stream, sorted by pts
+#define INDEX_MAGIC 0x5844494b // "KIDX"
+#define INDEX_VERSION 1
+
+typedef struct _IndexHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nb_streams;
+  uint32_t reserved;
+  int64_t media_size;
+  int64_t media_mtime;
+} IndexHeader;
+
+typedef struct _IndexStream
+{
+  int32_t stream_index;
+  int32_t time_base_num;
+  int32_t time_base_den;
+  uint32_t nb_entries;
+  uint64_t first_entry;
+} IndexStream;
+
+typedef struct _EntryList
+{
+  SeekIndexEntry* entries;
+  uint32_t count;
+  uint32_t capacity;
+} EntryList;
+
+struct _SeekIndexWriter
+{
+  AVFormatContext* fmt_ctx;
+  unsigned int nb_streams;
+  EntryList* lists;
+};
+
+struct _SeekIndex
+{
+  uint8_t* map;
+  size_t map_size;
+  const IndexHeader* header;
+  const IndexStream* streams;
+  const SeekIndexEntry* entries;
+};
+
+void seek_index_path(const char* media_path, char* buf, size_t buf_size)
+{
+  snprintf(buf, buf_size, "%s.kidx", media_path);
+}
+
+static int stat_media(const char* media_path, int64_t* size, int64_t* mtime)
+{
+  struct stat st;
+
+  if(stat(media_path, &st) < 0)
+  {
+    return -1;
+  }
+
+  *size = st.st_size;
+  *mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  return 0;
+}
+
+SeekIndexWriter* seek_index_writer_alloc(AVFormatContext* fmt_ctx)
+{
+  SeekIndexWriter* writer = calloc(1, sizeof(SeekIndexWriter));
+  if(writer == NULL)
+  {
+    return NULL;
+  }
+
+  writer->fmt_ctx = fmt_ctx;
+  writer->nb_streams = fmt_ctx->nb_streams;
+  writer->lists = calloc(writer->nb_streams, sizeof(EntryList));
+  if(writer->lists == NULL)
+  {
+    free(writer);
+    return NULL;
+  }
+
+  return writer;
+}
+
+int seek_index_writer_add(SeekIndexWriter* writer, const AVPacket* pkt, int64_t packet_no)
+{
+  EntryList* list;
+  SeekIndexEntry* entry;
+
+  if(!(pkt->flags & AV_PKT_FLAG_KEY) || (unsigned int)pkt->stream_index >= writer->nb_streams)
+  {
+    return 0;
+  }
+
+  if(pkt->pts == AV_NOPTS_VALUE && pkt->dts == AV_NOPTS_VALUE)
+  {
+    return 0;
+  }
+
+  list = &writer->lists[pkt->stream_index];
+  if(list->count == list->capacity)
+  {
+    uint32_t capacity = list->capacity ? list->capacity * 2 : 1024;
+    SeekIndexEntry* entries = realloc(list->entries, capacity * sizeof(SeekIndexEntry));
+    if(entries == NULL)
+    {
+      return -1;
+    }
+
+    list->entries = entries;
+    list->capacity = capacity;
+  }
+
+  entry = &list->entries[list->count++];
+  entry->pts = (pkt->pts != AV_NOPTS_VALUE) ? pkt->pts : pkt->dts;
+  entry->pos = pkt->pos;
+  entry->packet_no = packet_no;
+
+  return 0;
+}
+
+static int compare_entries(const void* a, const void* b)
+{
+  const SeekIndexEntry* entry1 = (const SeekIndexEntry*)a;
+  const SeekIndexEntry* entry2 = (const SeekIndexEntry*)b;
+
+  if(entry1->pts != entry2->pts)
+  {
+    return entry1->pts < entry2->pts ? -1 : 1;
+  }
+
+  return 0;
+}
+
+int seek_index_writer_save(SeekIndexWriter* writer, const char* index_path, const char* media_path)
+{
+  IndexHeader header;
+  IndexStream stream;
+  uint64_t first_entry = 0;
+  unsigned int index;
+  FILE* fp;
+  int ret = 0;
+
+  memset(&header, 0, sizeof(header));
+  header.magic = INDEX_MAGIC;
+  header.version = INDEX_VERSION;
+  header.nb_streams = writer->nb_streams;
+  if(stat_media(media_path, &header.media_size, &header.media_mtime) < 0)
+  {
+    return -1;
+  }
+
+  fp = fopen(index_path, "wb");
+  if(fp == NULL)
+  {
+    printf("Could not create index file %s\n", index_path);
+    return -2;
+  }
+
+  if(fwrite(&header, sizeof(header), 1, fp) != 1)
+  {
+    ret = -3;
+  }
+
+  for(index = 0; index < writer->nb_streams && ret == 0; index++)
+  {
+    EntryList* list = &writer->lists[index];
+    AVRational time_base = writer->fmt_ctx->streams[index]->time_base;
+
+    // Keyframes normally come in pts order, but B-pyramids and broken files may not.
+    qsort(list->entries, list->count, sizeof(SeekIndexEntry), compare_entries);
+
+    memset(&stream, 0, sizeof(stream));
+    stream.stream_index = index;
+    stream.time_base_num = time_base.num;
+    stream.time_base_den = time_base.den;
+    stream.nb_entries = list->count;
+    stream.first_entry = first_entry;
+    first_entry += list->count;
+
+    if(fwrite(&stream, sizeof(stream), 1, fp) != 1)
+    {
+      ret = -3;
+    }
+  } // for
+
+  for(index = 0; index < writer->nb_streams && ret == 0; index++)
+  {
+    EntryList* list = &writer->lists[index];
+    if(list->count > 0 && fwrite(list->entries, sizeof(SeekIndexEntry), list->count, fp) != list->count)
+    {
+      ret = -3;
+    }
+  } // for
+
+  if(fclose(fp) != 0 || ret < 0)
+  {
+    printf("Failed to write index file %s\n", index_path);
+    unlink(index_path);
+    return -3;
+  }
+
+  return 0;
+}
+
+void seek_index_writer_free(SeekIndexWriter** writer)
+{
+  unsigned int index;
+
+  if(*writer == NULL)
+  {
+    return;
+  }
+
+  for(index = 0; index < (*writer)->nb_streams; index++)
+  {
+    free((*writer)->lists[index].entries);
+  }
+
+  free((*writer)->lists);
+  free(*writer);
+  *writer = NULL;
+}
+
+SeekIndex* seek_index_open(const char* index_path, const char* media_path)
+{
+  const IndexHeader* header;
+  SeekIndex* index;
+  int64_t media_size, media_mtime;
+  uint64_t expected, max_entries, nb_entries = 0;
+  struct stat st;
+  unsigned int stream;
+  void* map;
+  int fd;
+
+  if(stat_media(media_path, &media_size, &media_mtime) < 0)
+  {
+    return NULL;
+  }
+
+  fd = open(index_path, O_RDONLY);
+  if(fd < 0)
+  {
+    return NULL;
+  }
+
+  if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(IndexHeader))
+  {
+    close(fd);
+    return NULL;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED)
+  {
+    return NULL;
+  }
+
+  header = (const IndexHeader*)map;
+  expected = sizeof(IndexHeader) + (uint64_t)header->nb_streams * sizeof(IndexStream);
+  if(header->magic != INDEX_MAGIC || header->version != INDEX_VERSION ||
+    header->media_size != media_size || header->media_mtime != media_mtime ||
+    expected > (uint64_t)st.st_size)
+  {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  // The entries that fit in the file bound every count below, so that
+  // neither the sum nor first_entry + nb_entries can wrap.
+  const IndexStream* streams = (const IndexStream*)((const uint8_t*)map + sizeof(IndexHeader));
+  max_entries = ((uint64_t)st.st_size - expected) / sizeof(SeekIndexEntry);
+  for(stream = 0; stream < header->nb_streams; stream++)
+  {
+    if(streams[stream].nb_entries > max_entries - nb_entries)
+    {
+      nb_entries = max_entries + 1;
+      break;
+    }
+    nb_entries += streams[stream].nb_entries;
+  } // for
+
+  if(nb_entries > max_entries || expected + nb_entries * sizeof(SeekIndexEntry) != (uint64_t)st.st_size)
+  {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  // A stale or damaged file of the right size may still point the entries
+  // of a stream outside the table.
+  for(stream = 0; stream < header->nb_streams; stream++)
+  {
+    if(streams[stream].first_entry > nb_entries ||
+      streams[stream].nb_entries > nb_entries - streams[stream].first_entry)
+    {
+      munmap(map, st.st_size);
+      return NULL;
+    }
+  } // for
+
+  index = calloc(1, sizeof(SeekIndex));
+  if(index == NULL)
+  {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  index->map = (uint8_t*)map;
+  index->map_size = st.st_size;
+  index->header = header;
+  index->streams = streams;
+  index->entries = (const SeekIndexEntry*)(streams + header->nb_streams);
+
+  return index;
+}
+
+int seek_index_entries(const SeekIndex* index, int stream_index)
+{
+  if(stream_index < 0 || (uint32_t)stream_index >= index->header->nb_streams)
+  {
+    return 0;
+  }
+
+  return (int)index->streams[stream_index].nb_entries;
+}
+
+// Returns the number of entries with pts <= ts.
+static uint32_t upper_bound(const SeekIndexEntry* entries, uint32_t count, int64_t ts)
+{
+  uint32_t low = 0, high = count;
+
+  while(low < high)
+  {
+    uint32_t middle = low + (high - low) / 2;
+    if(entries[middle].pts <= ts)
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
+  } // while
+
+  return low;
+}
+
+int seek_index_lookup(const SeekIndex* index, int stream_index, int64_t ts, SeekIndexEntry* entry)
+{
+  const SeekIndexEntry* entries;
+  uint32_t count, found;
+
+  count = seek_index_entries(index, stream_index);
+  if(count == 0)
+  {
+    return -1;
+  }
+
+  entries = index->entries + index->streams[stream_index].first_entry;
+  found = upper_bound(entries, count, ts);
+  *entry = entries[found > 0 ? found - 1 : 0];
+
+  return 0;
+}
+
+int seek_index_lookup_next(const SeekIndex* index, int stream_index, int64_t ts, SeekIndexEntry* entry)
+{
+  const SeekIndexEntry* entries;
+  uint32_t count, found;
+
+  count = seek_index_entries(index, stream_index);
+  if(count == 0)
+  {
+    return -1;
+  }
+
+  entries = index->entries + index->streams[stream_index].first_entry;
+  found = upper_bound(entries, count, ts - 1);
+  if(found == count)
+  {
+    return -2;
+  }
+
+  *entry = entries[found];
+  return 0;
+}
+
+int seek_index_seek(AVFormatContext* fmt_ctx, const SeekIndex* index, int stream_index,
+                    int64_t ts, SeekIndexEntry* entry)
+{
+  int flags = fmt_ctx->iformat->flags;
+
+  if(seek_index_lookup(index, stream_index, ts, entry) < 0)
+  {
+    return -1;
+  }
+
+  // Formats with timestamp discontinuities (MPEG-TS/PS) resync from any byte
+  // position. Seeking them by time makes the demuxer search by reading.
+  if(entry->pos >= 0 && !(flags & AVFMT_NO_BYTE_SEEK) && (flags & AVFMT_TS_DISCONT))
+  {
+    if(av_seek_frame(fmt_ctx, stream_index, entry->pos, AVSEEK_FLAG_BYTE) >= 0)
+    {
+      return 0;
+    }
+  }
+
+  if(av_seek_frame(fmt_ctx, stream_index, entry->pts, AVSEEK_FLAG_BACKWARD) < 0)
+  {
+    return -2;
+  }
+
+  return 0;
+}
+
+void seek_index_close(SeekIndex** index)
+{
+  if(*index == NULL)
+  {
+    return;
+  }
+
+  munmap((*index)->map, (*index)->map_size);
+  free(*index);
+  *index = NULL;
+}
@@ -0,0 +1,51 @@
+#ifndef SEEK_INDEX_H
+#define SEEK_INDEX_H
+
+#include <libavformat/avformat.h>
+
+// Sidecar keyframe index, stored next to the media file as <media>.kidx.
+// The file is used in place through mmap, a lookup is a binary search.
+
+typedef struct _SeekIndexEntry
+{
+  int64_t pts;
+  int64_t pos;
+  // Packet number within its stream, starting from 0.
+  int64_t packet_no;
+} SeekIndexEntry;
+
+typedef struct _SeekIndexWriter SeekIndexWriter;
+typedef struct _SeekIndex SeekIndex;
+
+void seek_index_path(const char* media_path, char* buf, size_t buf_size);
+
+SeekIndexWriter* seek_index_writer_alloc(AVFormatContext* fmt_ctx);
+
+// Records pkt if it is a keyframe. packet_no is counted by the caller.
+int seek_index_writer_add(SeekIndexWriter* writer, const AVPacket* pkt, int64_t packet_no);
+
+// media_path is used to store its size and mtime, so that a stale index is ignored.
+int seek_index_writer_save(SeekIndexWriter* writer, const char* index_path, const char* media_path);
+
+void seek_index_writer_free(SeekIndexWriter** writer);
+
+// Returns NULL if there is no index or it does not match media_path.
+SeekIndex* seek_index_open(const char* index_path, const char* media_path);
+
+int seek_index_entries(const SeekIndex* index, int stream_index);
+
+// Last keyframe with pts <= ts, or the first keyframe if there is none.
+int seek_index_lookup(const SeekIndex* index, int stream_index, int64_t ts, SeekIndexEntry* entry);
+
+// First keyframe with pts >= ts.
+int seek_index_lookup_next(const SeekIndex* index, int stream_index, int64_t ts, SeekIndexEntry* entry);
+
+// Seeks fmt_ctx to the keyframe found by seek_index_lookup(). Formats that
+// resync on their own are seeked by byte position, the others by the exact
+// keyframe timestamp.
+int seek_index_seek(AVFormatContext* fmt_ctx, const SeekIndex* index, int stream_index,
+                    int64_t ts, SeekIndexEntry* entry);
+
+void seek_index_close(SeekIndex** index);
+
+#endif
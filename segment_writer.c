@@ -0,0 +1,295 @@
+#include "segment_writer.h"
+
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+typedef struct _Segment
+{
+  char* name;
+  uint8_t* data;
+  int size;
+  double duration;
+} Segment;
+
+static void free_segment(Segment* segment)
+{
+  free(segment->name);
+  av_free(segment->data);
+  free(segment);
+}
+
+static int write_file(SegmentWriter* writer, const char* name, const uint8_t* data, int size)
+{
+  char path[4096];
+  ssize_t written;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/%s", writer->directory, name);
+
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0)
+  {
+    printf("Failed to create segment %s\n", path);
+    return -1;
+  }
+
+  while(size > 0)
+  {
+    written = write(fd, data, size);
+    if(written < 0)
+    {
+      if(errno == EINTR)
+      {
+        continue;
+      }
+
+      printf("Failed to write segment %s\n", path);
+      close(fd);
+      return -2;
+    }
+
+    data += written;
+    size -= (int)written;
+    writer->bytes_written += written;
+  } // while
+
+  // A segment listed in the playlist must be complete on disk.
+  fdatasync(fd);
+  close(fd);
+
+  return 0;
+}
+
+// Written to a temporary file and renamed, so that readers never see a
+// partial playlist.
+static int write_playlist(SegmentWriter* writer, int final)
+{
+  char tmp_path[4096];
+  double target_duration = writer->target_duration;
+  FILE* fp;
+  int index;
+
+  for(index = 0; index < writer->nb_segments; index++)
+  {
+    if(writer->durations[index] > target_duration)
+    {
+      target_duration = writer->durations[index];
+    }
+  } // for
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", writer->playlist_path);
+  fp = fopen(tmp_path, "w");
+  if(fp == NULL)
+  {
+    printf("Failed to create playlist %s\n", tmp_path);
+    return -1;
+  }
+
+  fprintf(fp, "#EXTM3U\n");
+  fprintf(fp, "#EXT-X-VERSION:%d\n", writer->init_name != NULL ? 7 : 3);
+  // Rounded up, no segment may be longer than the target duration.
+  fprintf(fp, "#EXT-X-TARGETDURATION:%d\n",
+    (int)target_duration + (target_duration > (int)target_duration));
+  fprintf(fp, "#EXT-X-MEDIA-SEQUENCE:0\n");
+  fprintf(fp, "#EXT-X-PLAYLIST-TYPE:%s\n", final ? "VOD" : "EVENT");
+  if(writer->init_name != NULL)
+  {
+    fprintf(fp, "#EXT-X-MAP:URI=\"%s\"\n", writer->init_name);
+  }
+
+  for(index = 0; index < writer->nb_segments; index++)
+  {
+    fprintf(fp, "#EXTINF:%.6f,\n%s\n", writer->durations[index], writer->names[index]);
+  }
+
+  if(final)
+  {
+    fprintf(fp, "#EXT-X-ENDLIST\n");
+  }
+
+  if(fclose(fp) != 0 || rename(tmp_path, writer->playlist_path) < 0)
+  {
+    printf("Failed to write playlist %s\n", writer->playlist_path);
+    return -2;
+  }
+
+  return 0;
+}
+
+static int add_entry(SegmentWriter* writer, Segment* segment)
+{
+  if(writer->nb_segments == writer->capacity)
+  {
+    int capacity = writer->capacity ? writer->capacity * 2 : 64;
+    char** names = realloc(writer->names, capacity * sizeof(char*));
+    if(names == NULL)
+    {
+      return -1;
+    }
+    writer->names = names;
+
+    double* durations = realloc(writer->durations, capacity * sizeof(double));
+    if(durations == NULL)
+    {
+      return -1;
+    }
+    writer->durations = durations;
+    writer->capacity = capacity;
+  }
+
+  // The entry keeps the name, the rest of the segment is freed.
+  writer->names[writer->nb_segments] = segment->name;
+  writer->durations[writer->nb_segments] = segment->duration;
+  writer->nb_segments++;
+  segment->name = NULL;
+
+  return 0;
+}
+
+static void* writer_thread(void* arg)
+{
+  SegmentWriter* writer = (SegmentWriter*)arg;
+  Segment* segment;
+  int64_t start_time;
+
+  while((segment = (Segment*)spsc_queue_pop(&writer->queue)) != NULL)
+  {
+    if(writer->error == 0)
+    {
+      start_time = av_gettime_relative();
+      writer->error = write_file(writer, segment->name, segment->data, segment->size);
+      writer->write_time += av_gettime_relative() - start_time;
+    }
+
+    if(writer->error == 0 && segment->duration >= 0)
+    {
+      if(add_entry(writer, segment) < 0)
+      {
+        writer->error = -3;
+      }
+      else
+      {
+        write_playlist(writer, 0);
+      }
+    }
+
+    free_segment(segment);
+  } // while
+
+  return NULL;
+}
+
+int segment_writer_start(SegmentWriter* writer, const char* playlist_path,
+                         double target_duration, uint32_t queue_size)
+{
+  const char* slash;
+
+  memset(writer, 0, sizeof(SegmentWriter));
+  writer->target_duration = target_duration;
+
+  slash = strrchr(playlist_path, '/');
+  writer->playlist_path = strdup(playlist_path);
+  writer->directory = (slash != NULL) ?
+    strndup(playlist_path, slash - playlist_path) : strdup(".");
+  if(writer->playlist_path == NULL || writer->directory == NULL)
+  {
+    return -1;
+  }
+
+  if(spsc_queue_init(&writer->queue, queue_size) < 0)
+  {
+    return -2;
+  }
+
+  if(pthread_create(&writer->thread, NULL, writer_thread, writer) != 0)
+  {
+    printf("Failed to start segment writer thread\n");
+    spsc_queue_uninit(&writer->queue);
+    return -3;
+  }
+
+  writer->started = 1;
+  return 0;
+}
+
+int segment_writer_submit(SegmentWriter* writer, const char* name,
+                          uint8_t* data, int size, double duration)
+{
+  Segment* segment;
+
+  segment = calloc(1, sizeof(Segment));
+  if(segment == NULL || (segment->name = strdup(name)) == NULL)
+  {
+    free(segment);
+    av_free(data);
+    return -1;
+  }
+
+  segment->data = data;
+  segment->size = size;
+  segment->duration = duration;
+
+  if(duration < 0)
+  {
+    // Only the writer thread reads init_name, and only after this push.
+    free(writer->init_name);
+    writer->init_name = strdup(name);
+  }
+
+  if(spsc_queue_push(&writer->queue, segment) < 0)
+  {
+    free_segment(segment);
+    return -2;
+  }
+
+  return 0;
+}
+
+int segment_writer_finish(SegmentWriter* writer)
+{
+  int started = writer->started;
+  int index;
+  int ret;
+
+  if(started)
+  {
+    spsc_queue_close(&writer->queue);
+    pthread_join(writer->thread, NULL);
+    spsc_queue_uninit(&writer->queue);
+    writer->started = 0;
+  }
+
+  ret = started ? writer->error : -1;
+  if(ret == 0)
+  {
+    ret = write_playlist(writer, 1);
+  }
+
+  for(index = 0; index < writer->nb_segments; index++)
+  {
+    free(writer->names[index]);
+  }
+  free(writer->names);
+  free(writer->durations);
+  free(writer->init_name);
+  free(writer->directory);
+  free(writer->playlist_path);
+  writer->names = NULL;
+  writer->durations = NULL;
+  writer->init_name = writer->directory = writer->playlist_path = NULL;
+
+  return ret;
+}
+
+void segment_writer_print_stats(SegmentWriter* writer)
+{
+  printf("segments : %d, %" PRId64 " bytes, %.3f ms writing on the writer thread\n",
+    writer->nb_segments, writer->bytes_written, writer->write_time / 1000.0);
+}
@@ -0,0 +1,52 @@
+#ifndef SEGMENT_WRITER_H
+#define SEGMENT_WRITER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "spsc_queue.h"
+
+// Writes finished segments and an HLS playlist on its own thread, so that
+// the muxing thread only hands over memory buffers. The playlist is
+// rewritten after every segment, so that players can start early.
+typedef struct _SegmentWriter
+{
+  char* directory;
+  char* playlist_path;
+  // Name of the fMP4 initialization segment, NULL for MPEG-TS.
+  char* init_name;
+  double target_duration;
+
+  SpscQueue queue;
+  pthread_t thread;
+  int started;
+
+  // Owned by the writer thread until segment_writer_finish() returns.
+  char** names;
+  double* durations;
+  int nb_segments;
+  int capacity;
+
+  int64_t bytes_written;
+  // Time spent in write() and fdatasync(), in microseconds.
+  int64_t write_time;
+  int error;
+} SegmentWriter;
+
+// Segments go to the directory of playlist_path.
+int segment_writer_start(SegmentWriter* writer, const char* playlist_path,
+                         double target_duration, uint32_t queue_size);
+
+// Takes ownership of data, which must come from av_malloc(), e.g. from
+// avio_close_dyn_buf(). A negative duration marks the initialization segment.
+// Waits only if queue_size segments are already pending.
+int segment_writer_submit(SegmentWriter* writer, const char* name,
+                          uint8_t* data, int size, double duration);
+
+// Writes the pending segments and the final playlist, and stops the thread.
+// Also releases a writer whose start failed.
+int segment_writer_finish(SegmentWriter* writer);
+
+void segment_writer_print_stats(SegmentWriter* writer);
+
+#endif
@@ -0,0 +1,181 @@
+#include "spsc_queue.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+
+int spsc_queue_init(SpscQueue* queue, uint32_t capacity)
+{
+  uint32_t size = 2;
+
+  while(size < capacity)
+  {
+    size <<= 1;
+  }
+
+  memset(queue, 0, sizeof(*queue));
+  queue->slots = calloc(size, sizeof(void*));
+  if(queue->slots == NULL)
+  {
+    return -1;
+  }
+
+  queue->capacity = size;
+  queue->mask = size - 1;
+  atomic_init(&queue->head, 0);
+  atomic_init(&queue->tail, 0);
+  atomic_init(&queue->closed, 0);
+  atomic_init(&queue->aborted, 0);
+
+  return 0;
+}
+
+void spsc_queue_uninit(SpscQueue* queue)
+{
+  free(queue->slots);
+  queue->slots = NULL;
+}
+
+int spsc_queue_try_push(SpscQueue* queue, void* item)
+{
+  uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+  uint32_t depth = tail - head;
+
+  if(depth == queue->capacity)
+  {
+    return -1;
+  }
+
+  queue->slots[tail & queue->mask] = item;
+  atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+
+  if(depth + 1 > queue->max_depth)
+  {
+    queue->max_depth = depth + 1;
+  }
+
+  return 0;
+}
+
+void* spsc_queue_try_pop(SpscQueue* queue)
+{
+  uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+  void* item;
+
+  if(head == tail)
+  {
+    return NULL;
+  }
+
+  item = queue->slots[head & queue->mask];
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+
+  return item;
+}
+
+// Yield a few times, then sleep from 50 us up to 0.8 ms between retries.
+static void backoff(int* round)
+{
+  struct timespec delay;
+
+  if(*round < 16)
+  {
+    sched_yield();
+  }
+  else
+  {
+    int shift = (*round - 16 < 4) ? *round - 16 : 4;
+    delay.tv_sec = 0;
+    delay.tv_nsec = 50000L << shift;
+    nanosleep(&delay, NULL);
+  }
+
+  (*round)++;
+}
+
+int spsc_queue_push(SpscQueue* queue, void* item)
+{
+  int round = 0;
+
+  while(spsc_queue_try_push(queue, item) < 0)
+  {
+    if(atomic_load_explicit(&queue->aborted, memory_order_acquire))
+    {
+      return -1;
+    }
+
+    if(round == 0)
+    {
+      queue->push_stalls++;
+    }
+
+    backoff(&round);
+  } // while
+
+  return 0;
+}
+
+void* spsc_queue_pop(SpscQueue* queue)
+{
+  int round = 0;
+  void* item;
+
+  while((item = spsc_queue_try_pop(queue)) == NULL)
+  {
+    if(atomic_load_explicit(&queue->aborted, memory_order_acquire))
+    {
+      return NULL;
+    }
+
+    // Check closed before the last try, a push may land in between.
+    if(atomic_load_explicit(&queue->closed, memory_order_acquire))
+    {
+      return spsc_queue_try_pop(queue);
+    }
+
+    if(round == 0)
+    {
+      queue->pop_stalls++;
+    }
+
+    backoff(&round);
+  } // while
+
+  return item;
+}
+
+void spsc_queue_close(SpscQueue* queue)
+{
+  atomic_store_explicit(&queue->closed, 1, memory_order_release);
+}
+
+void spsc_queue_abort(SpscQueue* queue)
+{
+  atomic_store_explicit(&queue->aborted, 1, memory_order_release);
+}
+
+int spsc_queue_done(SpscQueue* queue)
+{
+  if(atomic_load_explicit(&queue->aborted, memory_order_acquire))
+  {
+    return 1;
+  }
+
+  // Closed is checked first, every push before the close is visible then.
+  if(!atomic_load_explicit(&queue->closed, memory_order_acquire))
+  {
+    return 0;
+  }
+
+  return atomic_load_explicit(&queue->head, memory_order_relaxed) ==
+    atomic_load_explicit(&queue->tail, memory_order_acquire);
+}
+
+uint32_t spsc_queue_depth(SpscQueue* queue)
+{
+  return atomic_load_explicit(&queue->tail, memory_order_acquire) -
+    atomic_load_explicit(&queue->head, memory_order_acquire);
+}
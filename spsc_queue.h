@@ -0,0 +1,66 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Bounded lock-free queue of pointers for exactly one producer thread and
+// one consumer thread. The blocking calls back off with short sleeps, they
+// never take a lock.
+
+#define SPSC_CACHE_LINE 64
+
+typedef struct _SpscQueue
+{
+  void** slots;
+  uint32_t capacity;
+  uint32_t mask;
+
+  // Padding keeps the consumer and producer fields on separate cache lines.
+  char pad0[SPSC_CACHE_LINE];
+
+  // Written by the consumer only.
+  _Atomic uint32_t head;
+  uint64_t pop_stalls;
+
+  char pad1[SPSC_CACHE_LINE];
+
+  // Written by the producer only.
+  _Atomic uint32_t tail;
+  uint64_t push_stalls;
+  uint32_t max_depth;
+
+  char pad2[SPSC_CACHE_LINE];
+
+  _Atomic int closed;
+  _Atomic int aborted;
+} SpscQueue;
+
+// capacity is rounded up to a power of two.
+int spsc_queue_init(SpscQueue* queue, uint32_t capacity);
+void spsc_queue_uninit(SpscQueue* queue);
+
+// Non-blocking. Return -1 when full, or NULL when empty.
+int spsc_queue_try_push(SpscQueue* queue, void* item);
+void* spsc_queue_try_pop(SpscQueue* queue);
+
+// Waits while the queue is full. Returns -1 if the consumer aborted.
+int spsc_queue_push(SpscQueue* queue, void* item);
+
+// Waits while the queue is empty. Returns NULL once the producer closed
+// the queue and everything was popped, or when the queue was aborted.
+void* spsc_queue_pop(SpscQueue* queue);
+
+// Producer side: no more items will be pushed.
+void spsc_queue_close(SpscQueue* queue);
+
+// Either side: stop waiting, the other side is gone.
+void spsc_queue_abort(SpscQueue* queue);
+
+// Consumer side, for polling with spsc_queue_try_pop(): the producer closed
+// the queue and everything was popped, or the queue was aborted.
+int spsc_queue_done(SpscQueue* queue);
+
+uint32_t spsc_queue_depth(SpscQueue* queue);
+
+#endif
@@ -0,0 +1,456 @@
+// O_DIRECT
+#define _GNU_SOURCE
+
+#include "writebehind_io.h"
+
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+#include <libavutil/error.h>
+#include <libavutil/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// Size of the buffer handed to avio_alloc_context().
+#define WRITEBEHIND_IO_BUFFER_SIZE (64 * 1024)
+// Alignment of memory, offset and size required by O_DIRECT.
+#define WRITEBEHIND_IO_ALIGN 4096
+
+typedef struct _WritebehindBlock
+{
+  uint8_t* data;
+  int64_t pos;
+  int size;
+} WritebehindBlock;
+
+typedef struct _WritebehindFile
+{
+  int fd;
+  // Second descriptor opened with O_DIRECT, -1 if not used.
+  int direct_fd;
+  int flags;
+
+  WritebehindBlock* blocks;
+  int nb_blocks;
+  int block_size;
+
+  // The blocks from head to head + count - 1 are queued for the writer
+  // thread, in submission order. The block at fill belongs to the caller.
+  int head;
+  int count;
+  int fill;
+  int error;
+  int abort;
+
+  // Logical position of the caller, and the end of the file so far.
+  int64_t pos;
+  int64_t end;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  pthread_t thread;
+  int thread_started;
+
+  WritebehindStats stats;
+} WritebehindFile;
+
+static int write_block(WritebehindFile* file, const WritebehindBlock* block, int* direct)
+{
+  const uint8_t* data = block->data;
+  int64_t pos = block->pos;
+  int size = block->size;
+  ssize_t written;
+  int fd = file->fd;
+
+  *direct = (file->direct_fd >= 0 &&
+    pos % WRITEBEHIND_IO_ALIGN == 0 && size % WRITEBEHIND_IO_ALIGN == 0);
+  if(*direct)
+  {
+    fd = file->direct_fd;
+  }
+
+  while(size > 0)
+  {
+    written = pwrite(fd, data, size, pos);
+    if(written < 0)
+    {
+      if(errno == EINTR)
+      {
+        continue;
+      }
+      return AVERROR(errno);
+    }
+
+    data += written;
+    pos += written;
+    size -= (int)written;
+  } // while
+
+  if((file->flags & WRITEBEHIND_IO_SYNC_BLOCKS) && fdatasync(fd) < 0)
+  {
+    return AVERROR(errno);
+  }
+
+  return 0;
+}
+
+static void* writer_thread(void* arg)
+{
+  WritebehindFile* file = (WritebehindFile*)arg;
+  WritebehindBlock* block;
+  int64_t start_time;
+  int error, direct;
+  int ret = 0;
+
+  pthread_mutex_lock(&file->mutex);
+  while(1)
+  {
+    if(file->count == 0)
+    {
+      // Queued blocks are always written before the thread stops.
+      if(file->abort)
+      {
+        break;
+      }
+      pthread_cond_wait(&file->cond, &file->mutex);
+      continue;
+    }
+
+    block = &file->blocks[file->head];
+    error = file->error;
+
+    // The caller does not touch a queued block.
+    pthread_mutex_unlock(&file->mutex);
+    direct = 0;
+    if(error == 0)
+    {
+      start_time = av_gettime_relative();
+      ret = write_block(file, block, &direct);
+      start_time = av_gettime_relative() - start_time;
+    }
+    pthread_mutex_lock(&file->mutex);
+
+    if(error == 0)
+    {
+      file->stats.write_time += start_time;
+      if(ret < 0)
+      {
+        file->error = ret;
+      }
+      else
+      {
+        file->stats.blocks++;
+        file->stats.direct_blocks += direct;
+        file->stats.bytes_written += block->size;
+      }
+    }
+
+    file->head = (file->head + 1) % file->nb_blocks;
+    file->count--;
+    pthread_cond_broadcast(&file->cond);
+  } // while
+  pthread_mutex_unlock(&file->mutex);
+
+  return NULL;
+}
+
+// Queues the block being filled and waits until the next one is free.
+static int submit_block(WritebehindFile* file)
+{
+  int64_t wait_start;
+  int ret;
+
+  pthread_mutex_lock(&file->mutex);
+  file->count++;
+  file->fill = (file->fill + 1) % file->nb_blocks;
+  pthread_cond_broadcast(&file->cond);
+
+  if(file->count == file->nb_blocks)
+  {
+    wait_start = av_gettime_relative();
+    while(file->count == file->nb_blocks)
+    {
+      pthread_cond_wait(&file->cond, &file->mutex);
+    } // while
+    file->stats.wait_time += av_gettime_relative() - wait_start;
+  }
+
+  ret = file->error;
+  pthread_mutex_unlock(&file->mutex);
+
+  file->blocks[file->fill].size = 0;
+  return ret;
+}
+
+static int writebehind_write_packet(void* opaque, uint8_t* buf, int buf_size)
+{
+  WritebehindFile* file = (WritebehindFile*)opaque;
+  WritebehindBlock* block;
+  int size = buf_size;
+  int ret, length;
+
+  while(size > 0)
+  {
+    block = &file->blocks[file->fill];
+
+    // After a seek the data continues in a block of its own.
+    if(block->size > 0 && file->pos != block->pos + block->size)
+    {
+      ret = submit_block(file);
+      if(ret < 0)
+      {
+        return ret;
+      }
+      continue;
+    }
+
+    if(block->size == 0)
+    {
+      block->pos = file->pos;
+    }
+
+    length = FFMIN(size, file->block_size - block->size);
+    memcpy(block->data + block->size, buf, length);
+    block->size += length;
+    file->pos += length;
+    file->end = FFMAX(file->end, file->pos);
+    buf += length;
+    size -= length;
+
+    if(block->size == file->block_size)
+    {
+      ret = submit_block(file);
+      if(ret < 0)
+      {
+        return ret;
+      }
+    }
+  } // while
+
+  return buf_size;
+}
+
+// AVIOContext flushes its own buffer before it calls this.
+static int64_t writebehind_seek(void* opaque, int64_t offset, int whence)
+{
+  WritebehindFile* file = (WritebehindFile*)opaque;
+  int64_t pos;
+
+  switch(whence & ~AVSEEK_FORCE)
+  {
+  case AVSEEK_SIZE:
+    return file->end;
+  case SEEK_SET:
+    pos = offset;
+    break;
+  case SEEK_CUR:
+    pos = file->pos + offset;
+    break;
+  case SEEK_END:
+    pos = file->end + offset;
+    break;
+  default:
+    return AVERROR(EINVAL);
+  }
+
+  if(pos < 0)
+  {
+    return AVERROR(EINVAL);
+  }
+
+  file->pos = pos;
+  return pos;
+}
+
+// The thread writes the queued blocks before it stops.
+static void stop_thread(WritebehindFile* file)
+{
+  if(file->thread_started)
+  {
+    pthread_mutex_lock(&file->mutex);
+    file->abort = 1;
+    pthread_cond_broadcast(&file->cond);
+    pthread_mutex_unlock(&file->mutex);
+
+    pthread_join(file->thread, NULL);
+    file->thread_started = 0;
+  }
+}
+
+static void free_file(WritebehindFile* file)
+{
+  int index;
+
+  stop_thread(file);
+
+  if(file->blocks != NULL)
+  {
+    for(index = 0; index < file->nb_blocks; index++)
+    {
+      free(file->blocks[index].data);
+    }
+    av_free(file->blocks);
+  }
+
+  pthread_mutex_destroy(&file->mutex);
+  pthread_cond_destroy(&file->cond);
+
+  if(file->direct_fd >= 0)
+  {
+    close(file->direct_fd);
+  }
+
+  if(file->fd >= 0)
+  {
+    close(file->fd);
+  }
+
+  av_free(file);
+}
+
+int writebehind_io_open(AVIOContext** pb, const char* filename, int nb_blocks, int block_size, int flags)
+{
+  WritebehindFile* file;
+  uint8_t* buffer;
+  void* data;
+  int index;
+  int fd;
+
+  if(nb_blocks < 2 || block_size < WRITEBEHIND_IO_BUFFER_SIZE ||
+    block_size % WRITEBEHIND_IO_ALIGN != 0)
+  {
+    return AVERROR(EINVAL);
+  }
+
+  fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0)
+  {
+    return AVERROR(errno);
+  }
+
+  file = av_mallocz(sizeof(WritebehindFile));
+  if(file == NULL)
+  {
+    close(fd);
+    return AVERROR(ENOMEM);
+  }
+
+  file->fd = fd;
+  file->direct_fd = -1;
+  file->flags = flags;
+  file->nb_blocks = nb_blocks;
+  file->block_size = block_size;
+  pthread_mutex_init(&file->mutex, NULL);
+  pthread_cond_init(&file->cond, NULL);
+
+  if(flags & WRITEBEHIND_IO_DIRECT)
+  {
+    // Not every file system supports it, e.g. tmpfs. Buffered writes still work.
+    file->direct_fd = open(filename, O_WRONLY | O_DIRECT);
+    if(file->direct_fd < 0)
+    {
+      printf("O_DIRECT is not available for %s, using buffered writes\n", filename);
+    }
+  }
+
+  file->blocks = av_calloc(nb_blocks, sizeof(WritebehindBlock));
+  if(file->blocks == NULL)
+  {
+    free_file(file);
+    return AVERROR(ENOMEM);
+  }
+
+  for(index = 0; index < nb_blocks; index++)
+  {
+    if(posix_memalign(&data, WRITEBEHIND_IO_ALIGN, block_size) != 0)
+    {
+      free_file(file);
+      return AVERROR(ENOMEM);
+    }
+    file->blocks[index].data = data;
+  } // for
+
+  if(pthread_create(&file->thread, NULL, writer_thread, file) != 0)
+  {
+    free_file(file);
+    return AVERROR(EAGAIN);
+  }
+  file->thread_started = 1;
+
+  buffer = av_malloc(WRITEBEHIND_IO_BUFFER_SIZE);
+  if(buffer == NULL)
+  {
+    free_file(file);
+    return AVERROR(ENOMEM);
+  }
+
+  *pb = avio_alloc_context(buffer, WRITEBEHIND_IO_BUFFER_SIZE, 1, file,
+    NULL, writebehind_write_packet, writebehind_seek);
+  if(*pb == NULL)
+  {
+    av_free(buffer);
+    free_file(file);
+    return AVERROR(ENOMEM);
+  }
+
+  return 0;
+}
+
+int writebehind_io_close(AVIOContext** pb)
+{
+  WritebehindFile* file;
+  int ret;
+
+  if(*pb == NULL)
+  {
+    return 0;
+  }
+
+  file = (WritebehindFile*)(*pb)->opaque;
+
+  avio_flush(*pb);
+  if(file->blocks[file->fill].size > 0)
+  {
+    submit_block(file);
+  }
+
+  stop_thread(file);
+
+  ret = file->error;
+  if(ret == 0 && (file->flags & WRITEBEHIND_IO_SYNC_CLOSE) && fdatasync(file->fd) < 0)
+  {
+    ret = AVERROR(errno);
+  }
+
+  free_file(file);
+
+  // The buffer may have been reallocated by libavformat, free the current one.
+  av_freep(&(*pb)->buffer);
+  avio_context_free(pb);
+
+  return ret;
+}
+
+void writebehind_io_get_stats(AVIOContext* pb, WritebehindStats* stats)
+{
+  WritebehindFile* file = (WritebehindFile*)pb->opaque;
+
+  pthread_mutex_lock(&file->mutex);
+  *stats = file->stats;
+  pthread_mutex_unlock(&file->mutex);
+}
+
+void writebehind_io_print_stats(AVIOContext* pb)
+{
+  WritebehindStats stats;
+
+  writebehind_io_get_stats(pb, &stats);
+
+  printf("writebehind : %" PRId64 " blocks (%" PRId64 " direct), %" PRId64 " bytes, %.3f ms writing, %.3f ms waited\n",
+    stats.blocks, stats.direct_blocks, stats.bytes_written,
+    stats.write_time / 1000.0, stats.wait_time / 1000.0);
+}
@@ -0,0 +1,38 @@
+#ifndef WRITEBEHIND_IO_H
+#define WRITEBEHIND_IO_H
+
+#include <libavformat/avio.h>
+
+// Open flags.
+// Writes whole aligned blocks with O_DIRECT, bypassing the page cache.
+// Blocks that are not aligned, e.g. after a seek, still go through it.
+#define WRITEBEHIND_IO_DIRECT      0x1
+// fdatasync() once when the file is closed.
+#define WRITEBEHIND_IO_SYNC_CLOSE  0x2
+// fdatasync() after every block, so that dirty pages never pile up.
+#define WRITEBEHIND_IO_SYNC_BLOCKS 0x4
+
+typedef struct _WritebehindStats
+{
+  int64_t blocks;
+  int64_t direct_blocks;
+  int64_t bytes_written;
+  // Time the muxing thread waited for a free block, in microseconds.
+  int64_t wait_time;
+  // Time spent in pwrite() and fdatasync() on the writer thread.
+  int64_t write_time;
+} WritebehindStats;
+
+// Creates filename behind a write-only, seekable AVIOContext. Muxed data is
+// collected in nb_blocks buffers of block_size bytes, a full buffer is written
+// by a background thread while the muxer fills the next one.
+int writebehind_io_open(AVIOContext** pb, const char* filename, int nb_blocks, int block_size, int flags);
+
+// Writes what is left and returns the first write error, if any.
+int writebehind_io_close(AVIOContext** pb);
+
+void writebehind_io_get_stats(AVIOContext* pb, WritebehindStats* stats);
+
+void writebehind_io_print_stats(AVIOContext* pb);
+
+#endif